@@ -209,6 +209,7 @@ int fwk_ec_register(struct fwk_ec_device *ec_dev)
 	ec_dev->ec = NULL;
 	ec_dev->pd = NULL;
 	ec_dev->suspend_timeout_ms = EC_HOST_SLEEP_TIMEOUT_DEFAULT;
+	ec_dev->charge_ttl_ms = FWK_EC_CHARGE_TTL_MS_DEFAULT;
 
 	ec_dev->din = devm_kzalloc(dev, ec_dev->din_size, GFP_KERNEL);
 	if (!ec_dev->din)
@@ -226,6 +227,7 @@ int fwk_ec_register(struct fwk_ec_device *ec_dev)
 	lockdep_register_key(&ec_dev->lockdep_key);
 	mutex_init(&ec_dev->lock);
 	lockdep_set_class(&ec_dev->lock, &ec_dev->lockdep_key);
+	fwk_ec_init_features(ec_dev);
 
 	err = fwk_ec_query_all(ec_dev);
 	if (err) {
@@ -0,0 +1,330 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * IIO driver for the ADC channels of the ChromeOS EC
+ *
+ * EC_CMD_ADC_READ reads a single channel. A scan of several channels sends
+ * those reads back to back in one EC lock session, so that the samples are
+ * close in time and no other EC traffic gets in between, and the whole scan
+ * gets one timestamp, taken in the middle of it.
+ *
+ * Buffered capture runs the scan sampling_frequency times a second, from a
+ * work item; the EC does not have any ADC FIFO or trigger of its own.
+ */
+
+#include <linux/bitops.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/kfifo_buf.h>
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <fwk_ec_commands.h>
+#include <fwk_ec_proto.h>
+#include <linux/platform_device.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#define DRV_NAME	"fwk-ec-adc"
+
+/* Highest number of ADC channels looked for on the EC. */
+#define FWK_EC_ADC_MAX_CHANNELS		16
+
+#define FWK_EC_ADC_DEFAULT_FREQ		10
+#define FWK_EC_ADC_MAX_FREQ		1000
+
+/**
+ * struct fwk_ec_adc - ADC driver data.
+ * @indio_dev: IIO device.
+ * @ec: EC device the ADC belongs to.
+ * @num_channels: Number of ADC channels of the EC.
+ * @lock: Protects @freq.
+ * @freq: Buffered capture rate, in Hz.
+ * @work: Runs the scans of buffered capture.
+ * @next: Jiffies when the next scan is due.
+ * @scan: Samples of the last scan, as pushed to the buffer.
+ */
+struct fwk_ec_adc {
+	struct iio_dev *indio_dev;
+	struct fwk_ec_dev *ec;
+	int num_channels;
+	struct mutex lock;
+	unsigned int freq;
+	struct delayed_work work;
+	unsigned long next;
+	struct {
+		s32 values[FWK_EC_ADC_MAX_CHANNELS];
+		s64 timestamp __aligned(8);
+	} scan;
+};
+
+static int fwk_ec_adc_read_locked(struct fwk_ec_adc *adc, int channel,
+				  s32 *value)
+{
+	struct fwk_ec_dev *ec = adc->ec;
+	struct ec_params_adc_read params = {
+		.adc_channel = channel,
+	};
+	struct ec_response_adc_read resp;
+	int ret;
+
+	ret = fwk_ec_cmd_locked(ec->ec_dev, 0, EC_CMD_ADC_READ + ec->cmd_offset,
+				&params, sizeof(params), &resp, sizeof(resp));
+	if (ret < 0)
+		return ret;
+
+	*value = resp.adc_value;
+
+	return 0;
+}
+
+/*
+ * Read the channels of @mask in one EC lock session. The samples are
+ * stored in @values in channel order, one after the other.
+ */
+static int fwk_ec_adc_scan(struct iio_dev *indio_dev, const unsigned long *mask,
+			   s32 *values, s64 *timestamp)
+{
+	struct fwk_ec_adc *adc = iio_priv(indio_dev);
+	struct fwk_ec_device *ec_dev = adc->ec->ec_dev;
+	s64 before, after;
+	int channel, ret;
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	before = iio_get_time_ns(indio_dev);
+
+	for_each_set_bit(channel, mask, adc->num_channels) {
+		ret = fwk_ec_adc_read_locked(adc, channel, values++);
+		if (ret < 0)
+			break;
+	}
+
+	after = iio_get_time_ns(indio_dev);
+
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	if (timestamp)
+		*timestamp = before + ((after - before) >> 1);
+
+	return ret < 0 ? ret : 0;
+}
+
+static void fwk_ec_adc_scan_work(struct work_struct *work)
+{
+	struct fwk_ec_adc *adc = container_of(to_delayed_work(work),
+					      struct fwk_ec_adc, work);
+	struct iio_dev *indio_dev = adc->indio_dev;
+	unsigned long period;
+	int ret;
+
+	ret = fwk_ec_adc_scan(indio_dev, indio_dev->active_scan_mask,
+			      adc->scan.values, &adc->scan.timestamp);
+	if (ret)
+		dev_warn_ratelimited(&indio_dev->dev, "scan failed: %d\n", ret);
+	else
+		iio_push_to_buffers_with_timestamp(indio_dev, &adc->scan,
+						   adc->scan.timestamp);
+
+	mutex_lock(&adc->lock);
+	period = max_t(unsigned long, HZ / adc->freq, 1);
+	mutex_unlock(&adc->lock);
+
+	/* Keep to the schedule, unless this scan made us late. */
+	adc->next += period;
+	if (time_after(jiffies, adc->next))
+		adc->next = jiffies;
+
+	schedule_delayed_work(&adc->work, adc->next - jiffies);
+}
+
+static int fwk_ec_adc_read_raw(struct iio_dev *indio_dev,
+			       struct iio_chan_spec const *chan,
+			       int *val, int *val2, long mask)
+{
+	struct fwk_ec_adc *adc = iio_priv(indio_dev);
+	unsigned long channel_mask = BIT(chan->channel);
+	s32 value;
+	int ret;
+
+	switch (mask) {
+	case IIO_CHAN_INFO_RAW:
+		ret = fwk_ec_adc_scan(indio_dev, &channel_mask, &value, NULL);
+		if (ret)
+			return ret;
+		*val = value;
+		return IIO_VAL_INT;
+	case IIO_CHAN_INFO_SCALE:
+		/* The EC scales the readings to mV itself. */
+		*val = 1;
+		return IIO_VAL_INT;
+	case IIO_CHAN_INFO_SAMP_FREQ:
+		mutex_lock(&adc->lock);
+		*val = adc->freq;
+		mutex_unlock(&adc->lock);
+		return IIO_VAL_INT;
+	default:
+		return -EINVAL;
+	}
+}
+
+static int fwk_ec_adc_write_raw(struct iio_dev *indio_dev,
+				struct iio_chan_spec const *chan,
+				int val, int val2, long mask)
+{
+	struct fwk_ec_adc *adc = iio_priv(indio_dev);
+
+	switch (mask) {
+	case IIO_CHAN_INFO_SAMP_FREQ:
+		if (val <= 0 || val > FWK_EC_ADC_MAX_FREQ || val2)
+			return -EINVAL;
+		mutex_lock(&adc->lock);
+		adc->freq = val;
+		mutex_unlock(&adc->lock);
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+static const struct iio_info fwk_ec_adc_info = {
+	.read_raw = fwk_ec_adc_read_raw,
+	.write_raw = fwk_ec_adc_write_raw,
+};
+
+static int fwk_ec_adc_buffer_postenable(struct iio_dev *indio_dev)
+{
+	struct fwk_ec_adc *adc = iio_priv(indio_dev);
+
+	adc->next = jiffies;
+	schedule_delayed_work(&adc->work, 0);
+
+	return 0;
+}
+
+static int fwk_ec_adc_buffer_predisable(struct iio_dev *indio_dev)
+{
+	struct fwk_ec_adc *adc = iio_priv(indio_dev);
+
+	cancel_delayed_work_sync(&adc->work);
+
+	return 0;
+}
+
+static const struct iio_buffer_setup_ops fwk_ec_adc_buffer_ops = {
+	.postenable = fwk_ec_adc_buffer_postenable,
+	.predisable = fwk_ec_adc_buffer_predisable,
+};
+
+/*
+ * The EC rejects the channels it doesn't have with EC_RES_INVALID_PARAM,
+ * count them by reading them all in one lock session.
+ */
+static int fwk_ec_adc_count_channels(struct fwk_ec_adc *adc)
+{
+	struct fwk_ec_device *ec_dev = adc->ec->ec_dev;
+	int channel, ret;
+	s32 value;
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	for (channel = 0; channel < FWK_EC_ADC_MAX_CHANNELS; channel++) {
+		ret = fwk_ec_adc_read_locked(adc, channel, &value);
+		if (ret < 0)
+			break;
+	}
+
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	if (ret == -EOPNOTSUPP)
+		return -ENODEV;
+	if (ret < 0 && ret != -EINVAL)
+		return ret;
+
+	return channel;
+}
+
+static int fwk_ec_adc_probe(struct platform_device *pdev)
+{
+	struct device *dev = &pdev->dev;
+	struct fwk_ec_dev *ec = dev_get_drvdata(dev->parent);
+	struct iio_chan_spec *channels;
+	struct iio_dev *indio_dev;
+	struct fwk_ec_adc *adc;
+	int i, ret;
+
+	indio_dev = devm_iio_device_alloc(dev, sizeof(*adc));
+	if (!indio_dev)
+		return -ENOMEM;
+
+	adc = iio_priv(indio_dev);
+	adc->indio_dev = indio_dev;
+	adc->ec = ec;
+	adc->freq = FWK_EC_ADC_DEFAULT_FREQ;
+	mutex_init(&adc->lock);
+	INIT_DELAYED_WORK(&adc->work, fwk_ec_adc_scan_work);
+
+	ret = fwk_ec_adc_count_channels(adc);
+	if (ret < 0)
+		return ret;
+	if (!ret)
+		return -ENODEV;
+	adc->num_channels = ret;
+
+	/* One more for the timestamp. */
+	channels = devm_kcalloc(dev, adc->num_channels + 1, sizeof(*channels),
+				GFP_KERNEL);
+	if (!channels)
+		return -ENOMEM;
+
+	for (i = 0; i < adc->num_channels; i++) {
+		channels[i].type = IIO_VOLTAGE;
+		channels[i].indexed = 1;
+		channels[i].channel = i;
+		channels[i].scan_index = i;
+		channels[i].info_mask_separate = BIT(IIO_CHAN_INFO_RAW);
+		channels[i].info_mask_shared_by_all =
+			BIT(IIO_CHAN_INFO_SCALE) | BIT(IIO_CHAN_INFO_SAMP_FREQ);
+		channels[i].scan_type.sign = 's';
+		channels[i].scan_type.realbits = 32;
+		channels[i].scan_type.storagebits = 32;
+		channels[i].scan_type.endianness = IIO_CPU;
+	}
+	channels[i] = (struct iio_chan_spec)IIO_CHAN_SOFT_TIMESTAMP(i);
+
+	indio_dev->name = DRV_NAME;
+	indio_dev->info = &fwk_ec_adc_info;
+	indio_dev->modes = INDIO_DIRECT_MODE;
+	indio_dev->channels = channels;
+	indio_dev->num_channels = adc->num_channels + 1;
+
+	ret = devm_iio_kfifo_buffer_setup(dev, indio_dev,
+					  &fwk_ec_adc_buffer_ops);
+	if (ret)
+		return ret;
+
+	return devm_iio_device_register(dev, indio_dev);
+}
+
+static const struct platform_device_id fwk_ec_adc_id[] = {
+	{ DRV_NAME, 0 },
+	{}
+};
+MODULE_DEVICE_TABLE(platform, fwk_ec_adc_id);
+
+static struct platform_driver fwk_ec_adc_driver = {
+	.driver = {
+		.name = DRV_NAME,
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
+	.probe = fwk_ec_adc_probe,
+	.id_table = fwk_ec_adc_id,
+};
+module_platform_driver(fwk_ec_adc_driver);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("ChromeOS EC ADC driver");
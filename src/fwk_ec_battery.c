@@ -0,0 +1,807 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Battery driver for the ChromeOS EC
+ *
+ * The EC publishes the state of the battery in the memory-mapped region
+ * (EC_MEMMAP_BATT_*). The whole battery block is read in one burst when the
+ * EC reports a battery related host event, or on a slow poll, and
+ * power_supply_changed() is only signalled when something actually changed.
+ * Property reads are served from the cached copy and never touch the bus.
+ *
+ * The memory map only holds one battery. The others are read with
+ * EC_CMD_BATTERY_GET_STATIC and EC_CMD_BATTERY_GET_DYNAMIC, and cached per
+ * battery index: the static info until a battery event, as it only changes
+ * with the battery, and the dynamic info until the EC updates the memory
+ * map, which it does once per battery poll, or until our own poll. The
+ * memory map does not change while the battery in it is idle, so the other
+ * batteries are polled on their own.
+ *
+ * Nothing is registered when ACPI already exposes the batteries.
+ */
+
+#include <linux/acpi.h>
+#include <linux/device.h>
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/notifier.h>
+#include <fwk_ec_commands.h>
+#include <fwk_ec_proto.h>
+#include <linux/platform_device.h>
+#include <linux/power_supply.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/workqueue.h>
+#include <asm/unaligned.h>
+
+#define DRV_NAME	"fwk-ec-battery"
+
+/* The ACPI battery, exposing the same packs as the EC on Framework boards. */
+#define FWK_EC_BATTERY_ACPI_HID	"PNP0C0A"
+
+/*
+ * Poll the memory map this often in case the EC does not report battery
+ * host events to us (e.g. no MKBP support).
+ */
+#define FWK_EC_BATTERY_POLL_MS	5000
+
+/* The battery block of the memory map: EC_MEMMAP_BATT_VOLT..BATT_TYPE */
+#define FWK_EC_BATTERY_MAP_START	EC_MEMMAP_BATT_VOLT
+#define FWK_EC_BATTERY_MAP_SIZE		(EC_MEMMAP_BATT_TYPE + \
+					 EC_MEMMAP_TEXT_MAX - \
+					 EC_MEMMAP_BATT_VOLT)
+#define FWK_EC_BATTERY_MAP(offset)	((offset) - FWK_EC_BATTERY_MAP_START)
+
+/* Highest number of batteries handled. */
+#define FWK_EC_BATTERY_MAX	4
+
+#define FWK_EC_BATTERY_HOST_EVENTS \
+	(EC_HOST_EVENT_MASK(EC_HOST_EVENT_AC_CONNECTED) | \
+	 EC_HOST_EVENT_MASK(EC_HOST_EVENT_AC_DISCONNECTED) | \
+	 EC_HOST_EVENT_MASK(EC_HOST_EVENT_BATTERY_LOW) | \
+	 EC_HOST_EVENT_MASK(EC_HOST_EVENT_BATTERY_CRITICAL) | \
+	 EC_HOST_EVENT_MASK(EC_HOST_EVENT_BATTERY) | \
+	 EC_HOST_EVENT_MASK(EC_HOST_EVENT_BATTERY_STATUS))
+
+/**
+ * struct fwk_ec_battery_state - Battery values, as reported by the EC.
+ * @voltage: Present voltage (mV).
+ * @current_now: Present current (mA), negative when discharging.
+ * @remaining_capacity: Remaining capacity (mAh).
+ * @full_capacity: Last full charge capacity (mAh).
+ * @flags: EC_BATT_FLAG_*.
+ * @design_capacity: Design capacity (mAh).
+ * @design_voltage: Design voltage (mV).
+ * @cycle_count: Cycle count.
+ * @manufacturer: Manufacturer string.
+ * @model_name: Model string.
+ * @serial_number: Serial number string.
+ * @type: Battery type string.
+ */
+struct fwk_ec_battery_state {
+	int voltage;
+	int current_now;
+	int remaining_capacity;
+	int full_capacity;
+	u8 flags;
+	int design_capacity;
+	int design_voltage;
+	int cycle_count;
+	char manufacturer[EC_MEMMAP_TEXT_MAX + 1];
+	char model_name[EC_MEMMAP_TEXT_MAX + 1];
+	char serial_number[EC_MEMMAP_TEXT_MAX + 1];
+	char type[EC_MEMMAP_TEXT_MAX + 1];
+};
+
+struct fwk_ec_battery;
+
+/**
+ * struct fwk_ec_extra_battery - A battery not in the memory map.
+ * @battery: Driver data.
+ * @index: Battery index, as known by the EC.
+ * @psy: Registered power supply.
+ * @desc: Power supply description.
+ * @static_valid: True if the static part of @state is up to date.
+ * @dynamic_valid: True if the dynamic part of @state was read during
+ *                 battery poll @dynamic_gen of the EC.
+ * @dynamic_gen: Value of the battery poll count when the dynamic part of
+ *               @state was read.
+ * @state: Values read from the EC.
+ */
+struct fwk_ec_extra_battery {
+	struct fwk_ec_battery *battery;
+	u8 index;
+	struct power_supply *psy;
+	struct power_supply_desc desc;
+	bool static_valid;
+	bool dynamic_valid;
+	unsigned int dynamic_gen;
+	struct fwk_ec_battery_state state;
+};
+
+/**
+ * struct fwk_ec_battery - Battery driver data.
+ * @dev: Device, mostly used for logging.
+ * @ec_dev: EC device to read the memory map from.
+ * @psy: Registered power supply.
+ * @desc: Power supply description.
+ * @notifier: EC event notifier.
+ * @work: Work refreshing the cached state.
+ * @lock: Protects the fields below.
+ * @version: Last seen EC_MEMMAP_BATTERY_VERSION.
+ * @map: Last battery block read from the memory map.
+ * @state: Values decoded from @map.
+ * @gen: Number of EC battery polls seen, i.e. of changes of @map.
+ * @num_extra: Number of batteries in @extra.
+ * @extra: Batteries other than the one in the memory map.
+ */
+struct fwk_ec_battery {
+	struct device *dev;
+	struct fwk_ec_device *ec_dev;
+	struct power_supply *psy;
+	struct power_supply_desc desc;
+	struct notifier_block notifier;
+	struct delayed_work work;
+
+	struct mutex lock;
+	u8 version;
+	u8 map[FWK_EC_BATTERY_MAP_SIZE];
+	struct fwk_ec_battery_state state;
+	unsigned int gen;
+	int num_extra;
+	struct fwk_ec_extra_battery extra[FWK_EC_BATTERY_MAX - 1];
+};
+
+static const enum power_supply_property fwk_ec_battery_props[] = {
+	POWER_SUPPLY_PROP_STATUS,
+	POWER_SUPPLY_PROP_PRESENT,
+	POWER_SUPPLY_PROP_TECHNOLOGY,
+	POWER_SUPPLY_PROP_CYCLE_COUNT,
+	POWER_SUPPLY_PROP_VOLTAGE_MIN_DESIGN,
+	POWER_SUPPLY_PROP_VOLTAGE_NOW,
+	POWER_SUPPLY_PROP_CURRENT_NOW,
+	POWER_SUPPLY_PROP_CHARGE_FULL_DESIGN,
+	POWER_SUPPLY_PROP_CHARGE_FULL,
+	POWER_SUPPLY_PROP_CHARGE_NOW,
+	POWER_SUPPLY_PROP_CAPACITY,
+	POWER_SUPPLY_PROP_CAPACITY_LEVEL,
+	POWER_SUPPLY_PROP_SCOPE,
+	POWER_SUPPLY_PROP_MODEL_NAME,
+	POWER_SUPPLY_PROP_MANUFACTURER,
+	POWER_SUPPLY_PROP_SERIAL_NUMBER,
+};
+
+static u32 fwk_ec_battery_map_u32(struct fwk_ec_battery *battery,
+				  unsigned int offset)
+{
+	return get_unaligned_le32(&battery->map[FWK_EC_BATTERY_MAP(offset)]);
+}
+
+static void fwk_ec_battery_map_string(struct fwk_ec_battery *battery,
+				      unsigned int offset, char *dest)
+{
+	memcpy(dest, &battery->map[FWK_EC_BATTERY_MAP(offset)],
+	       EC_MEMMAP_TEXT_MAX);
+	dest[EC_MEMMAP_TEXT_MAX] = '\0';
+}
+
+/*
+ * Decode the battery block. Strings only change along with the battery, so
+ * they are only copied out when their part of the block changed.
+ *
+ * LOCKING: the caller holds battery->lock.
+ */
+static void fwk_ec_battery_decode(struct fwk_ec_battery *battery,
+				  bool strings_changed)
+{
+	struct fwk_ec_battery_state *state = &battery->state;
+	int rate;
+
+	state->flags = battery->map[FWK_EC_BATTERY_MAP(EC_MEMMAP_BATT_FLAG)];
+	state->voltage = fwk_ec_battery_map_u32(battery, EC_MEMMAP_BATT_VOLT);
+	rate = fwk_ec_battery_map_u32(battery, EC_MEMMAP_BATT_RATE);
+	state->current_now = (state->flags & EC_BATT_FLAG_DISCHARGING) ?
+			     -rate : rate;
+	state->remaining_capacity =
+		fwk_ec_battery_map_u32(battery, EC_MEMMAP_BATT_CAP);
+	state->full_capacity =
+		fwk_ec_battery_map_u32(battery, EC_MEMMAP_BATT_LFCC);
+	state->design_capacity =
+		fwk_ec_battery_map_u32(battery, EC_MEMMAP_BATT_DCAP);
+	state->design_voltage =
+		fwk_ec_battery_map_u32(battery, EC_MEMMAP_BATT_DVLT);
+	state->cycle_count =
+		fwk_ec_battery_map_u32(battery, EC_MEMMAP_BATT_CCNT);
+
+	if (!strings_changed)
+		return;
+
+	fwk_ec_battery_map_string(battery, EC_MEMMAP_BATT_MFGR,
+				  state->manufacturer);
+	fwk_ec_battery_map_string(battery, EC_MEMMAP_BATT_MODEL,
+				  state->model_name);
+	fwk_ec_battery_map_string(battery, EC_MEMMAP_BATT_SERIAL,
+				  state->serial_number);
+	fwk_ec_battery_map_string(battery, EC_MEMMAP_BATT_TYPE,
+				  state->type);
+}
+
+/*
+ * Read the battery block from the memory map in one burst.
+ *
+ * Return: 1 if anything changed, 0 if not, or negative error code.
+ */
+static int fwk_ec_battery_refresh(struct fwk_ec_battery *battery)
+{
+	struct fwk_ec_device *ec_dev = battery->ec_dev;
+	u8 map[FWK_EC_BATTERY_MAP_SIZE];
+	bool strings_changed;
+	u8 version;
+	int ret;
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	ret = ec_dev->cmd_readmem(ec_dev, EC_MEMMAP_BATTERY_VERSION, 1,
+				  &version);
+	if (ret >= 0)
+		ret = ec_dev->cmd_readmem(ec_dev, FWK_EC_BATTERY_MAP_START,
+					  sizeof(map), map);
+
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	if (ret < 0)
+		return ret;
+
+	/* The EC is in the middle of updating the block; use the old one. */
+	if (map[FWK_EC_BATTERY_MAP(EC_MEMMAP_BATT_FLAG)] &
+	    EC_BATT_FLAG_INVALID_DATA)
+		return 0;
+
+	mutex_lock(&battery->lock);
+
+	if (version == battery->version &&
+	    !memcmp(map, battery->map, sizeof(map))) {
+		mutex_unlock(&battery->lock);
+		return 0;
+	}
+
+	strings_changed = version != battery->version ||
+		memcmp(&map[FWK_EC_BATTERY_MAP(EC_MEMMAP_BATT_MFGR)],
+		       &battery->map[FWK_EC_BATTERY_MAP(EC_MEMMAP_BATT_MFGR)],
+		       EC_MEMMAP_BATT_TYPE + EC_MEMMAP_TEXT_MAX -
+		       EC_MEMMAP_BATT_MFGR);
+
+	battery->version = version;
+	memcpy(battery->map, map, sizeof(map));
+	fwk_ec_battery_decode(battery, strings_changed);
+
+	/* A new EC battery poll, the other batteries may have changed too. */
+	battery->gen++;
+
+	mutex_unlock(&battery->lock);
+
+	return 1;
+}
+
+static bool fwk_ec_battery_extra_poll(struct fwk_ec_extra_battery *extra);
+
+static void fwk_ec_battery_work(struct work_struct *work)
+{
+	struct fwk_ec_battery *battery =
+		container_of(to_delayed_work(work), struct fwk_ec_battery,
+			     work);
+
+	int i;
+
+	if (fwk_ec_battery_refresh(battery) > 0)
+		power_supply_changed(battery->psy);
+
+	for (i = 0; i < battery->num_extra; i++) {
+		if (fwk_ec_battery_extra_poll(&battery->extra[i]))
+			power_supply_changed(battery->extra[i].psy);
+	}
+
+	schedule_delayed_work(&battery->work,
+			      msecs_to_jiffies(FWK_EC_BATTERY_POLL_MS));
+}
+
+static int fwk_ec_battery_event(struct notifier_block *nb,
+				unsigned long queued_during_suspend,
+				void *_notify)
+{
+	struct fwk_ec_battery *battery =
+		container_of(nb, struct fwk_ec_battery, notifier);
+	u32 host_event = fwk_ec_get_host_event(battery->ec_dev);
+
+	int i;
+
+	if (!(host_event & FWK_EC_BATTERY_HOST_EVENTS))
+		return NOTIFY_DONE;
+
+	/* Batteries come and go with EC_HOST_EVENT_BATTERY. */
+	if (host_event & EC_HOST_EVENT_MASK(EC_HOST_EVENT_BATTERY)) {
+		mutex_lock(&battery->lock);
+		for (i = 0; i < battery->num_extra; i++) {
+			battery->extra[i].static_valid = false;
+			battery->extra[i].dynamic_valid = false;
+		}
+		mutex_unlock(&battery->lock);
+	}
+
+	mod_delayed_work(system_wq, &battery->work, 0);
+
+	return NOTIFY_OK;
+}
+
+static int fwk_ec_battery_status(struct fwk_ec_battery_state *state)
+{
+	if (!(state->flags & EC_BATT_FLAG_BATT_PRESENT))
+		return POWER_SUPPLY_STATUS_UNKNOWN;
+	if (state->flags & EC_BATT_FLAG_CHARGING)
+		return POWER_SUPPLY_STATUS_CHARGING;
+	if (state->flags & EC_BATT_FLAG_DISCHARGING)
+		return POWER_SUPPLY_STATUS_DISCHARGING;
+	if (state->full_capacity &&
+	    state->remaining_capacity >= state->full_capacity)
+		return POWER_SUPPLY_STATUS_FULL;
+
+	return POWER_SUPPLY_STATUS_NOT_CHARGING;
+}
+
+static int fwk_ec_battery_technology(const char *type)
+{
+	if (!strncasecmp(type, "LION", 4) || !strncasecmp(type, "Li-I", 4))
+		return POWER_SUPPLY_TECHNOLOGY_LION;
+	if (!strncasecmp(type, "LIP", 3))
+		return POWER_SUPPLY_TECHNOLOGY_LIPO;
+
+	return POWER_SUPPLY_TECHNOLOGY_UNKNOWN;
+}
+
+/* LOCKING: the caller holds battery->lock. */
+static int fwk_ec_battery_state_property(struct fwk_ec_battery_state *state,
+					 enum power_supply_property psp,
+					 union power_supply_propval *val)
+{
+	int ret = 0;
+
+	switch (psp) {
+	case POWER_SUPPLY_PROP_STATUS:
+		val->intval = fwk_ec_battery_status(state);
+		break;
+	case POWER_SUPPLY_PROP_PRESENT:
+		val->intval = !!(state->flags & EC_BATT_FLAG_BATT_PRESENT);
+		break;
+	case POWER_SUPPLY_PROP_TECHNOLOGY:
+		val->intval = fwk_ec_battery_technology(state->type);
+		break;
+	case POWER_SUPPLY_PROP_CYCLE_COUNT:
+		val->intval = state->cycle_count;
+		break;
+	case POWER_SUPPLY_PROP_VOLTAGE_MIN_DESIGN:
+		val->intval = state->design_voltage * 1000;
+		break;
+	case POWER_SUPPLY_PROP_VOLTAGE_NOW:
+		val->intval = state->voltage * 1000;
+		break;
+	case POWER_SUPPLY_PROP_CURRENT_NOW:
+		val->intval = state->current_now * 1000;
+		break;
+	case POWER_SUPPLY_PROP_CHARGE_FULL_DESIGN:
+		val->intval = state->design_capacity * 1000;
+		break;
+	case POWER_SUPPLY_PROP_CHARGE_FULL:
+		val->intval = state->full_capacity * 1000;
+		break;
+	case POWER_SUPPLY_PROP_CHARGE_NOW:
+		val->intval = state->remaining_capacity * 1000;
+		break;
+	case POWER_SUPPLY_PROP_CAPACITY:
+		if (!state->full_capacity) {
+			ret = -ENODATA;
+			break;
+		}
+		val->intval = min(100, state->remaining_capacity * 100 /
+				       state->full_capacity);
+		break;
+	case POWER_SUPPLY_PROP_CAPACITY_LEVEL:
+		if (state->flags & EC_BATT_FLAG_LEVEL_CRITICAL)
+			val->intval = POWER_SUPPLY_CAPACITY_LEVEL_CRITICAL;
+		else if (fwk_ec_battery_status(state) ==
+			 POWER_SUPPLY_STATUS_FULL)
+			val->intval = POWER_SUPPLY_CAPACITY_LEVEL_FULL;
+		else
+			val->intval = POWER_SUPPLY_CAPACITY_LEVEL_NORMAL;
+		break;
+	case POWER_SUPPLY_PROP_SCOPE:
+		val->intval = POWER_SUPPLY_SCOPE_SYSTEM;
+		break;
+	case POWER_SUPPLY_PROP_MODEL_NAME:
+		val->strval = state->model_name;
+		break;
+	case POWER_SUPPLY_PROP_MANUFACTURER:
+		val->strval = state->manufacturer;
+		break;
+	case POWER_SUPPLY_PROP_SERIAL_NUMBER:
+		val->strval = state->serial_number;
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	return ret;
+}
+
+static int fwk_ec_battery_get_property(struct power_supply *psy,
+				       enum power_supply_property psp,
+				       union power_supply_propval *val)
+{
+	struct fwk_ec_battery *battery = power_supply_get_drvdata(psy);
+	int ret;
+
+	mutex_lock(&battery->lock);
+	ret = fwk_ec_battery_state_property(&battery->state, psp, val);
+	mutex_unlock(&battery->lock);
+
+	return ret;
+}
+
+static void fwk_ec_battery_comm_string(char *dest, const char *src)
+{
+	BUILD_BUG_ON(EC_COMM_TEXT_MAX > EC_MEMMAP_TEXT_MAX);
+
+	memcpy(dest, src, EC_COMM_TEXT_MAX);
+	dest[EC_COMM_TEXT_MAX] = '\0';
+}
+
+/*
+ * Bring the state of an extra battery up to date, in one EC lock session:
+ * the dynamic info once per EC battery poll, the static info once per
+ * battery.
+ *
+ * LOCKING: the caller holds battery->lock.
+ */
+static int fwk_ec_battery_extra_update(struct fwk_ec_extra_battery *extra)
+{
+	struct fwk_ec_battery *battery = extra->battery;
+	struct fwk_ec_device *ec_dev = battery->ec_dev;
+	struct fwk_ec_battery_state *state = &extra->state;
+	struct ec_params_battery_static_info params = {
+		.index = extra->index,
+	};
+	struct ec_response_battery_dynamic_info dynamic;
+	struct ec_response_battery_static_info info;
+	int ret = 0;
+
+	if (extra->dynamic_valid && extra->dynamic_gen == battery->gen &&
+	    (extra->static_valid ||
+	     !(state->flags & EC_BATT_FLAG_BATT_PRESENT)))
+		return 0;
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	if (!extra->dynamic_valid || extra->dynamic_gen != battery->gen) {
+		/* Same parameters as the static info. */
+		ret = fwk_ec_cmd_locked(ec_dev, 0, EC_CMD_BATTERY_GET_DYNAMIC,
+					&params, sizeof(params),
+					&dynamic, sizeof(dynamic));
+		if (ret < 0)
+			goto unlock;
+
+		/* A battery plugged or unplugged since the last read. */
+		if ((dynamic.flags ^ state->flags) & EC_BATT_FLAG_BATT_PRESENT)
+			extra->static_valid = false;
+
+		state->voltage = dynamic.actual_voltage;
+		state->current_now = dynamic.actual_current;
+		state->remaining_capacity = dynamic.remaining_capacity;
+		state->full_capacity = dynamic.full_capacity;
+		state->flags = dynamic.flags;
+		extra->dynamic_gen = battery->gen;
+		extra->dynamic_valid = true;
+	}
+
+	if (!extra->static_valid &&
+	    (state->flags & EC_BATT_FLAG_BATT_PRESENT)) {
+		ret = fwk_ec_cmd_locked(ec_dev, 0, EC_CMD_BATTERY_GET_STATIC,
+					&params, sizeof(params),
+					&info, sizeof(info));
+		if (ret < 0)
+			goto unlock;
+
+		state->design_capacity = info.design_capacity;
+		state->design_voltage = info.design_voltage;
+		state->cycle_count = info.cycle_count;
+		fwk_ec_battery_comm_string(state->manufacturer,
+					   info.manufacturer);
+		fwk_ec_battery_comm_string(state->model_name, info.model);
+		fwk_ec_battery_comm_string(state->serial_number, info.serial);
+		fwk_ec_battery_comm_string(state->type, info.type);
+		extra->static_valid = true;
+	}
+
+unlock:
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Read the dynamic info of an extra battery again, whatever the memory map
+ * did.
+ *
+ * Return: true if it changed.
+ */
+static bool fwk_ec_battery_extra_poll(struct fwk_ec_extra_battery *extra)
+{
+	struct fwk_ec_battery *battery = extra->battery;
+	struct fwk_ec_battery_state *state = &extra->state;
+	struct fwk_ec_battery_state old;
+	bool changed;
+
+	mutex_lock(&battery->lock);
+
+	old = *state;
+	extra->dynamic_valid = false;
+	changed = !fwk_ec_battery_extra_update(extra) &&
+		  (state->voltage != old.voltage ||
+		   state->current_now != old.current_now ||
+		   state->remaining_capacity != old.remaining_capacity ||
+		   state->full_capacity != old.full_capacity ||
+		   state->flags != old.flags ||
+		   state->cycle_count != old.cycle_count);
+
+	mutex_unlock(&battery->lock);
+
+	return changed;
+}
+
+static int fwk_ec_battery_extra_get_property(struct power_supply *psy,
+					     enum power_supply_property psp,
+					     union power_supply_propval *val)
+{
+	struct fwk_ec_extra_battery *extra = power_supply_get_drvdata(psy);
+	struct fwk_ec_battery *battery = extra->battery;
+	int ret;
+
+	mutex_lock(&battery->lock);
+
+	ret = fwk_ec_battery_extra_update(extra);
+	if (!ret)
+		ret = fwk_ec_battery_state_property(&extra->state, psp, val);
+
+	mutex_unlock(&battery->lock);
+
+	return ret;
+}
+
+/*
+ * Register the batteries the memory map doesn't hold. Older ECs leave
+ * EC_MEMMAP_BATT_COUNT at 0, and have a single battery.
+ */
+static int fwk_ec_battery_register_extra(struct fwk_ec_battery *battery)
+{
+	struct fwk_ec_device *ec_dev = battery->ec_dev;
+	struct power_supply_config psy_cfg = {};
+	struct fwk_ec_extra_battery *extra;
+	u8 count, index;
+	int i, ret;
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	ret = ec_dev->cmd_readmem(ec_dev, EC_MEMMAP_BATT_COUNT, 1, &count);
+	if (ret >= 0)
+		ret = ec_dev->cmd_readmem(ec_dev, EC_MEMMAP_BATT_INDEX, 1,
+					  &index);
+
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	if (ret < 0)
+		return ret;
+
+	if (count <= 1)
+		return 0;
+
+	/* Without it, there is no telling which battery is which. */
+	if (index >= count) {
+		dev_warn(battery->dev, "bad memory map battery index %u of %u\n",
+			 index, count);
+		return 0;
+	}
+
+	if (count > FWK_EC_BATTERY_MAX) {
+		dev_warn(battery->dev, "only %d of %u batteries supported\n",
+			 FWK_EC_BATTERY_MAX, count);
+		count = FWK_EC_BATTERY_MAX;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (i == index)
+			continue;
+
+		/* With index past FWK_EC_BATTERY_MAX, no room for the last. */
+		if (battery->num_extra == ARRAY_SIZE(battery->extra))
+			break;
+
+		extra = &battery->extra[battery->num_extra];
+		extra->battery = battery;
+		extra->index = i;
+
+		mutex_lock(&battery->lock);
+		ret = fwk_ec_battery_extra_update(extra);
+		mutex_unlock(&battery->lock);
+		if (ret == -EOPNOTSUPP || ret == -EINVAL) {
+			dev_info(battery->dev,
+				 "EC can't report battery %u, skipping\n",
+				 extra->index);
+			continue;
+		}
+		if (ret < 0)
+			return ret;
+
+		extra->desc.name = devm_kasprintf(battery->dev, GFP_KERNEL,
+						  "fwk-ec-battery-%u",
+						  extra->index);
+		if (!extra->desc.name)
+			return -ENOMEM;
+		extra->desc.type = POWER_SUPPLY_TYPE_BATTERY;
+		extra->desc.properties = fwk_ec_battery_props;
+		extra->desc.num_properties = ARRAY_SIZE(fwk_ec_battery_props);
+		extra->desc.get_property = fwk_ec_battery_extra_get_property;
+
+		psy_cfg.drv_data = extra;
+
+		extra->psy = devm_power_supply_register(battery->dev,
+							&extra->desc,
+							&psy_cfg);
+		if (IS_ERR(extra->psy)) {
+			dev_err(battery->dev,
+				"failed to register battery %u\n",
+				extra->index);
+			return PTR_ERR(extra->psy);
+		}
+
+		battery->num_extra++;
+	}
+
+	return 0;
+}
+
+static int fwk_ec_battery_probe(struct platform_device *pdev)
+{
+	struct device *dev = &pdev->dev;
+	struct fwk_ec_dev *ec = dev_get_drvdata(dev->parent);
+	struct fwk_ec_device *ec_dev = ec->ec_dev;
+	struct power_supply_config psy_cfg = {};
+	struct fwk_ec_battery *battery;
+	u8 version;
+	int ret;
+
+	if (!ec_dev->cmd_readmem)
+		return -ENODEV;
+
+	/*
+	 * Do not register the same packs a second time: user space would
+	 * count two system batteries.
+	 */
+	if (acpi_dev_present(FWK_EC_BATTERY_ACPI_HID, NULL, -1)) {
+		dev_dbg(dev, "batteries already exposed by ACPI\n");
+		return -ENODEV;
+	}
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	/* EC_MEMMAP_BATTERY_VERSION is 0 if the battery data is unsupported */
+	ret = ec_dev->cmd_readmem(ec_dev, EC_MEMMAP_BATTERY_VERSION, 1,
+				  &version);
+
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	if (ret < 0)
+		return ret;
+
+	if (!version)
+		return -ENODEV;
+
+	battery = devm_kzalloc(dev, sizeof(*battery), GFP_KERNEL);
+	if (!battery)
+		return -ENOMEM;
+
+	battery->dev = dev;
+	battery->ec_dev = ec_dev;
+	mutex_init(&battery->lock);
+	INIT_DELAYED_WORK(&battery->work, fwk_ec_battery_work);
+
+	ret = fwk_ec_battery_refresh(battery);
+	if (ret < 0)
+		return ret;
+
+	battery->desc.name = "fwk-ec-battery";
+	battery->desc.type = POWER_SUPPLY_TYPE_BATTERY;
+	battery->desc.properties = fwk_ec_battery_props;
+	battery->desc.num_properties = ARRAY_SIZE(fwk_ec_battery_props);
+	battery->desc.get_property = fwk_ec_battery_get_property;
+
+	psy_cfg.drv_data = battery;
+
+	battery->psy = devm_power_supply_register(dev, &battery->desc,
+						  &psy_cfg);
+	if (IS_ERR(battery->psy)) {
+		dev_err(dev, "failed to register power supply\n");
+		return PTR_ERR(battery->psy);
+	}
+
+	platform_set_drvdata(pdev, battery);
+
+	ret = fwk_ec_battery_register_extra(battery);
+	if (ret)
+		return ret;
+
+	battery->notifier.notifier_call = fwk_ec_battery_event;
+	ret = blocking_notifier_chain_register(&ec_dev->event_notifier,
+					       &battery->notifier);
+	if (ret)
+		return ret;
+
+	schedule_delayed_work(&battery->work,
+			      msecs_to_jiffies(FWK_EC_BATTERY_POLL_MS));
+
+	return 0;
+}
+
+static void fwk_ec_battery_remove(struct platform_device *pdev)
+{
+	struct fwk_ec_battery *battery = platform_get_drvdata(pdev);
+
+	blocking_notifier_chain_unregister(&battery->ec_dev->event_notifier,
+					   &battery->notifier);
+	cancel_delayed_work_sync(&battery->work);
+}
+
+static int __maybe_unused fwk_ec_battery_suspend(struct device *dev)
+{
+	struct fwk_ec_battery *battery = dev_get_drvdata(dev);
+
+	cancel_delayed_work_sync(&battery->work);
+
+	return 0;
+}
+
+static int __maybe_unused fwk_ec_battery_resume(struct device *dev)
+{
+	struct fwk_ec_battery *battery = dev_get_drvdata(dev);
+
+	/* The battery may have changed a lot while we were asleep. */
+	schedule_delayed_work(&battery->work, 0);
+
+	return 0;
+}
+
+static SIMPLE_DEV_PM_OPS(fwk_ec_battery_pm_ops,
+			 fwk_ec_battery_suspend, fwk_ec_battery_resume);
+
+static struct platform_driver fwk_ec_battery_driver = {
+	.driver = {
+		.name = DRV_NAME,
+		.pm = &fwk_ec_battery_pm_ops,
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
+	.probe = fwk_ec_battery_probe,
+	.remove_new = fwk_ec_battery_remove,
+};
+
+module_platform_driver(fwk_ec_battery_driver);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("ChromeOS EC battery driver");
+MODULE_ALIAS("platform:" DRV_NAME);
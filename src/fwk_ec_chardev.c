@@ -13,23 +13,37 @@
 #include <linux/init.h>
 #include <linux/device.h>
 #include <linux/fs.h>
+#include <linux/jiffies.h>
 #include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/notifier.h>
+#include <linux/overflow.h>
 #include <fwk_ec_chardev.h>
 #include <fwk_ec_commands.h>
 #include <fwk_ec_proto.h>
 #include <linux/platform_device.h>
 #include <linux/poll.h>
+#include <linux/sizes.h>
 #include <linux/slab.h>
 #include <linux/types.h>
 #include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+
+#include <asm/unaligned.h>
 
 #define DRV_NAME		"fwk-ec-chardev"
 
 /* Arbitrary bounded size for the event queue */
 #define FWK_MAX_EVENT_LEN	PAGE_SIZE
 
+/* Largest fingerprint frame or template read at once */
+#define FWK_MAX_FP_FRAME_LEN	SZ_1M
+
+/* Largest touchpad frame buffer, all frames together */
+#define FWK_MAX_TP_FRAMES_LEN	SZ_4M
+
 struct chardev_data {
 	struct fwk_ec_dev *ec_dev;
 	struct miscdevice misc;
@@ -42,6 +56,10 @@ struct chardev_priv {
 	unsigned long event_mask;
 	struct list_head events;
 	size_t event_len;
+	bool fp_image_ready;
+	struct mutex tp_lock;
+	struct fwk_ec_tp_frame_info tp_info;
+	void *tp_frames;
 };
 
 struct ec_event {
@@ -100,6 +118,16 @@ static int fwk_ec_chardev_mkbp_event(struct notifier_block *nb,
 	unsigned long event_bit = 1 << ec_dev->event_data.event_type;
 	int total_size = sizeof(*event) + ec_dev->event_size;
 
+	/* Remembered for FWK_EC_DEV_IOCFPFRAME, whatever the event mask. */
+	if (ec_dev->event_data.event_type == EC_MKBP_EVENT_FINGERPRINT &&
+	    (get_unaligned_le32(&ec_dev->event_data.data.fp_events) &
+	     EC_MKBP_FP_IMAGE_READY)) {
+		spin_lock(&priv->wait_event.lock);
+		priv->fp_image_ready = true;
+		wake_up_locked(&priv->wait_event);
+		spin_unlock(&priv->wait_event.lock);
+	}
+
 	if (!(event_bit & priv->event_mask) ||
 	    (priv->event_len + total_size) > FWK_MAX_EVENT_LEN)
 		return NOTIFY_DONE;
@@ -172,6 +200,7 @@ static int fwk_ec_chardev_open(struct inode *inode, struct file *filp)
 	filp->private_data = priv;
 	INIT_LIST_HEAD(&priv->events);
 	init_waitqueue_head(&priv->wait_event);
+	mutex_init(&priv->tp_lock);
 	nonseekable_open(inode, filp);
 
 	priv->notifier.notifier_call = fwk_ec_chardev_mkbp_event;
@@ -263,6 +292,7 @@ static int fwk_ec_chardev_release(struct inode *inode, struct file *filp)
 		list_del(&event->node);
 		kfree(event);
 	}
+	vfree(priv->tp_frames);
 	kfree(priv);
 
 	return 0;
@@ -349,6 +379,157 @@ static long fwk_ec_chardev_ioctl_readmem(struct fwk_ec_dev *ec,
 	return num;
 }
 
+/*
+ * Stream a whole fingerprint frame to user space, rather than having it
+ * issue one FWK_EC_DEV_IOCXCMD per chunk.
+ */
+static long fwk_ec_chardev_ioctl_fp_frame(struct chardev_priv *priv,
+					  void __user *arg)
+{
+	struct fwk_ec_fp_frame s_frame;
+	long timeout;
+	void *buf;
+	int ret;
+
+	if (copy_from_user(&s_frame, arg, sizeof(s_frame)))
+		return -EFAULT;
+
+	if (!s_frame.size || s_frame.size > FWK_MAX_FP_FRAME_LEN ||
+	    s_frame.flags & ~FWK_EC_FP_FRAME_WAIT)
+		return -EINVAL;
+
+	if (s_frame.flags & FWK_EC_FP_FRAME_WAIT) {
+		timeout = s_frame.timeout_ms ?
+			  msecs_to_jiffies(s_frame.timeout_ms) :
+			  MAX_SCHEDULE_TIMEOUT;
+
+		spin_lock(&priv->wait_event.lock);
+		timeout = wait_event_interruptible_locked_timeout(
+				priv->wait_event, priv->fp_image_ready,
+				timeout);
+		spin_unlock(&priv->wait_event.lock);
+		if (timeout < 0)
+			return timeout;
+		if (!timeout)
+			return -ETIMEDOUT;
+	}
+
+	buf = kvmalloc(s_frame.size, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	ret = fwk_ec_fp_frame_read(priv->ec_dev, s_frame.index, buf,
+				   s_frame.size);
+	if (ret < 0)
+		goto exit;
+
+	spin_lock(&priv->wait_event.lock);
+	priv->fp_image_ready = false;
+	spin_unlock(&priv->wait_event.lock);
+
+	if (copy_to_user(u64_to_user_ptr(s_frame.buffer), buf, s_frame.size))
+		ret = -EFAULT;
+	else
+		ret = s_frame.size;
+exit:
+	kvfree(buf);
+	return ret;
+}
+
+/*
+ * Get the touchpad frame layout and allocate the buffer the frames are
+ * captured into, the first time around. Called with tp_lock held.
+ */
+static int fwk_ec_chardev_tp_init(struct chardev_priv *priv)
+{
+	struct fwk_ec_tp_frame_info *info = &priv->tp_info;
+	struct fwk_ec_dev *ec = priv->ec_dev;
+	struct {
+		struct ec_response_tp_frame_info info;
+		u32 frame_sizes[FWK_EC_TP_MAX_FRAMES];
+	} resp;
+	size_t size = 0;
+	int ret, i;
+
+	if (priv->tp_frames)
+		return 0;
+
+	ret = fwk_ec_cmd(ec->ec_dev, 0, EC_CMD_TP_FRAME_INFO + ec->cmd_offset,
+			 NULL, 0, &resp, sizeof(resp));
+	if (ret < 0)
+		return ret;
+
+	/* Only the first FWK_EC_TP_MAX_FRAMES frames are available. */
+	info->n_frames = min_t(u32, resp.info.n_frames, FWK_EC_TP_MAX_FRAMES);
+	if (!info->n_frames ||
+	    (size_t)ret < struct_size(&resp.info, frame_sizes, info->n_frames))
+		return -EPROTO;
+
+	for (i = 0; i < info->n_frames; i++) {
+		info->offsets[i] = size;
+		info->sizes[i] = resp.frame_sizes[i];
+		size += info->sizes[i];
+		if (size > FWK_MAX_TP_FRAMES_LEN)
+			return -E2BIG;
+	}
+	info->size = PAGE_ALIGN(size);
+
+	/* Zeroed, and suitable for remap_vmalloc_range(). */
+	priv->tp_frames = vmalloc_user(info->size);
+	if (!priv->tp_frames)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static long fwk_ec_chardev_ioctl_tp_info(struct chardev_priv *priv,
+					 void __user *arg)
+{
+	long ret;
+
+	mutex_lock(&priv->tp_lock);
+	ret = fwk_ec_chardev_tp_init(priv);
+	mutex_unlock(&priv->tp_lock);
+	if (ret)
+		return ret;
+
+	if (copy_to_user(arg, &priv->tp_info, sizeof(priv->tp_info)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * Capture touchpad frames into the buffer user space has mapped, rather
+ * than having it issue one FWK_EC_DEV_IOCXCMD per chunk.
+ */
+static long fwk_ec_chardev_ioctl_tp_capture(struct chardev_priv *priv,
+					    unsigned long frames)
+{
+	unsigned long all;
+	long ret;
+
+	mutex_lock(&priv->tp_lock);
+
+	ret = fwk_ec_chardev_tp_init(priv);
+	if (ret)
+		goto unlock;
+
+	all = GENMASK(priv->tp_info.n_frames - 1, 0);
+	if (frames & ~all) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	ret = fwk_ec_tp_frames_read(priv->ec_dev, priv->tp_info.sizes,
+				    priv->tp_info.n_frames,
+				    frames ?: all, priv->tp_frames);
+unlock:
+	mutex_unlock(&priv->tp_lock);
+
+	return ret;
+}
+
 static long fwk_ec_chardev_ioctl(struct file *filp, unsigned int cmd,
 				   unsigned long arg)
 {
@@ -366,15 +547,37 @@ static long fwk_ec_chardev_ioctl(struct file *filp, unsigned int cmd,
 	case FWK_EC_DEV_IOCEVENTMASK:
 		priv->event_mask = arg;
 		return 0;
+	case FWK_EC_DEV_IOCFPFRAME:
+		return fwk_ec_chardev_ioctl_fp_frame(priv, (void __user *)arg);
+	case FWK_EC_DEV_IOCTPINFO:
+		return fwk_ec_chardev_ioctl_tp_info(priv, (void __user *)arg);
+	case FWK_EC_DEV_IOCTPCAPTURE:
+		return fwk_ec_chardev_ioctl_tp_capture(priv, arg);
 	}
 
 	return -ENOTTY;
 }
 
+/* Map the touchpad frame buffer, see struct fwk_ec_tp_frame_info. */
+static int fwk_ec_chardev_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct chardev_priv *priv = filp->private_data;
+	int ret;
+
+	mutex_lock(&priv->tp_lock);
+	ret = fwk_ec_chardev_tp_init(priv);
+	mutex_unlock(&priv->tp_lock);
+	if (ret)
+		return ret;
+
+	return remap_vmalloc_range(vma, priv->tp_frames, vma->vm_pgoff);
+}
+
 static const struct file_operations chardev_fops = {
 	.open		= fwk_ec_chardev_open,
 	.poll		= fwk_ec_chardev_poll,
 	.read		= fwk_ec_chardev_read,
+	.mmap		= fwk_ec_chardev_mmap,
 	.release	= fwk_ec_chardev_release,
 	.unlocked_ioctl	= fwk_ec_chardev_ioctl,
 #ifdef CONFIG_COMPAT
@@ -30,9 +30,57 @@ struct fwk_ec_readmem {
 	uint8_t buffer[EC_MEMMAP_SIZE];
 };
 
+/* Wait for EC_MKBP_FP_IMAGE_READY before reading the frame. */
+#define FWK_EC_FP_FRAME_WAIT	BIT(0)
+
+/**
+ * struct fwk_ec_fp_frame - Struct used to read a fingerprint frame.
+ * @index: FP_FRAME_INDEX_RAW_IMAGE for the last captured image, or
+ *         FP_FRAME_INDEX_TEMPLATE + n for template n.
+ * @flags: FWK_EC_FP_FRAME_*.
+ * @timeout_ms: With FWK_EC_FP_FRAME_WAIT, how long to wait for the image,
+ *         0 to wait without limit.
+ * @size: Number of bytes to read into @buffer.
+ * @buffer: User space address of the buffer.
+ *
+ * With FWK_EC_FP_FRAME_WAIT, an image ready event received on this file
+ * since its last frame read counts. The ioctl returns the number of bytes
+ * read or negative on error.
+ */
+struct fwk_ec_fp_frame {
+	uint32_t index;
+	uint32_t flags;
+	uint32_t timeout_ms;
+	uint32_t size;
+	uint64_t buffer;
+};
+
+#define FWK_EC_TP_MAX_FRAMES	8
+
+/**
+ * struct fwk_ec_tp_frame_info - Layout of the touchpad frame buffer.
+ * @n_frames: Number of frames of the touchpad MCU, at most
+ *         FWK_EC_TP_MAX_FRAMES.
+ * @size: Size of the buffer to mmap() to get at the frames.
+ * @offsets: Offset of each frame in the buffer.
+ * @sizes: Size of each frame.
+ *
+ * FWK_EC_DEV_IOCTPCAPTURE takes its argument as a bitmask of the frames to
+ * capture, 0 meaning all of them, and stores them in the buffer.
+ */
+struct fwk_ec_tp_frame_info {
+	uint32_t n_frames;
+	uint32_t size;
+	uint32_t offsets[FWK_EC_TP_MAX_FRAMES];
+	uint32_t sizes[FWK_EC_TP_MAX_FRAMES];
+};
+
 #define FWK_EC_DEV_IOC       0xEC
 #define FWK_EC_DEV_IOCXCMD   _IOWR(FWK_EC_DEV_IOC, 0, struct fwk_ec_command)
 #define FWK_EC_DEV_IOCRDMEM  _IOWR(FWK_EC_DEV_IOC, 1, struct fwk_ec_readmem)
 #define FWK_EC_DEV_IOCEVENTMASK _IO(FWK_EC_DEV_IOC, 2)
+#define FWK_EC_DEV_IOCFPFRAME _IOWR(FWK_EC_DEV_IOC, 3, struct fwk_ec_fp_frame)
+#define FWK_EC_DEV_IOCTPINFO _IOR(FWK_EC_DEV_IOC, 4, struct fwk_ec_tp_frame_info)
+#define FWK_EC_DEV_IOCTPCAPTURE _IO(FWK_EC_DEV_IOC, 5)
 
 #endif /* _FWK_EC_DEV_H_ */
@@ -7,6 +7,9 @@
 #include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <fwk_ec_commands.h>
@@ -14,6 +17,9 @@
 #include <linux/platform_device.h>
 #include <linux/poll.h>
 #include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/seq_file.h>
+#include <linux/sizes.h>
 #include <linux/slab.h>
 #include <linux/wait.h>
 
@@ -23,6 +29,19 @@
 #define LOG_SIZE		(1 << LOG_SHIFT)
 #define LOG_POLL_SEC		10
 
+/*
+ * Time budget, counted from the panic notification, for reading panic data
+ * before the EC forces a reset.
+ */
+#define PANIC_CAPTURE_BUDGET_MS	100
+
+/*
+ * Flash is read ahead by up to FLASH_STAGE_SIZE bytes, in EC lock sessions
+ * of at most FLASH_SESSION_MS.
+ */
+#define FLASH_STAGE_SIZE	SZ_64K
+#define FLASH_SESSION_MS	20
+
 #define CIRC_ADD(idx, size, value)	(((idx) + (value)) & ((size) - 1))
 
 /* waitqueue for log readers */
@@ -38,8 +57,16 @@ static DECLARE_WAIT_QUEUE_HEAD(fwk_ec_debugfs_log_wq);
  * @log_mutex: mutex to protect circular buffer
  * @log_poll_work: recurring task to poll EC for new console log data
  * @panicinfo_blob: panicinfo debugfs blob
- * @notifier_panic: notifier_block to let kernel to flush buffered log
+ * @panicinfo_created: true once the panicinfo debugfs file exists
+ * @panic_msg: preallocated EC command and buffer used when EC panics
+ * @panic_size: size of the panicinfo buffer and of the @panic_msg data,
+ *              max_response when they were allocated
+ * @panic_log: preallocated staging buffer for console data read on EC panic
+ * @notifier_panic: notifier_block to let kernel to capture panic data
  *                  when EC panic
+ * @flash_size: EC flash size, 0 if the flash can't be read
+ * @flash_regions: offset and size of the EC_FLASH_REGION_* regions
+ * @typec_ports: number of USB-C ports shown in the typec file
  */
 struct fwk_ec_debugfs {
 	struct fwk_ec_dev *ec;
@@ -51,7 +78,37 @@ struct fwk_ec_debugfs {
 	struct delayed_work log_poll_work;
 	/* EC panicinfo */
 	struct debugfs_blob_wrapper panicinfo_blob;
+	bool panicinfo_created;
+	struct fwk_ec_command *panic_msg;
+	u16 panic_size;
+	u8 *panic_log;
 	struct notifier_block notifier_panic;
+	/* EC flash */
+	u32 flash_size;
+	struct ec_response_flash_region_info flash_regions[EC_FLASH_REGION_COUNT];
+	/* Type-C */
+	u8 typec_ports;
+};
+
+/**
+ * struct fwk_ec_flash_reader - State of an open flash file.
+ *
+ * @debug_info: EC debugging information
+ * @lock: serializes the reads on the file
+ * @msg: EC command buffer, large enough for the largest EC_CMD_FLASH_READ
+ * @msg_size: size of the @msg data, max_response when the file was opened
+ * @stage: flash data read ahead
+ * @stage_pos: flash offset of @stage
+ * @stage_len: number of valid bytes in @stage
+ */
+struct fwk_ec_flash_reader {
+	struct fwk_ec_debugfs *debug_info;
+	struct mutex lock;
+	struct fwk_ec_command *msg;
+	u16 msg_size;
+	u8 *stage;
+	u32 stage_pos;
+	u32 stage_len;
 };
 
 /*
@@ -246,6 +303,163 @@ static ssize_t fwk_ec_pdinfo_read(struct file *file,
 				       read_buf, p - read_buf);
 }
 
+/*
+ * Everything the EC core caches about the USB-C ports, one line per port.
+ * Reading this again without any PD event in between doesn't reach the EC.
+ * The parts the EC does not support, e.g. EC_CMD_TYPEC_STATUS on older ECs,
+ * are left out.
+ */
+static ssize_t fwk_ec_typec_read(struct file *file, char __user *user_buf,
+				  size_t count, loff_t *ppos)
+{
+	char read_buf[EC_USB_PD_MAX_PORTS * 160], *p = read_buf;
+	struct fwk_ec_debugfs *debug_info = file->private_data;
+	struct fwk_ec_device *ec_dev = debug_info->ec->ec_dev;
+	struct ec_response_usb_pd_power_info power;
+	struct ec_response_typec_status status;
+	struct ec_response_usb_pd_mux_info mux;
+	const char *end = read_buf + sizeof(read_buf);
+	int i, ret, err = 0;
+	bool shown = false;
+
+	for (i = 0; i < debug_info->typec_ports; i++) {
+		p += scnprintf(p, end - p, "p%d:", i);
+
+		ret = fwk_ec_typec_get_status(ec_dev, i, &status);
+		if (ret >= 0) {
+			p += scnprintf(p, end - p,
+				       " %.*s pd:%u conn:%u pr:%u dr:%u pol:%u",
+				       (int)sizeof(status.tc_state),
+				       status.tc_state, status.pd_enabled,
+				       status.dev_connected, status.power_role,
+				       status.data_role, status.polarity);
+			shown = true;
+		} else {
+			err = ret;
+		}
+
+		ret = fwk_ec_usb_pd_get_mux_info(ec_dev, i, &mux);
+		if (ret >= 0) {
+			p += scnprintf(p, end - p, " mux:%.2x", mux.flags);
+			shown = true;
+		} else {
+			err = ret;
+		}
+
+		ret = fwk_ec_usb_pd_get_power_info(ec_dev, i, &power);
+		if (ret >= 0) {
+			p += scnprintf(p, end - p, " power:%u type:%u %umV %umA",
+				       power.role, power.type,
+				       power.meas.voltage_now,
+				       power.meas.current_lim);
+			shown = true;
+		} else {
+			err = ret;
+		}
+
+		p += scnprintf(p, end - p, "\n");
+	}
+
+	/* Nothing at all could be read. */
+	if (!shown && err)
+		return err;
+
+	return simple_read_from_buffer(user_buf, count, ppos,
+				       read_buf, p - read_buf);
+}
+
+static const char * const fwk_ec_charge_param_names[CS_NUM_BASE_PARAMS] = {
+	[CS_PARAM_CHG_VOLTAGE] = "chg_voltage_limit",
+	[CS_PARAM_CHG_CURRENT] = "chg_current_limit",
+	[CS_PARAM_CHG_INPUT_CURRENT] = "chg_input_current_limit",
+	[CS_PARAM_CHG_STATUS] = "chg_status",
+	[CS_PARAM_CHG_OPTION] = "chg_option",
+	[CS_PARAM_LIMIT_POWER] = "limit_power",
+};
+
+/*
+ * The whole text is generated on the first read, from a single snapshot,
+ * so reading it in several chunks doesn't mix snapshots.
+ */
+static int fwk_ec_charge_show(struct seq_file *s, void *unused)
+{
+	struct fwk_ec_debugfs *debug_info = s->private;
+	struct fwk_ec_charge_snapshot snap;
+	int i, ret;
+
+	ret = fwk_ec_get_charge_snapshot(debug_info->ec->ec_dev, &snap);
+	if (ret < 0)
+		return ret;
+
+	seq_printf(s, "age_ms: %llu\n",
+		   div_u64(ktime_get_boottime_ns() - snap.timestamp,
+			   NSEC_PER_MSEC));
+	seq_printf(s, "ac: %d\n", snap.ac);
+	seq_printf(s, "chg_voltage: %d\n", snap.chg_voltage);
+	seq_printf(s, "chg_current: %d\n", snap.chg_current);
+	seq_printf(s, "chg_input_current: %d\n", snap.chg_input_current);
+	seq_printf(s, "batt_state_of_charge: %d\n", snap.batt_state_of_charge);
+
+	for (i = 0; i < CS_NUM_BASE_PARAMS; i++) {
+		if (snap.params_valid & BIT(i))
+			seq_printf(s, "%s: 0x%x\n", fwk_ec_charge_param_names[i],
+				   snap.params[i]);
+	}
+
+	if (snap.power_info_valid) {
+		seq_printf(s, "usb_dev_type: 0x%x\n",
+			   snap.power_info.usb_dev_type);
+		seq_printf(s, "voltage_ac: %u\n", snap.power_info.voltage_ac);
+		seq_printf(s, "voltage_system: %u\n",
+			   snap.power_info.voltage_system);
+		seq_printf(s, "current_system: %u\n",
+			   snap.power_info.current_system);
+		seq_printf(s, "usb_current_limit: %u\n",
+			   snap.power_info.usb_current_limit);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(fwk_ec_charge);
+
+/* Each open gets its own snapshot, as a struct fwk_ec_charge_snapshot. */
+static int fwk_ec_charge_snapshot_open(struct inode *inode, struct file *file)
+{
+	struct fwk_ec_debugfs *debug_info = inode->i_private;
+	struct fwk_ec_charge_snapshot *snap;
+	int ret;
+
+	snap = kmalloc(sizeof(*snap), GFP_KERNEL);
+	if (!snap)
+		return -ENOMEM;
+
+	ret = fwk_ec_get_charge_snapshot(debug_info->ec->ec_dev, snap);
+	if (ret < 0) {
+		kfree(snap);
+		return ret;
+	}
+
+	file->private_data = snap;
+
+	return nonseekable_open(inode, file);
+}
+
+static ssize_t fwk_ec_charge_snapshot_read(struct file *file,
+					   char __user *user_buf,
+					   size_t count, loff_t *ppos)
+{
+	return simple_read_from_buffer(user_buf, count, ppos,
+				       file->private_data,
+				       sizeof(struct fwk_ec_charge_snapshot));
+}
+
+static int fwk_ec_charge_snapshot_release(struct inode *inode,
+					  struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
 static bool fwk_ec_uptime_is_supported(struct fwk_ec_device *ec_dev)
 {
 	struct {
@@ -293,6 +507,206 @@ static ssize_t fwk_ec_uptime_read(struct file *file, char __user *user_buf,
 	return simple_read_from_buffer(user_buf, count, ppos, read_buf, ret);
 }
 
+static int fwk_ec_flash_open(struct inode *inode, struct file *file)
+{
+	struct fwk_ec_debugfs *debug_info = inode->i_private;
+	struct fwk_ec_device *ec_dev = debug_info->ec->ec_dev;
+	struct fwk_ec_flash_reader *reader;
+
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+
+	reader->msg_size = max_t(int, sizeof(struct ec_params_flash_read),
+				 ec_dev->max_response);
+	reader->msg = kzalloc(sizeof(*reader->msg) + reader->msg_size,
+			      GFP_KERNEL);
+	reader->stage = kvmalloc(FLASH_STAGE_SIZE, GFP_KERNEL);
+	if (!reader->msg || !reader->stage) {
+		kvfree(reader->stage);
+		kfree(reader->msg);
+		kfree(reader);
+		return -ENOMEM;
+	}
+
+	reader->debug_info = debug_info;
+	mutex_init(&reader->lock);
+	file->private_data = reader;
+
+	return 0;
+}
+
+static int fwk_ec_flash_release(struct inode *inode, struct file *file)
+{
+	struct fwk_ec_flash_reader *reader = file->private_data;
+
+	mutex_destroy(&reader->lock);
+	kvfree(reader->stage);
+	kfree(reader->msg);
+	kfree(reader);
+
+	return 0;
+}
+
+/*
+ * Fill the stage with up to @len bytes of flash at @offset, with
+ * maximum-sized EC_CMD_FLASH_READ commands sent in a single EC lock session.
+ * The session ends early once FLASH_SESSION_MS is spent or when an EC event
+ * comes in, so that event handling is not held off for long.
+ *
+ * Return: 0 if at least one byte was read, negative error code otherwise.
+ */
+static int fwk_ec_flash_fill(struct fwk_ec_flash_reader *reader, u32 offset,
+			     u32 len)
+{
+	struct fwk_ec_dev *ec = reader->debug_info->ec;
+	struct fwk_ec_device *ec_dev = ec->ec_dev;
+	struct fwk_ec_command *msg = reader->msg;
+	struct ec_params_flash_read *params =
+		(struct ec_params_flash_read *)msg->data;
+	ktime_t deadline, last_event;
+	u32 done = 0;
+	u32 chunk;
+	int ret;
+
+	reader->stage_pos = offset;
+	reader->stage_len = 0;
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	deadline = ktime_add_ms(ktime_get(), FLASH_SESSION_MS);
+	last_event = READ_ONCE(ec_dev->last_event_time);
+
+	do {
+		/* max_response may have grown since the file was opened. */
+		chunk = min_t(u32, len - done,
+			      min(ec_dev->max_response, reader->msg_size));
+
+		msg->version = 0;
+		msg->command = EC_CMD_FLASH_READ + ec->cmd_offset;
+		msg->outsize = sizeof(*params);
+		msg->insize = chunk;
+		params->offset = offset + done;
+		params->size = chunk;
+
+		ret = fwk_ec_cmd_xfer_status_locked(ec_dev, msg);
+		if (ret < 0)
+			break;
+		if (ret != chunk) {
+			ret = -EPROTO;
+			break;
+		}
+
+		memcpy(reader->stage + done, msg->data, chunk);
+		done += chunk;
+	} while (done < len && ktime_before(ktime_get(), deadline) &&
+		 READ_ONCE(ec_dev->last_event_time) == last_event);
+
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	reader->stage_len = done;
+
+	return done ? 0 : ret;
+}
+
+/*
+ * Reads are served from the stage. Sequential readers get the stage filled
+ * ahead, so that small reads still turn into maximum-sized EC commands;
+ * other reads only fetch what they ask for.
+ */
+static ssize_t fwk_ec_flash_read(struct file *file, char __user *user_buf,
+				 size_t count, loff_t *ppos)
+{
+	struct fwk_ec_flash_reader *reader = file->private_data;
+	u32 flash_size = reader->debug_info->flash_size;
+	loff_t pos = *ppos;
+	size_t done = 0;
+	size_t len;
+	u32 want;
+	int ret = 0;
+
+	if (pos < 0)
+		return -EINVAL;
+	if (pos >= flash_size || !count)
+		return 0;
+
+	count = min_t(loff_t, count, flash_size - pos);
+
+	mutex_lock(&reader->lock);
+
+	while (done < count) {
+		if (pos < reader->stage_pos ||
+		    pos >= reader->stage_pos + reader->stage_len) {
+			if (pos == reader->stage_pos + reader->stage_len)
+				want = FLASH_STAGE_SIZE;
+			else
+				want = min_t(size_t, count - done,
+					     FLASH_STAGE_SIZE);
+			want = min_t(u32, want, flash_size - pos);
+
+			ret = fwk_ec_flash_fill(reader, pos, want);
+			if (ret < 0)
+				break;
+		}
+
+		len = min_t(size_t, count - done,
+			    reader->stage_pos + reader->stage_len - pos);
+		if (copy_to_user(user_buf + done,
+				 reader->stage + (pos - reader->stage_pos),
+				 len)) {
+			ret = -EFAULT;
+			break;
+		}
+
+		done += len;
+		pos += len;
+
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+	}
+
+	mutex_unlock(&reader->lock);
+
+	if (!done)
+		return ret;
+
+	*ppos = pos;
+
+	return done;
+}
+
+static ssize_t fwk_ec_flash_regions_read(struct file *file,
+					 char __user *user_buf,
+					 size_t count, loff_t *ppos)
+{
+	static const char * const names[EC_FLASH_REGION_COUNT] = {
+		[EC_FLASH_REGION_RO] = "ro",
+		[EC_FLASH_REGION_ACTIVE] = "active",
+		[EC_FLASH_REGION_WP_RO] = "wp_ro",
+		[EC_FLASH_REGION_UPDATE] = "update",
+	};
+	struct fwk_ec_debugfs *debug_info = file->private_data;
+	char read_buf[EC_FLASH_REGION_COUNT * 32], *p = read_buf;
+	int i;
+
+	for (i = 0; i < EC_FLASH_REGION_COUNT; i++) {
+		if (!debug_info->flash_regions[i].size)
+			continue;
+
+		p += scnprintf(p, sizeof(read_buf) + read_buf - p,
+			       "%-6s 0x%08x 0x%08x\n", names[i],
+			       debug_info->flash_regions[i].offset,
+			       debug_info->flash_regions[i].size);
+	}
+
+	return simple_read_from_buffer(user_buf, count, ppos,
+				       read_buf, p - read_buf);
+}
+
 static const struct file_operations fwk_ec_console_log_fops = {
 	.owner = THIS_MODULE,
 	.open = fwk_ec_console_log_open,
@@ -309,6 +723,21 @@ static const struct file_operations fwk_ec_pdinfo_fops = {
 	.llseek = default_llseek,
 };
 
+static const struct file_operations fwk_ec_typec_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = fwk_ec_typec_read,
+	.llseek = default_llseek,
+};
+
+static const struct file_operations fwk_ec_charge_snapshot_fops = {
+	.owner = THIS_MODULE,
+	.open = fwk_ec_charge_snapshot_open,
+	.read = fwk_ec_charge_snapshot_read,
+	.llseek = no_llseek,
+	.release = fwk_ec_charge_snapshot_release,
+};
+
 static const struct file_operations fwk_ec_uptime_fops = {
 	.owner = THIS_MODULE,
 	.open = simple_open,
@@ -316,6 +745,21 @@ static const struct file_operations fwk_ec_uptime_fops = {
 	.llseek = default_llseek,
 };
 
+static const struct file_operations fwk_ec_flash_fops = {
+	.owner = THIS_MODULE,
+	.open = fwk_ec_flash_open,
+	.read = fwk_ec_flash_read,
+	.llseek = default_llseek,
+	.release = fwk_ec_flash_release,
+};
+
+static const struct file_operations fwk_ec_flash_regions_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = fwk_ec_flash_regions_read,
+	.llseek = default_llseek,
+};
+
 static int ec_read_version_supported(struct fwk_ec_dev *ec)
 {
 	struct ec_params_get_cmd_versions_v1 *params;
@@ -371,6 +815,10 @@ static int fwk_ec_create_console_log(struct fwk_ec_debugfs *debug_info)
 	if (!debug_info->read_msg)
 		return -ENOMEM;
 
+	debug_info->panic_log = devm_kzalloc(ec->dev, LOG_SIZE, GFP_KERNEL);
+	if (!debug_info->panic_log)
+		return -ENOMEM;
+
 	debug_info->read_msg->version = 1;
 	debug_info->read_msg->command = EC_CMD_CONSOLE_READ + ec->cmd_offset;
 	debug_info->read_msg->outsize = read_params_size;
@@ -400,6 +848,96 @@ static void fwk_ec_cleanup_console_log(struct fwk_ec_debugfs *debug_info)
 	}
 }
 
+/*
+ * Read the flash layout in one EC lock session, and expose the flash image
+ * and its regions if the EC reports them.
+ */
+static int fwk_ec_create_flash(struct fwk_ec_debugfs *debug_info)
+{
+	struct fwk_ec_dev *ec = debug_info->ec;
+	struct fwk_ec_device *ec_dev = ec->ec_dev;
+	struct ec_params_flash_region_info params;
+	struct ec_response_flash_info info;
+	int ret;
+	int i;
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	ret = fwk_ec_cmd_locked(ec_dev, 0, EC_CMD_FLASH_INFO + ec->cmd_offset,
+				 NULL, 0, &info, sizeof(info));
+
+	for (i = 0; ret >= 0 && i < EC_FLASH_REGION_COUNT; i++) {
+		params.region = i;
+		if (fwk_ec_cmd_locked(ec_dev, EC_VER_FLASH_REGION_INFO,
+				       EC_CMD_FLASH_REGION_INFO + ec->cmd_offset,
+				       &params, sizeof(params),
+				       &debug_info->flash_regions[i],
+				       sizeof(debug_info->flash_regions[i])) < 0)
+			memset(&debug_info->flash_regions[i], 0,
+			       sizeof(debug_info->flash_regions[i]));
+	}
+
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	/* Not an error, the EC may not give access to its flash. */
+	if (ret < 0 || !info.flash_size)
+		return 0;
+
+	debug_info->flash_size = info.flash_size;
+
+	debugfs_create_file_size("flash", 0400, debug_info->dir, debug_info,
+				 &fwk_ec_flash_fops, debug_info->flash_size);
+	debugfs_create_file("flash_regions", 0444, debug_info->dir,
+			    debug_info, &fwk_ec_flash_regions_fops);
+
+	return 0;
+}
+
+/*
+ * The Type-C cache of the EC core only covers the main EC, and the ports of
+ * the PD controllers it drives.
+ */
+static void fwk_ec_create_typec(struct fwk_ec_debugfs *debug_info)
+{
+	struct fwk_ec_dev *ec = debug_info->ec;
+	struct ec_response_usb_pd_ports resp;
+
+	if (ec->cmd_offset || !fwk_ec_check_features(ec, EC_FEATURE_USB_PD))
+		return;
+
+	if (fwk_ec_cmd(ec->ec_dev, 0, EC_CMD_USB_PD_PORTS, NULL, 0,
+		       &resp, sizeof(resp)) < 0)
+		return;
+
+	debug_info->typec_ports = min_t(u8, resp.num_ports,
+					EC_USB_PD_MAX_PORTS);
+	if (!debug_info->typec_ports)
+		return;
+
+	debugfs_create_file("typec", 0444, debug_info->dir, debug_info,
+			    &fwk_ec_typec_fops);
+}
+
+/* The charger belongs to the main EC. */
+static void fwk_ec_create_charge(struct fwk_ec_debugfs *debug_info)
+{
+	struct fwk_ec_dev *ec = debug_info->ec;
+	struct fwk_ec_charge_snapshot snap;
+
+	if (ec->cmd_offset ||
+	    fwk_ec_get_charge_snapshot(ec->ec_dev, &snap) < 0)
+		return;
+
+	debugfs_create_file("charge", 0444, debug_info->dir, debug_info,
+			    &fwk_ec_charge_fops);
+	debugfs_create_file("charge_snapshot", 0444, debug_info->dir,
+			    debug_info, &fwk_ec_charge_snapshot_fops);
+	debugfs_create_u16("charge_ttl_ms", 0664, debug_info->dir,
+			   &ec->ec_dev->charge_ttl_ms);
+}
+
 /*
  * Returns the size of the panicinfo data fetched from the EC
  */
@@ -436,47 +974,186 @@ static int fwk_ec_create_panicinfo(struct fwk_ec_debugfs *debug_info)
 	int ret;
 	void *data;
 
-	data = devm_kzalloc(debug_info->ec->dev, ec_dev->max_response,
+	/*
+	 * Keep the buffers even if there is no panic data yet: the panic
+	 * notifier fills them in and must not allocate.
+	 */
+	debug_info->panic_size = ec_dev->max_response;
+
+	data = devm_kzalloc(debug_info->ec->dev, debug_info->panic_size,
 			    GFP_KERNEL);
 	if (!data)
 		return -ENOMEM;
 
-	ret = fwk_ec_get_panicinfo(ec_dev, data, ec_dev->max_response);
-	if (ret < 0) {
-		ret = 0;
-		goto free;
-	}
+	debug_info->panic_msg = devm_kzalloc(debug_info->ec->dev,
+		sizeof(*debug_info->panic_msg) +
+			max_t(int, sizeof(struct ec_params_console_read_v1),
+			      debug_info->panic_size), GFP_KERNEL);
+	if (!debug_info->panic_msg)
+		return -ENOMEM;
+
+	debug_info->panicinfo_blob.data = data;
+
+	ret = fwk_ec_get_panicinfo(ec_dev, data, debug_info->panic_size);
 
 	/* No panic data */
-	if (ret == 0)
-		goto free;
+	if (ret <= 0)
+		return 0;
 
-	debug_info->panicinfo_blob.data = data;
 	debug_info->panicinfo_blob.size = ret;
 
 	debugfs_create_blob("panicinfo", S_IFREG | 0444, debug_info->dir,
 			    &debug_info->panicinfo_blob);
+	debug_info->panicinfo_created = true;
 
 	return 0;
+}
+
+/*
+ * Read the panic info into the preallocated panicinfo buffer.
+ *
+ * LOCKING: the caller holds the EC lock.
+ */
+static int fwk_ec_panic_read_info_locked(struct fwk_ec_debugfs *debug_info)
+{
+	struct fwk_ec_device *ec_dev = debug_info->ec->ec_dev;
+	struct fwk_ec_command *msg = debug_info->panic_msg;
+	int ret;
+
+	msg->version = 0;
+	msg->command = EC_CMD_GET_PANIC_INFO;
+	msg->outsize = 0;
+	/* max_response may have grown since the buffers were allocated. */
+	msg->insize = min(debug_info->panic_size, ec_dev->max_response);
+
+	ret = fwk_ec_cmd_xfer_status_locked(ec_dev, msg);
+	if (ret <= 0)
+		return ret;
+
+	memcpy(debug_info->panicinfo_blob.data, msg->data, ret);
 
-free:
-	devm_kfree(debug_info->ec->dev, data);
 	return ret;
 }
 
+/*
+ * Read the most recent console data into the panic staging buffer, until the
+ * console is drained, the staging buffer is full or @deadline has passed.
+ *
+ * LOCKING: the caller holds the EC lock.
+ *
+ * Return: number of bytes staged.
+ */
+static int fwk_ec_panic_read_console_locked(struct fwk_ec_debugfs *debug_info,
+					     ktime_t deadline)
+{
+	struct fwk_ec_dev *ec = debug_info->ec;
+	struct fwk_ec_command *msg = debug_info->panic_msg;
+	struct ec_params_console_read_v1 *params =
+		(struct ec_params_console_read_v1 *)msg->data;
+	int len = 0;
+	int idx;
+	int ret;
+
+	msg->version = 0;
+	msg->command = EC_CMD_CONSOLE_SNAPSHOT + ec->cmd_offset;
+	msg->outsize = 0;
+	msg->insize = 0;
+
+	if (fwk_ec_cmd_xfer_status_locked(ec->ec_dev, msg) < 0)
+		return 0;
+
+	while (len < LOG_SIZE &&
+	       ktime_before(fwk_ec_get_time_ns(), deadline)) {
+		msg->version = 1;
+		msg->command = EC_CMD_CONSOLE_READ + ec->cmd_offset;
+		msg->outsize = sizeof(*params);
+		msg->insize = min(debug_info->panic_size,
+				  ec->ec_dev->max_response);
+
+		memset(params, '\0', sizeof(*params));
+		params->subcmd = CONSOLE_READ_RECENT;
+		ret = fwk_ec_cmd_xfer_status_locked(ec->ec_dev, msg);
+
+		/* If the buffer is empty, we're done here. */
+		if (ret <= 0 || msg->data[0] == '\0')
+			break;
+
+		idx = 0;
+		while (idx < ret && msg->data[idx] != '\0' && len < LOG_SIZE)
+			debug_info->panic_log[len++] = msg->data[idx++];
+	}
+
+	return len;
+}
+
+static void fwk_ec_panic_publish_console(struct fwk_ec_debugfs *debug_info,
+					  int len)
+{
+	struct circ_buf *cb = &debug_info->log_buffer;
+	int idx;
+
+	mutex_lock(&debug_info->log_mutex);
+
+	for (idx = 0; idx < len && CIRC_SPACE(cb->head, cb->tail, LOG_SIZE);
+	     idx++) {
+		cb->buf[cb->head] = debug_info->panic_log[idx];
+		cb->head = CIRC_ADD(cb->head, LOG_SIZE, 1);
+	}
+
+	mutex_unlock(&debug_info->log_mutex);
+
+	wake_up(&fwk_ec_debugfs_log_wq);
+}
+
+/*
+ * The EC resets the machine shortly after reporting a panic, so grab the
+ * panic info and the most recent console data in a single EC lock session,
+ * using preallocated buffers only, and stop reading the console once the time
+ * budget is spent. The data is published after the EC lock is dropped, so
+ * the log mutex is never waited for while holding it.
+ */
 static int fwk_ec_debugfs_panic_event(struct notifier_block *nb,
 				       unsigned long queued_during_suspend, void *_notify)
 {
 	struct fwk_ec_debugfs *debug_info =
 		container_of(nb, struct fwk_ec_debugfs, notifier_panic);
+	struct fwk_ec_device *ec_dev = debug_info->ec->ec_dev;
+	ktime_t deadline = ktime_add_ms(ec_dev->last_event_time,
+					PANIC_CAPTURE_BUDGET_MS);
+	int info_len;
+	int log_len = 0;
 
-	if (debug_info->log_buffer.buf) {
-		/* Force log poll work to run immediately */
-		mod_delayed_work(debug_info->log_poll_work.wq, &debug_info->log_poll_work, 0);
-		/* Block until log poll work finishes */
-		flush_delayed_work(&debug_info->log_poll_work);
+	if (!debug_info->panic_msg)
+		return NOTIFY_DONE;
+
+	if (ec_dev->ec_mutex_lock(ec_dev))
+		return NOTIFY_DONE;
+
+	info_len = fwk_ec_panic_read_info_locked(debug_info);
+
+	if (debug_info->log_buffer.buf)
+		log_len = fwk_ec_panic_read_console_locked(debug_info,
+							    deadline);
+
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	if (info_len > 0) {
+		debug_info->panicinfo_blob.size = info_len;
+		if (!debug_info->panicinfo_created) {
+			debugfs_create_blob("panicinfo", S_IFREG | 0444,
+					    debug_info->dir,
+					    &debug_info->panicinfo_blob);
+			debug_info->panicinfo_created = true;
+		}
 	}
 
+	if (log_len)
+		fwk_ec_panic_publish_console(debug_info, log_len);
+
+	dev_info(debug_info->ec->dev,
+		 "EC panic captured: %d bytes of panicinfo, %d bytes of console\n",
+		 info_len, log_len);
+
 	return NOTIFY_DONE;
 }
 
@@ -506,6 +1183,14 @@ static int fwk_ec_debugfs_probe(struct platform_device *pd)
 	debugfs_create_file("pdinfo", 0444, debug_info->dir, debug_info,
 			    &fwk_ec_pdinfo_fops);
 
+	ret = fwk_ec_create_flash(debug_info);
+	if (ret)
+		goto remove_debugfs;
+
+	fwk_ec_create_typec(debug_info);
+
+	fwk_ec_create_charge(debug_info);
+
 	if (fwk_ec_uptime_is_supported(ec->ec_dev))
 		debugfs_create_file("uptime", 0444, debug_info->dir, debug_info,
 				    &fwk_ec_uptime_fops);
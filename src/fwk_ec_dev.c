@@ -5,8 +5,11 @@
  * Copyright (C) 2014 Google, Inc.
  */
 
+#include <linux/acpi.h>
+#include <linux/async.h>
 #include <linux/dmi.h>
 #include <linux/kconfig.h>
+#include <linux/ktime.h>
 #include <linux/mfd/core.h>
 #include <linux/module.h>
 #include <linux/mod_devicetable.h>
@@ -15,6 +18,7 @@
 #include <fwk_ec_chardev.h>
 #include <fwk_ec_commands.h>
 #include <fwk_ec_proto.h>
+#include <fwk_usbpd_notify.h>
 #include <linux/slab.h>
 
 #define DRV_NAME "fwk-ec-dev"
@@ -74,6 +78,19 @@ static const struct mfd_cell fwk_ec_cec_cells[] = {
 	{ .name = "fwk-ec-cec", },
 };
 
+static const struct mfd_cell fwk_ec_i2c_cells[] = {
+	{ .name = "fwk-ec-i2c", },
+};
+
+static const struct mfd_cell fwk_ec_memmap_cells[] = {
+	{ .name = "fwk-ec-battery", },
+	{ .name = "fwk-ec-hwmon", },
+};
+
+static const struct mfd_cell fwk_ec_kbd_led_cells[] = {
+	{ .name = "fwk-ec-kbd-led", },
+};
+
 static const struct mfd_cell fwk_ec_rtc_cells[] = {
 	{ .name = "fwk-ec-rtc", },
 };
@@ -97,11 +114,21 @@ static const struct fwk_feature_to_cells fwk_subdevices[] = {
 		.mfd_cells	= fwk_ec_cec_cells,
 		.num_cells	= ARRAY_SIZE(fwk_ec_cec_cells),
 	},
+	{
+		.id		= EC_FEATURE_PWM_KEYB,
+		.mfd_cells	= fwk_ec_kbd_led_cells,
+		.num_cells	= ARRAY_SIZE(fwk_ec_kbd_led_cells),
+	},
 	{
 		.id		= EC_FEATURE_RTC,
 		.mfd_cells	= fwk_ec_rtc_cells,
 		.num_cells	= ARRAY_SIZE(fwk_ec_rtc_cells),
 	},
+	{
+		.id		= EC_FEATURE_I2C,
+		.mfd_cells	= fwk_ec_i2c_cells,
+		.num_cells	= ARRAY_SIZE(fwk_ec_i2c_cells),
+	},
 	{
 		.id		= EC_FEATURE_USB_PD,
 		.mfd_cells	= fwk_usbpd_charger_cells,
@@ -115,6 +142,12 @@ static const struct mfd_cell fwk_ec_platform_cells[] = {
 	{ .name = "fwk-ec-sysfs", },
 };
 
+static const struct mfd_cell fwk_ec_main_cells[] = {
+	{ .name = "fwk-ec-adc", },
+	{ .name = "fwk-ec-flash", },
+	{ .name = "fwk-ec-gpio", },
+};
+
 static const struct mfd_cell fwk_ec_pchg_cells[] = {
 	{ .name = "fwk-ec-pchg", },
 };
@@ -132,63 +165,78 @@ static void fwk_ec_class_release(struct device *dev)
 	kfree(to_fwk_ec_dev(dev));
 }
 
-static int ec_device_probe(struct platform_device *pdev)
+/**
+ * struct fwk_ec_dev_discovery - Results of the EC subdevice discovery.
+ * @ec: EC device the discovery was run on.
+ * @sensor_count: Number of MEMS sensors, or negative error code.
+ * @pchg_count: Number of peripheral charger ports.
+ * @main_ec: True for the main EC, as opposed to a PD, FP, TP, ISH or SCP MCU.
+ */
+struct fwk_ec_dev_discovery {
+	struct fwk_ec_dev *ec;
+	int sensor_count;
+	int pchg_count;
+	bool main_ec;
+};
+
+/* Cell additions still in flight, waited for on remove. */
+static ASYNC_DOMAIN_EXCLUSIVE(fwk_ec_dev_async_domain);
+
+/*
+ * Send all the commands needed to find out which subdevices this EC has in
+ * a single lock session, rather than locking the EC once per command.
+ */
+static void ec_device_discover(struct fwk_ec_dev_discovery *disc)
 {
-	int retval = -ENOMEM;
-	struct device_node *node;
-	struct device *dev = &pdev->dev;
-	struct fwk_ec_platform *ec_platform = dev_get_platdata(dev);
-	struct fwk_ec_dev *ec = kzalloc(sizeof(*ec), GFP_KERNEL);
+	struct fwk_ec_dev *ec = disc->ec;
+	struct fwk_ec_device *ec_dev = ec->ec_dev;
 	struct ec_response_pchg_count pchg_count;
-	int i;
-
-	if (!ec)
-		return retval;
+	ktime_t start = ktime_get();
+	int ret;
 
-	dev_set_drvdata(dev, ec);
-	ec->ec_dev = dev_get_drvdata(dev->parent);
-	ec->dev = dev;
-	ec->cmd_offset = ec_platform->cmd_offset;
-	ec->features.flags[0] = -1U; /* Not cached yet */
-	ec->features.flags[1] = -1U; /* Not cached yet */
-	device_initialize(&ec->class_dev);
+	disc->sensor_count = 0;
+	disc->pchg_count = 0;
 
-	for (i = 0; i < ARRAY_SIZE(fwk_mcu_devices); i++) {
-		/*
-		 * Check whether this is actually a dedicated MCU rather
-		 * than an standard EC.
-		 */
-		if (fwk_ec_check_features(ec, fwk_mcu_devices[i].id)) {
-			dev_info(dev, "CrOS %s MCU detected\n",
-				 fwk_mcu_devices[i].desc);
-			/*
-			 * Help userspace differentiating ECs from other MCU,
-			 * regardless of the probing order.
-			 */
-			ec_platform->ec_name = fwk_mcu_devices[i].name;
-			break;
-		}
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret) {
+		dev_warn(ec->dev, "cannot lock EC for discovery: %d\n", ret);
+		return;
 	}
 
+	fwk_ec_get_features_locked(ec);
+
+	disc->sensor_count = fwk_ec_get_sensor_count_locked(ec);
+
 	/*
-	 * Add the class device
+	 * The PCHG device cannot be detected by sending EC_FEATURE_GET_CMD, but
+	 * it can be detected by querying the number of peripheral chargers.
 	 */
-	ec->class_dev.class = &fwk_class;
-	ec->class_dev.parent = dev;
-	ec->class_dev.release = fwk_ec_class_release;
+	ret = fwk_ec_cmd_locked(ec_dev, 0, EC_CMD_PCHG_COUNT, NULL, 0,
+				 &pchg_count, sizeof(pchg_count));
+	if (ret >= 0)
+		disc->pchg_count = pchg_count.port_count;
 
-	retval = dev_set_name(&ec->class_dev, "%s", ec_platform->ec_name);
-	if (retval) {
-		dev_err(dev, "dev_set_name failed => %d\n", retval);
-		goto failed;
-	}
+	ec_dev->ec_mutex_unlock(ec_dev);
 
-	retval = device_add(&ec->class_dev);
-	if (retval)
-		goto failed;
+	dev_dbg(ec->dev, "discovery took %lld us\n",
+		ktime_us_delta(ktime_get(), start));
+}
+
+/*
+ * Adding the cells probes their drivers, which may themselves talk to the EC
+ * for a while. Do it off the probe path so that it does not delay boot.
+ */
+static void ec_device_add_cells(void *data, async_cookie_t cookie)
+{
+	struct fwk_ec_dev_discovery *disc = data;
+	struct fwk_ec_dev *ec = disc->ec;
+	struct device_node *node;
+	ktime_t start = ktime_get();
+	int retval;
+	int i;
 
 	/* check whether this EC is a sensor hub. */
-	if (fwk_ec_get_sensor_count(ec) > 0) {
+	if (disc->sensor_count > 0) {
 		retval = mfd_add_hotplug_devices(ec->dev,
 				fwk_ec_sensorhub_cells,
 				ARRAY_SIZE(fwk_ec_sensorhub_cells));
@@ -231,9 +279,11 @@ static int ec_device_probe(struct platform_device *pdev)
 	/*
 	 * The PD notifier driver cell is separate since it only needs to be
 	 * explicitly added on platforms that don't have the PD notifier ACPI
-	 * device entry defined.
+	 * device entry defined: device tree platforms, and ACPI platforms
+	 * such as Framework laptops that route PD events through the EC
+	 * host events instead.
 	 */
-	if (IS_ENABLED(CONFIG_OF) && ec->ec_dev->dev->of_node) {
+	if (!acpi_dev_present(FWK_USBPD_NOTIFY_ACPI_HID, NULL, -1)) {
 		if (fwk_ec_check_features(ec, EC_FEATURE_USB_PD)) {
 			retval = mfd_add_hotplug_devices(ec->dev,
 					fwk_usbpd_notify_cells,
@@ -246,12 +296,20 @@ static int ec_device_probe(struct platform_device *pdev)
 	}
 
 	/*
-	 * The PCHG device cannot be detected by sending EC_FEATURE_GET_CMD, but
-	 * it can be detected by querying the number of peripheral chargers.
+	 * The battery state, temperatures and fan speeds are published in
+	 * the memory map, which only the main EC has.
 	 */
-	retval = fwk_ec_cmd(ec->ec_dev, 0, EC_CMD_PCHG_COUNT, NULL, 0,
-			     &pchg_count, sizeof(pchg_count));
-	if (retval >= 0 && pchg_count.port_count) {
+	if (ec->ec_dev->cmd_readmem && ec->cmd_offset == 0) {
+		retval = mfd_add_hotplug_devices(ec->dev,
+					fwk_ec_memmap_cells,
+					ARRAY_SIZE(fwk_ec_memmap_cells));
+		if (retval)
+			dev_warn(ec->dev,
+				 "failed to add memory map devices: %d\n",
+				 retval);
+	}
+
+	if (disc->pchg_count) {
 		retval = mfd_add_hotplug_devices(ec->dev,
 					fwk_ec_pchg_cells,
 					ARRAY_SIZE(fwk_ec_pchg_cells));
@@ -271,6 +329,19 @@ static int ec_device_probe(struct platform_device *pdev)
 			 "failed to add fwk-ec platform devices: %d\n",
 			 retval);
 
+	/*
+	 * Only the main EC has ADC channels, GPIOs and an update region
+	 * worth offering; don't have the other MCUs probe for them.
+	 */
+	if (disc->main_ec) {
+		retval = mfd_add_hotplug_devices(ec->dev, fwk_ec_main_cells,
+						 ARRAY_SIZE(fwk_ec_main_cells));
+		if (retval)
+			dev_warn(ec->dev,
+				 "failed to add main EC devices: %d\n",
+				 retval);
+	}
+
 	/* Check whether this EC instance has a VBC NVRAM */
 	node = ec->ec_dev->dev->of_node;
 	if (of_property_read_bool(node, "google,has-vbc-nvram")) {
@@ -281,9 +352,86 @@ static int ec_device_probe(struct platform_device *pdev)
 				 retval);
 	}
 
+	dev_dbg(ec->dev, "adding subdevices took %lld us\n",
+		ktime_us_delta(ktime_get(), start));
+
+	kfree(disc);
+}
+
+static int ec_device_probe(struct platform_device *pdev)
+{
+	int retval = -ENOMEM;
+	struct device *dev = &pdev->dev;
+	struct fwk_ec_platform *ec_platform = dev_get_platdata(dev);
+	struct fwk_ec_dev *ec = kzalloc(sizeof(*ec), GFP_KERNEL);
+	struct fwk_ec_dev_discovery *disc;
+	ktime_t start = ktime_get();
+	int i;
+
+	if (!ec)
+		return retval;
+
+	disc = kzalloc(sizeof(*disc), GFP_KERNEL);
+	if (!disc) {
+		kfree(ec);
+		return retval;
+	}
+
+	dev_set_drvdata(dev, ec);
+	ec->ec_dev = dev_get_drvdata(dev->parent);
+	ec->dev = dev;
+	ec->cmd_offset = ec_platform->cmd_offset;
+	device_initialize(&ec->class_dev);
+
+	disc->ec = ec;
+	ec_device_discover(disc);
+
+	for (i = 0; i < ARRAY_SIZE(fwk_mcu_devices); i++) {
+		/*
+		 * Check whether this is actually a dedicated MCU rather
+		 * than an standard EC.
+		 */
+		if (fwk_ec_check_features(ec, fwk_mcu_devices[i].id)) {
+			dev_info(dev, "CrOS %s MCU detected\n",
+				 fwk_mcu_devices[i].desc);
+			/*
+			 * Help userspace differentiating ECs from other MCU,
+			 * regardless of the probing order.
+			 */
+			ec_platform->ec_name = fwk_mcu_devices[i].name;
+			break;
+		}
+	}
+	disc->main_ec = ec->cmd_offset == 0 &&
+			i == ARRAY_SIZE(fwk_mcu_devices);
+
+	/*
+	 * Add the class device
+	 */
+	ec->class_dev.class = &fwk_class;
+	ec->class_dev.parent = dev;
+	ec->class_dev.release = fwk_ec_class_release;
+
+	retval = dev_set_name(&ec->class_dev, "%s", ec_platform->ec_name);
+	if (retval) {
+		dev_err(dev, "dev_set_name failed => %d\n", retval);
+		goto failed;
+	}
+
+	retval = device_add(&ec->class_dev);
+	if (retval)
+		goto failed;
+
+	async_schedule_domain(ec_device_add_cells, disc,
+			      &fwk_ec_dev_async_domain);
+
+	dev_dbg(dev, "probe took %lld us\n",
+		ktime_us_delta(ktime_get(), start));
+
 	return 0;
 
 failed:
+	kfree(disc);
 	put_device(&ec->class_dev);
 	return retval;
 }
@@ -292,6 +440,7 @@ static int ec_device_remove(struct platform_device *pdev)
 {
 	struct fwk_ec_dev *ec = dev_get_drvdata(&pdev->dev);
 
+	async_synchronize_full_domain(&fwk_ec_dev_async_domain);
 	mfd_remove_devices(ec->dev);
 	device_unregister(&ec->class_dev);
 	return 0;
@@ -0,0 +1,481 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Flash update driver for the ChromeOS EC
+ *
+ * Writes an image to the EC update (non-active RW) region through the
+ * firmware upload API, one erase block at a time. The erase is started
+ * asynchronously when the EC supports it, and the write commands for the
+ * block are staged while the EC erases. The block is then written with
+ * commands of the EC's preferred write size, in short EC lock sessions.
+ */
+
+#include <linux/delay.h>
+#include <linux/device.h>
+#include <linux/firmware.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <fwk_ec_commands.h>
+#include <fwk_ec_proto.h>
+#include <linux/platform_device.h>
+#include <linux/sizes.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#define DRV_NAME	"fwk-ec-flash"
+
+/* Interval between two checks of an asynchronous erase. */
+#define FLASH_ERASE_POLL_US	1000
+/* Time for the EC to erase a single erase block. */
+#define FLASH_ERASE_TIMEOUT_MS	3000
+/* Longest EC lock session while writing. */
+#define FLASH_SESSION_MS	20
+
+/**
+ * struct fwk_ec_flash - Flash update driver data.
+ * @dev: Device, for logging.
+ * @ec: EC device to update.
+ * @fwl: Firmware upload handle.
+ * @cancel: Set when userspace cancels the update.
+ * @region_offset: Offset of the update region.
+ * @region_size: Size of the update region.
+ * @erase_size: Erase block size.
+ * @write_block_size: Writes must be a multiple of this.
+ * @write_size: Size of the data of each write command.
+ * @write_version: EC_CMD_FLASH_WRITE version to use.
+ * @erased: Value of erased flash bytes.
+ * @erase_async: True if the EC supports EC_CMD_FLASH_ERASE v1.
+ * @stage: Write commands for the erase block being written.
+ * @stage_stride: Size of each command of @stage.
+ * @start: Time the update started.
+ * @size: Size of the image.
+ * @skipped: Number of bytes not written as they were erased already.
+ */
+struct fwk_ec_flash {
+	struct device *dev;
+	struct fwk_ec_dev *ec;
+	struct fw_upload *fwl;
+	bool cancel;
+	u32 region_offset;
+	u32 region_size;
+	u32 erase_size;
+	u32 write_block_size;
+	u32 write_size;
+	u8 write_version;
+	u8 erased;
+	bool erase_async;
+	u8 *stage;
+	size_t stage_stride;
+	ktime_t start;
+	u32 size;
+	u32 skipped;
+};
+
+static u32 fwk_ec_flash_cmd_versions(struct fwk_ec_flash *flash, u16 cmd)
+{
+	struct fwk_ec_dev *ec = flash->ec;
+	struct ec_params_get_cmd_versions_v1 params = { .cmd = cmd };
+	struct ec_response_get_cmd_versions resp;
+	int ret;
+
+	ret = fwk_ec_cmd(ec->ec_dev, 1, EC_CMD_GET_CMD_VERSIONS + ec->cmd_offset,
+			 &params, sizeof(params), &resp, sizeof(resp));
+
+	return ret < 0 ? 0 : resp.version_mask;
+}
+
+/*
+ * Read the layout of the flash, the update region and the command versions
+ * the EC supports.
+ */
+static int fwk_ec_flash_query(struct fwk_ec_flash *flash)
+{
+	struct fwk_ec_dev *ec = flash->ec;
+	struct fwk_ec_device *ec_dev = ec->ec_dev;
+	struct ec_params_flash_region_info region_params = {
+		.region = EC_FLASH_REGION_UPDATE,
+	};
+	struct ec_response_flash_region_info region;
+	struct ec_response_flash_info_1 info = {};
+	u32 max_write;
+	int ret;
+
+	ret = fwk_ec_cmd(ec_dev, 1, EC_CMD_FLASH_INFO + ec->cmd_offset,
+			 NULL, 0, &info, sizeof(info));
+	if (ret < 0)
+		ret = fwk_ec_cmd(ec_dev, 0, EC_CMD_FLASH_INFO + ec->cmd_offset,
+				 NULL, 0, &info,
+				 sizeof(struct ec_response_flash_info));
+	if (ret < 0)
+		return ret;
+
+	ret = fwk_ec_cmd(ec_dev, EC_VER_FLASH_REGION_INFO,
+			 EC_CMD_FLASH_REGION_INFO + ec->cmd_offset,
+			 &region_params, sizeof(region_params),
+			 &region, sizeof(region));
+	if (ret < 0)
+		return ret;
+
+	if (!region.size || !info.erase_block_size || !info.write_block_size)
+		return -ENODEV;
+
+	flash->region_offset = region.offset;
+	flash->region_size = region.size;
+	flash->erase_size = info.erase_block_size;
+	flash->write_block_size = info.write_block_size;
+	flash->erased = info.flags & EC_FLASH_INFO_ERASE_TO_0 ? 0x00 : 0xff;
+
+	if (fwk_ec_flash_cmd_versions(flash, EC_CMD_FLASH_WRITE) &
+	    EC_VER_MASK(EC_VER_FLASH_WRITE)) {
+		flash->write_version = EC_VER_FLASH_WRITE;
+		flash->write_size = info.write_ideal_size ?: info.erase_block_size;
+	} else {
+		flash->write_version = 0;
+		flash->write_size = EC_FLASH_WRITE_VER0_SIZE;
+	}
+
+	max_write = ec_dev->max_request - sizeof(struct ec_params_flash_write);
+	flash->write_size = min(flash->write_size, max_write);
+	flash->write_size = rounddown(flash->write_size, flash->write_block_size);
+	if (!flash->write_size)
+		return -ENODEV;
+
+	flash->erase_async = fwk_ec_flash_cmd_versions(flash, EC_CMD_FLASH_ERASE) &
+			     EC_VER_MASK(1);
+
+	return 0;
+}
+
+static enum fw_upload_err fwk_ec_flash_error(int ret)
+{
+	switch (ret) {
+	case -ETIMEDOUT:
+		return FW_UPLOAD_ERR_TIMEOUT;
+	case -EBUSY:
+		return FW_UPLOAD_ERR_BUSY;
+	default:
+		return FW_UPLOAD_ERR_RW_ERROR;
+	}
+}
+
+static enum fw_upload_err fwk_ec_flash_prepare(struct fw_upload *fwl,
+					       const u8 *data, u32 size)
+{
+	struct fwk_ec_flash *flash = fwl->dd_handle;
+	struct ec_response_flash_protect protect;
+	struct ec_params_flash_protect protect_params = {};
+	struct fwk_ec_dev *ec = flash->ec;
+	size_t chunks;
+	int ret;
+
+	/* The layout may differ if the EC was updated and rebooted since. */
+	ret = fwk_ec_flash_query(flash);
+	if (ret < 0) {
+		dev_err(flash->dev, "cannot read the flash layout: %d\n", ret);
+		return FW_UPLOAD_ERR_HW_ERROR;
+	}
+
+	if (size > flash->region_size || size % flash->write_block_size) {
+		dev_err(flash->dev, "invalid image size %u, region is %u\n",
+			size, flash->region_size);
+		return FW_UPLOAD_ERR_INVALID_SIZE;
+	}
+
+	ret = fwk_ec_cmd(ec->ec_dev, EC_VER_FLASH_PROTECT,
+			 EC_CMD_FLASH_PROTECT + ec->cmd_offset,
+			 &protect_params, sizeof(protect_params),
+			 &protect, sizeof(protect));
+	if (ret >= 0 && protect.flags & (EC_FLASH_PROTECT_RW_NOW |
+					 EC_FLASH_PROTECT_ALL_NOW)) {
+		dev_err(flash->dev, "flash is write protected\n");
+		return FW_UPLOAD_ERR_HW_ERROR;
+	}
+
+	flash->stage_stride = ALIGN(sizeof(struct fwk_ec_command) +
+				    sizeof(struct ec_params_flash_write) +
+				    flash->write_size, 8);
+	chunks = DIV_ROUND_UP(flash->erase_size, flash->write_size);
+	flash->stage = kvmalloc_array(chunks, flash->stage_stride, GFP_KERNEL);
+	if (!flash->stage)
+		return FW_UPLOAD_ERR_HW_ERROR;
+
+	WRITE_ONCE(flash->cancel, false);
+	flash->start = ktime_get();
+	flash->size = size;
+	flash->skipped = 0;
+
+	return FW_UPLOAD_ERR_NONE;
+}
+
+static int fwk_ec_flash_erase_start(struct fwk_ec_flash *flash, u32 addr)
+{
+	struct fwk_ec_dev *ec = flash->ec;
+	struct ec_params_flash_erase_v1 params = {
+		.cmd = FLASH_ERASE_SECTOR_ASYNC,
+		.params = {
+			.offset = addr,
+			.size = flash->erase_size,
+		},
+	};
+
+	/* Without v1, the erase completes before the command returns. */
+	if (!flash->erase_async)
+		return fwk_ec_cmd(ec->ec_dev, 0,
+				  EC_CMD_FLASH_ERASE + ec->cmd_offset,
+				  &params.params, sizeof(params.params),
+				  NULL, 0);
+
+	return fwk_ec_cmd(ec->ec_dev, 1, EC_CMD_FLASH_ERASE + ec->cmd_offset,
+			  &params, sizeof(params), NULL, 0);
+}
+
+/*
+ * Poll for the end of an asynchronous erase. The EC is only locked for the
+ * duration of each poll. Some ECs can't answer while they erase, so time
+ * outs are retried as well.
+ */
+static int fwk_ec_flash_erase_wait(struct fwk_ec_flash *flash)
+{
+	struct fwk_ec_dev *ec = flash->ec;
+	struct ec_params_flash_erase_v1 params = {
+		.cmd = FLASH_ERASE_GET_RESULT,
+	};
+	ktime_t deadline;
+	int ret;
+
+	if (!flash->erase_async)
+		return 0;
+
+	deadline = ktime_add_ms(ktime_get(), FLASH_ERASE_TIMEOUT_MS);
+
+	for (;;) {
+		ret = fwk_ec_cmd(ec->ec_dev, 1,
+				 EC_CMD_FLASH_ERASE + ec->cmd_offset,
+				 &params, sizeof(params), NULL, 0);
+		if (ret != -EBUSY && ret != -ETIMEDOUT)
+			return ret < 0 ? ret : 0;
+
+		if (ktime_after(ktime_get(), deadline))
+			return -ETIMEDOUT;
+
+		usleep_range(FLASH_ERASE_POLL_US, 2 * FLASH_ERASE_POLL_US);
+	}
+}
+
+/*
+ * Build the write commands for @len bytes of @data, to be written at @addr.
+ * Chunks that only hold erased bytes are left out.
+ *
+ * Return: the number of commands staged.
+ */
+static int fwk_ec_flash_stage(struct fwk_ec_flash *flash, const u8 *data,
+			      u32 addr, u32 len)
+{
+	struct ec_params_flash_write *params;
+	struct fwk_ec_command *msg;
+	u32 done, chunk;
+	int n = 0;
+
+	for (done = 0; done < len; done += chunk) {
+		chunk = min(len - done, flash->write_size);
+
+		if (!memchr_inv(data + done, flash->erased, chunk)) {
+			flash->skipped += chunk;
+			continue;
+		}
+
+		msg = (struct fwk_ec_command *)(flash->stage +
+						n * flash->stage_stride);
+		params = (struct ec_params_flash_write *)msg->data;
+
+		msg->version = flash->write_version;
+		msg->command = EC_CMD_FLASH_WRITE + flash->ec->cmd_offset;
+		msg->outsize = sizeof(*params) + chunk;
+		msg->insize = 0;
+		params->offset = addr + done;
+		params->size = chunk;
+		memcpy(params + 1, data + done, chunk);
+
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ * Send the @n staged write commands. The EC lock is dropped every
+ * FLASH_SESSION_MS to let events through.
+ */
+static int fwk_ec_flash_write_staged(struct fwk_ec_flash *flash, int n)
+{
+	struct fwk_ec_device *ec_dev = flash->ec->ec_dev;
+	struct fwk_ec_command *msg;
+	ktime_t deadline;
+	int ret = 0;
+	int i;
+
+	if (!n)
+		return 0;
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	deadline = ktime_add_ms(ktime_get(), FLASH_SESSION_MS);
+
+	for (i = 0; i < n; i++) {
+		if (ktime_after(ktime_get(), deadline)) {
+			ec_dev->ec_mutex_unlock(ec_dev);
+			ret = ec_dev->ec_mutex_lock(ec_dev);
+			if (ret)
+				return ret;
+			deadline = ktime_add_ms(ktime_get(), FLASH_SESSION_MS);
+		}
+
+		msg = (struct fwk_ec_command *)(flash->stage +
+						i * flash->stage_stride);
+		ret = fwk_ec_cmd_xfer_status_locked(ec_dev, msg);
+		if (ret < 0)
+			break;
+	}
+
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	return ret < 0 ? ret : 0;
+}
+
+static enum fw_upload_err fwk_ec_flash_write(struct fw_upload *fwl,
+					     const u8 *data, u32 offset,
+					     u32 size, u32 *written)
+{
+	struct fwk_ec_flash *flash = fwl->dd_handle;
+	u32 addr = flash->region_offset + offset;
+	u32 len = min(size, flash->erase_size);
+	int ret, n;
+
+	if (READ_ONCE(flash->cancel))
+		return FW_UPLOAD_ERR_CANCELED;
+
+	ret = fwk_ec_flash_erase_start(flash, addr);
+	if (ret < 0) {
+		dev_err(flash->dev, "erase at 0x%x failed: %d\n", addr, ret);
+		return fwk_ec_flash_error(ret);
+	}
+
+	/* Stage the block while the EC erases. */
+	n = fwk_ec_flash_stage(flash, data + offset, addr, len);
+
+	ret = fwk_ec_flash_erase_wait(flash);
+	if (ret < 0) {
+		dev_err(flash->dev, "erase at 0x%x failed: %d\n", addr, ret);
+		return fwk_ec_flash_error(ret);
+	}
+
+	ret = fwk_ec_flash_write_staged(flash, n);
+	if (ret < 0) {
+		dev_err(flash->dev, "write at 0x%x failed: %d\n", addr, ret);
+		return fwk_ec_flash_error(ret);
+	}
+
+	*written = len;
+
+	return FW_UPLOAD_ERR_NONE;
+}
+
+static enum fw_upload_err fwk_ec_flash_poll_complete(struct fw_upload *fwl)
+{
+	struct fwk_ec_flash *flash = fwl->dd_handle;
+	s64 us = max_t(s64, ktime_us_delta(ktime_get(), flash->start), 1);
+
+	/* Every block is written by the time write() returns. */
+	dev_info(flash->dev,
+		 "wrote %u bytes in %lld ms (%llu KiB/s), %u bytes skipped\n",
+		 flash->size, div_s64(us, USEC_PER_MSEC),
+		 div64_u64((u64)flash->size * USEC_PER_SEC, us * SZ_1K),
+		 flash->skipped);
+
+	return FW_UPLOAD_ERR_NONE;
+}
+
+static void fwk_ec_flash_cancel(struct fw_upload *fwl)
+{
+	struct fwk_ec_flash *flash = fwl->dd_handle;
+
+	WRITE_ONCE(flash->cancel, true);
+}
+
+static void fwk_ec_flash_cleanup(struct fw_upload *fwl)
+{
+	struct fwk_ec_flash *flash = fwl->dd_handle;
+
+	kvfree(flash->stage);
+	flash->stage = NULL;
+}
+
+static const struct fw_upload_ops fwk_ec_flash_ops = {
+	.prepare = fwk_ec_flash_prepare,
+	.write = fwk_ec_flash_write,
+	.poll_complete = fwk_ec_flash_poll_complete,
+	.cancel = fwk_ec_flash_cancel,
+	.cleanup = fwk_ec_flash_cleanup,
+};
+
+static int fwk_ec_flash_probe(struct platform_device *pdev)
+{
+	struct device *dev = &pdev->dev;
+	struct fwk_ec_dev *ec = dev_get_drvdata(dev->parent);
+	struct fwk_ec_platform *ec_platform = dev_get_platdata(ec->dev);
+	struct fwk_ec_flash *flash;
+	int ret;
+
+	flash = devm_kzalloc(dev, sizeof(*flash), GFP_KERNEL);
+	if (!flash)
+		return -ENOMEM;
+
+	flash->dev = dev;
+	flash->ec = ec;
+
+	/* Only offer updates for ECs that have an update region. */
+	ret = fwk_ec_flash_query(flash);
+	if (ret < 0)
+		return -ENODEV;
+
+	flash->fwl = firmware_upload_register(THIS_MODULE, dev,
+					      ec_platform->ec_name,
+					      &fwk_ec_flash_ops, flash);
+	if (IS_ERR(flash->fwl))
+		return PTR_ERR(flash->fwl);
+
+	platform_set_drvdata(pdev, flash);
+
+	return 0;
+}
+
+static void fwk_ec_flash_remove(struct platform_device *pdev)
+{
+	struct fwk_ec_flash *flash = platform_get_drvdata(pdev);
+
+	firmware_upload_unregister(flash->fwl);
+}
+
+static const struct platform_device_id fwk_ec_flash_id[] = {
+	{ DRV_NAME, 0 },
+	{}
+};
+MODULE_DEVICE_TABLE(platform, fwk_ec_flash_id);
+
+static struct platform_driver fwk_ec_flash_driver = {
+	.driver = {
+		.name = DRV_NAME,
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
+	.probe = fwk_ec_flash_probe,
+	.remove_new = fwk_ec_flash_remove,
+	.id_table = fwk_ec_flash_id,
+};
+module_platform_driver(fwk_ec_flash_driver);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("ChromeOS EC flash update driver");
@@ -0,0 +1,278 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * GPIO driver for the GPIOs of the ChromeOS EC
+ *
+ * The EC only lets the host at its GPIOs when write protect is disabled.
+ * GPIOs are read by index and set by name; the names are listed once, at
+ * probe time. Getting or setting several lines at once sends all the EC
+ * commands in a single EC lock session.
+ */
+
+#include <linux/bitops.h>
+#include <linux/gpio/driver.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <fwk_ec_commands.h>
+#include <fwk_ec_proto.h>
+#include <linux/platform_device.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#define DRV_NAME	"fwk-ec-gpio"
+
+/* Prefix all names to avoid collisions with EC <-> AP nets */
+static const char fwk_ec_gpio_prefix[] = "EC:";
+
+/* EC GPIO flags, as reported by EC_GPIO_GET_INFO */
+#define FWK_EC_GPIO_INPUT	BIT(8)
+#define FWK_EC_GPIO_OUTPUT	BIT(9)
+
+/**
+ * struct fwk_ec_gpio - EC GPIO driver data.
+ * @gc: GPIO chip.
+ * @ec: EC device the GPIOs belong to.
+ */
+struct fwk_ec_gpio {
+	struct gpio_chip gc;
+	struct fwk_ec_dev *ec;
+};
+
+static int fwk_ec_gpio_info_locked(struct fwk_ec_gpio *gpio, unsigned int index,
+				   struct ec_response_gpio_get_v1 *response)
+{
+	struct fwk_ec_dev *ec = gpio->ec;
+	struct ec_params_gpio_get_v1 params = {
+		.subcmd = EC_GPIO_GET_INFO,
+		.get_info.index = index,
+	};
+	int ret;
+
+	ret = fwk_ec_cmd_locked(ec->ec_dev, 1, EC_CMD_GPIO_GET + ec->cmd_offset,
+				&params, sizeof(params),
+				response, sizeof(*response));
+
+	return ret < 0 ? ret : 0;
+}
+
+static int fwk_ec_gpio_get_multiple(struct gpio_chip *gc, unsigned long *mask,
+				    unsigned long *bits)
+{
+	struct fwk_ec_gpio *gpio = gpiochip_get_data(gc);
+	struct fwk_ec_device *ec_dev = gpio->ec->ec_dev;
+	struct ec_response_gpio_get_v1 response;
+	unsigned int offset;
+	int ret;
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	for_each_set_bit(offset, mask, gc->ngpio) {
+		ret = fwk_ec_gpio_info_locked(gpio, offset, &response);
+		if (ret) {
+			dev_err(gc->parent, "error getting gpio%u (%s): %d\n",
+				offset, gc->names[offset], ret);
+			break;
+		}
+
+		__assign_bit(offset, bits, response.get_info.val);
+	}
+
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	return ret;
+}
+
+static int fwk_ec_gpio_get(struct gpio_chip *gc, unsigned int offset)
+{
+	unsigned long mask = BIT(offset), bits = 0;
+	int ret;
+
+	ret = fwk_ec_gpio_get_multiple(gc, &mask, &bits);
+	if (ret)
+		return ret;
+
+	return !!(bits & mask);
+}
+
+static void fwk_ec_gpio_set_multiple(struct gpio_chip *gc, unsigned long *mask,
+				     unsigned long *bits)
+{
+	struct fwk_ec_gpio *gpio = gpiochip_get_data(gc);
+	struct fwk_ec_dev *ec = gpio->ec;
+	struct fwk_ec_device *ec_dev = ec->ec_dev;
+	struct ec_params_gpio_set params = {};
+	unsigned int offset;
+	int ret;
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return;
+
+	for_each_set_bit(offset, mask, gc->ngpio) {
+		/* The EC wants the name, without our prefix. */
+		strscpy(params.name,
+			gc->names[offset] + strlen(fwk_ec_gpio_prefix),
+			sizeof(params.name));
+		params.val = test_bit(offset, bits);
+
+		ret = fwk_ec_cmd_locked(ec_dev, 0,
+					EC_CMD_GPIO_SET + ec->cmd_offset,
+					&params, sizeof(params), NULL, 0);
+		if (ret < 0)
+			dev_err(gc->parent, "error setting gpio%u (%s): %d\n",
+				offset, gc->names[offset], ret);
+	}
+
+	ec_dev->ec_mutex_unlock(ec_dev);
+}
+
+static void fwk_ec_gpio_set(struct gpio_chip *gc, unsigned int offset,
+			    int value)
+{
+	unsigned long mask = BIT(offset);
+	unsigned long bits = value ? mask : 0;
+
+	fwk_ec_gpio_set_multiple(gc, &mask, &bits);
+}
+
+static int fwk_ec_gpio_get_direction(struct gpio_chip *gc, unsigned int offset)
+{
+	struct fwk_ec_gpio *gpio = gpiochip_get_data(gc);
+	struct fwk_ec_device *ec_dev = gpio->ec->ec_dev;
+	struct ec_response_gpio_get_v1 response;
+	int ret;
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	ret = fwk_ec_gpio_info_locked(gpio, offset, &response);
+
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	if (ret)
+		return ret;
+
+	if (response.get_info.flags & FWK_EC_GPIO_INPUT)
+		return GPIO_LINE_DIRECTION_IN;
+
+	if (response.get_info.flags & FWK_EC_GPIO_OUTPUT)
+		return GPIO_LINE_DIRECTION_OUT;
+
+	return -EINVAL;
+}
+
+/* List the GPIOs and their names, in one EC lock session. */
+static int fwk_ec_gpio_init_names(struct device *dev, struct fwk_ec_gpio *gpio)
+{
+	struct fwk_ec_dev *ec = gpio->ec;
+	struct fwk_ec_device *ec_dev = ec->ec_dev;
+	struct ec_params_gpio_get_v1 params = {
+		.subcmd = EC_GPIO_GET_COUNT,
+	};
+	struct ec_response_gpio_get_v1 response;
+	const char **names;
+	char *name;
+	int ret, i;
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	ret = fwk_ec_cmd_locked(ec_dev, 1, EC_CMD_GPIO_GET + ec->cmd_offset,
+				&params, sizeof(params),
+				&response, sizeof(response));
+	if (ret < 0)
+		goto unlock;
+
+	gpio->gc.ngpio = response.get_count.val;
+	if (!gpio->gc.ngpio) {
+		ret = -ENODEV;
+		goto unlock;
+	}
+
+	names = devm_kcalloc(dev, gpio->gc.ngpio, sizeof(*names), GFP_KERNEL);
+	if (!names) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	for (i = 0; i < gpio->gc.ngpio; i++) {
+		ret = fwk_ec_gpio_info_locked(gpio, i, &response);
+		if (ret)
+			goto unlock;
+
+		name = devm_kasprintf(dev, GFP_KERNEL, "%s%.*s",
+				      fwk_ec_gpio_prefix,
+				      (int)sizeof(response.get_info.name),
+				      response.get_info.name);
+		if (!name) {
+			ret = -ENOMEM;
+			goto unlock;
+		}
+
+		names[i] = name;
+	}
+
+	gpio->gc.names = names;
+	ret = 0;
+
+unlock:
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	return ret;
+}
+
+static int fwk_ec_gpio_probe(struct platform_device *pdev)
+{
+	struct device *dev = &pdev->dev;
+	struct fwk_ec_dev *ec = dev_get_drvdata(dev->parent);
+	struct fwk_ec_gpio *gpio;
+	int ret;
+
+	gpio = devm_kzalloc(dev, sizeof(*gpio), GFP_KERNEL);
+	if (!gpio)
+		return -ENOMEM;
+
+	gpio->ec = ec;
+
+	/* Write protected ECs deny access to their GPIOs. */
+	ret = fwk_ec_gpio_init_names(dev, gpio);
+	if (ret == -EOPNOTSUPP || ret == -EACCES)
+		return -ENODEV;
+	if (ret)
+		return ret;
+
+	gpio->gc.label = dev_name(dev);
+	gpio->gc.parent = dev;
+	gpio->gc.owner = THIS_MODULE;
+	gpio->gc.base = -1;
+	gpio->gc.can_sleep = true;
+	gpio->gc.get = fwk_ec_gpio_get;
+	gpio->gc.get_multiple = fwk_ec_gpio_get_multiple;
+	gpio->gc.set = fwk_ec_gpio_set;
+	gpio->gc.set_multiple = fwk_ec_gpio_set_multiple;
+	gpio->gc.get_direction = fwk_ec_gpio_get_direction;
+
+	return devm_gpiochip_add_data(dev, &gpio->gc, gpio);
+}
+
+static const struct platform_device_id fwk_ec_gpio_id[] = {
+	{ DRV_NAME, 0 },
+	{}
+};
+MODULE_DEVICE_TABLE(platform, fwk_ec_gpio_id);
+
+static struct platform_driver fwk_ec_gpio_driver = {
+	.driver = {
+		.name = DRV_NAME,
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
+	.probe = fwk_ec_gpio_probe,
+	.id_table = fwk_ec_gpio_id,
+};
+module_platform_driver(fwk_ec_gpio_driver);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("ChromeOS EC GPIO driver");
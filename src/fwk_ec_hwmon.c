@@ -0,0 +1,371 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * hwmon driver for the temperatures and fans of the ChromeOS EC
+ *
+ * The EC keeps its temperature and fan speed readings up to date in the
+ * memory-mapped region. Those are read in a single burst and cached for a
+ * short while, so that polling every hwmon attribute in a row only costs
+ * one memmap read, and never a host command.
+ */
+
+#include <linux/device.h>
+#include <linux/hwmon.h>
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <fwk_ec_commands.h>
+#include <fwk_ec_proto.h>
+#include <linux/platform_device.h>
+#include <linux/slab.h>
+#include <linux/types.h>
+#include <linux/units.h>
+#include <asm/unaligned.h>
+
+#define DRV_NAME	"fwk-ec-hwmon"
+
+/* The EC refreshes the thermal memmap data about once a second. */
+#define FWK_EC_HWMON_CACHE_MS	1000
+
+/* Temperatures, fans and more temperatures are contiguous in the memmap. */
+#define FWK_EC_HWMON_MAP_SIZE	(EC_MEMMAP_TEMP_SENSOR_B + \
+				 EC_TEMP_SENSOR_B_ENTRIES)
+
+#define FWK_EC_HWMON_TEMP_NUM	(EC_TEMP_SENSOR_ENTRIES + \
+				 EC_TEMP_SENSOR_B_ENTRIES)
+
+/**
+ * struct fwk_ec_hwmon_priv - hwmon driver data.
+ * @ec_dev: EC device to read the memory map from.
+ * @lock: Protects @map and @map_time.
+ * @map: Cached copy of the thermal part of the memory map.
+ * @map_time: jiffies when @map was read, only valid if @map_valid.
+ * @map_valid: True if @map holds data.
+ * @thermal_version: EC_MEMMAP_THERMAL_VERSION, read at probe.
+ * @temp_sensor_names: Sensor names, read once at probe.
+ * @usable_fans: Bitmap of fans present at probe.
+ * @usable_temps: Bitmap of temperature sensors present at probe.
+ */
+struct fwk_ec_hwmon_priv {
+	struct fwk_ec_device *ec_dev;
+	struct mutex lock;
+	u8 map[FWK_EC_HWMON_MAP_SIZE];
+	unsigned long map_time;
+	bool map_valid;
+	u8 thermal_version;
+	const char *temp_sensor_names[FWK_EC_HWMON_TEMP_NUM];
+	u8 usable_fans;
+	u32 usable_temps;
+};
+
+static int fwk_ec_hwmon_read_map(struct fwk_ec_hwmon_priv *priv)
+{
+	struct fwk_ec_device *ec_dev = priv->ec_dev;
+	int ret;
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	ret = ec_dev->cmd_readmem(ec_dev, EC_MEMMAP_TEMP_SENSOR,
+				  sizeof(priv->map), priv->map);
+
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	if (ret < 0)
+		return ret;
+
+	priv->map_time = jiffies;
+	priv->map_valid = true;
+
+	return 0;
+}
+
+/*
+ * Make sure the cached memory map is recent enough.
+ *
+ * LOCKING: the caller holds priv->lock.
+ */
+static int fwk_ec_hwmon_refresh(struct fwk_ec_hwmon_priv *priv)
+{
+	if (priv->map_valid &&
+	    time_before(jiffies, priv->map_time +
+				 msecs_to_jiffies(FWK_EC_HWMON_CACHE_MS)))
+		return 0;
+
+	return fwk_ec_hwmon_read_map(priv);
+}
+
+static u16 fwk_ec_hwmon_fan(struct fwk_ec_hwmon_priv *priv, int index)
+{
+	return get_unaligned_le16(&priv->map[EC_MEMMAP_FAN + index * 2]);
+}
+
+static u8 fwk_ec_hwmon_temp(struct fwk_ec_hwmon_priv *priv, int index)
+{
+	if (index < EC_TEMP_SENSOR_ENTRIES)
+		return priv->map[EC_MEMMAP_TEMP_SENSOR + index];
+
+	return priv->map[EC_MEMMAP_TEMP_SENSOR_B + index -
+			 EC_TEMP_SENSOR_ENTRIES];
+}
+
+static bool fwk_ec_hwmon_is_error_fan(u16 speed)
+{
+	return speed == EC_FAN_SPEED_NOT_PRESENT ||
+	       speed == EC_FAN_SPEED_STALLED;
+}
+
+static bool fwk_ec_hwmon_is_error_temp(u8 temp)
+{
+	return temp == EC_TEMP_SENSOR_NOT_PRESENT ||
+	       temp == EC_TEMP_SENSOR_ERROR ||
+	       temp == EC_TEMP_SENSOR_NOT_POWERED ||
+	       temp == EC_TEMP_SENSOR_NOT_CALIBRATED;
+}
+
+static long fwk_ec_hwmon_temp_to_millicelsius(u8 temp)
+{
+	return kelvin_to_millicelsius(((long)temp) + EC_TEMP_SENSOR_OFFSET);
+}
+
+static int fwk_ec_hwmon_read(struct device *dev, enum hwmon_sensor_types type,
+			      u32 attr, int channel, long *val)
+{
+	struct fwk_ec_hwmon_priv *priv = dev_get_drvdata(dev);
+	u16 speed;
+	u8 temp;
+	int ret;
+
+	mutex_lock(&priv->lock);
+
+	ret = fwk_ec_hwmon_refresh(priv);
+	if (ret)
+		goto out;
+
+	if (type == hwmon_fan) {
+		speed = fwk_ec_hwmon_fan(priv, channel);
+		if (attr == hwmon_fan_input) {
+			if (fwk_ec_hwmon_is_error_fan(speed))
+				ret = -ENODATA;
+			else
+				*val = speed;
+		} else if (attr == hwmon_fan_fault) {
+			*val = speed == EC_FAN_SPEED_STALLED;
+		} else {
+			ret = -EOPNOTSUPP;
+		}
+	} else if (type == hwmon_temp) {
+		temp = fwk_ec_hwmon_temp(priv, channel);
+		if (attr == hwmon_temp_input) {
+			if (fwk_ec_hwmon_is_error_temp(temp))
+				ret = -ENODATA;
+			else
+				*val = fwk_ec_hwmon_temp_to_millicelsius(temp);
+		} else if (attr == hwmon_temp_fault) {
+			*val = temp == EC_TEMP_SENSOR_ERROR;
+		} else {
+			ret = -EOPNOTSUPP;
+		}
+	} else {
+		ret = -EOPNOTSUPP;
+	}
+
+out:
+	mutex_unlock(&priv->lock);
+	return ret;
+}
+
+static int fwk_ec_hwmon_read_string(struct device *dev,
+				     enum hwmon_sensor_types type, u32 attr,
+				     int channel, const char **str)
+{
+	struct fwk_ec_hwmon_priv *priv = dev_get_drvdata(dev);
+
+	if (type == hwmon_temp && attr == hwmon_temp_label) {
+		*str = priv->temp_sensor_names[channel];
+		return 0;
+	}
+
+	return -EOPNOTSUPP;
+}
+
+static umode_t fwk_ec_hwmon_is_visible(const void *data,
+					enum hwmon_sensor_types type,
+					u32 attr, int channel)
+{
+	const struct fwk_ec_hwmon_priv *priv = data;
+
+	if (type == hwmon_fan) {
+		if (priv->usable_fans & BIT(channel))
+			return 0444;
+	} else if (type == hwmon_temp) {
+		if (attr == hwmon_temp_label &&
+		    !priv->temp_sensor_names[channel])
+			return 0;
+		if (priv->usable_temps & BIT(channel))
+			return 0444;
+	}
+
+	return 0;
+}
+
+static const struct hwmon_channel_info * const fwk_ec_hwmon_info[] = {
+	HWMON_CHANNEL_INFO(chip, HWMON_C_REGISTER_TZ),
+	HWMON_CHANNEL_INFO(fan,
+			   HWMON_F_INPUT | HWMON_F_FAULT,
+			   HWMON_F_INPUT | HWMON_F_FAULT,
+			   HWMON_F_INPUT | HWMON_F_FAULT,
+			   HWMON_F_INPUT | HWMON_F_FAULT),
+	HWMON_CHANNEL_INFO(temp,
+			   HWMON_T_INPUT | HWMON_T_FAULT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_FAULT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_FAULT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_FAULT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_FAULT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_FAULT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_FAULT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_FAULT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_FAULT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_FAULT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_FAULT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_FAULT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_FAULT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_FAULT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_FAULT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_FAULT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_FAULT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_FAULT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_FAULT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_FAULT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_FAULT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_FAULT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_FAULT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_FAULT | HWMON_T_LABEL),
+	NULL
+};
+
+static const struct hwmon_ops fwk_ec_hwmon_ops = {
+	.read = fwk_ec_hwmon_read,
+	.read_string = fwk_ec_hwmon_read_string,
+	.is_visible = fwk_ec_hwmon_is_visible,
+};
+
+static const struct hwmon_chip_info fwk_ec_hwmon_chip_info = {
+	.ops = &fwk_ec_hwmon_ops,
+	.info = fwk_ec_hwmon_info,
+};
+
+/*
+ * Work out which fans and sensors exist from the memmap snapshot taken at
+ * probe, and ask the EC for all the sensor names in one lock session.
+ */
+static int fwk_ec_hwmon_probe_sensors(struct device *dev,
+				       struct fwk_ec_hwmon_priv *priv)
+{
+	struct fwk_ec_device *ec_dev = priv->ec_dev;
+	struct ec_params_temp_sensor_get_info req = {};
+	struct ec_response_temp_sensor_get_info resp;
+	int num_temps = EC_TEMP_SENSOR_ENTRIES;
+	int ret;
+	int i;
+
+	for (i = 0; i < EC_FAN_SPEED_ENTRIES; i++)
+		if (fwk_ec_hwmon_fan(priv, i) != EC_FAN_SPEED_NOT_PRESENT)
+			priv->usable_fans |= BIT(i);
+
+	if (priv->thermal_version >= 2)
+		num_temps += EC_TEMP_SENSOR_B_ENTRIES;
+
+	for (i = 0; i < num_temps; i++)
+		if (fwk_ec_hwmon_temp(priv, i) != EC_TEMP_SENSOR_NOT_PRESENT)
+			priv->usable_temps |= BIT(i);
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < num_temps; i++) {
+		if (!(priv->usable_temps & BIT(i)))
+			continue;
+
+		req.id = i;
+		ret = fwk_ec_cmd_locked(ec_dev, 0,
+					 EC_CMD_TEMP_SENSOR_GET_INFO,
+					 &req, sizeof(req),
+					 &resp, sizeof(resp));
+		if (ret < 0)
+			continue;
+
+		resp.sensor_name[sizeof(resp.sensor_name) - 1] = '\0';
+		priv->temp_sensor_names[i] =
+			devm_kstrdup(dev, resp.sensor_name, GFP_KERNEL);
+	}
+
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	return 0;
+}
+
+static int fwk_ec_hwmon_probe(struct platform_device *pdev)
+{
+	struct device *dev = &pdev->dev;
+	struct fwk_ec_dev *ec = dev_get_drvdata(dev->parent);
+	struct fwk_ec_device *ec_dev = ec->ec_dev;
+	struct fwk_ec_hwmon_priv *priv;
+	struct device *hwmon_dev;
+	int ret;
+
+	if (!ec_dev->cmd_readmem)
+		return -ENODEV;
+
+	priv = devm_kzalloc(dev, sizeof(*priv), GFP_KERNEL);
+	if (!priv)
+		return -ENOMEM;
+
+	priv->ec_dev = ec_dev;
+
+	mutex_init(&priv->lock);
+
+	/* EC_MEMMAP_THERMAL_VERSION is 0 if the thermal data is unsupported */
+	ret = ec_dev->cmd_readmem(ec_dev, EC_MEMMAP_THERMAL_VERSION, 1,
+				  &priv->thermal_version);
+	if (ret < 0)
+		return ret;
+
+	if (!priv->thermal_version)
+		return -ENODEV;
+
+	ret = fwk_ec_hwmon_read_map(priv);
+	if (ret)
+		return ret;
+
+	ret = fwk_ec_hwmon_probe_sensors(dev, priv);
+	if (ret)
+		return ret;
+
+	hwmon_dev = devm_hwmon_device_register_with_info(dev, "cros_ec", priv,
+							 &fwk_ec_hwmon_chip_info,
+							 NULL);
+
+	return PTR_ERR_OR_ZERO(hwmon_dev);
+}
+
+static const struct platform_device_id fwk_ec_hwmon_id[] = {
+	{ DRV_NAME, 0 },
+	{}
+};
+MODULE_DEVICE_TABLE(platform, fwk_ec_hwmon_id);
+
+static struct platform_driver fwk_ec_hwmon_driver = {
+	.driver = {
+		.name = DRV_NAME,
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
+	.probe = fwk_ec_hwmon_probe,
+	.id_table = fwk_ec_hwmon_id,
+};
+module_platform_driver(fwk_ec_hwmon_driver);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("ChromeOS EC hwmon driver");
@@ -0,0 +1,341 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * I2C adapters for the buses behind the ChromeOS EC
+ *
+ * The EC gives access to its I2C buses with EC_CMD_I2C_PASSTHRU, which
+ * carries several messages. The messages of a transfer are packed into as
+ * few passthru commands as the EC request and response sizes allow, so a
+ * register write followed by a read costs a single EC round trip.
+ */
+
+#include <linux/device.h>
+#include <linux/i2c.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <fwk_ec_commands.h>
+#include <fwk_ec_proto.h>
+#include <linux/platform_device.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/types.h>
+
+#define DRV_NAME	"fwk-ec-i2c"
+
+/* Highest number of I2C ports looked for on the EC. */
+#define FWK_EC_I2C_MAX_PORTS	16
+
+/* The number of messages of a passthru command is a u8. */
+#define FWK_EC_I2C_MAX_MSGS	U8_MAX
+
+static unsigned long ports;
+module_param(ports, ulong, 0444);
+MODULE_PARM_DESC(ports,
+		 "Bitmask of the EC I2C ports to expose, if the EC can't list them");
+
+/**
+ * struct fwk_ec_i2c_bus - One I2C port of the EC.
+ * @adap: I2C adapter.
+ * @quirks: Message length limits, from the EC protocol sizes.
+ * @ec: EC device the port belongs to.
+ * @port: EC I2C port number.
+ * @buf_size: Size of the data of @msg.
+ * @msg: Passthru command buffer, serialized by the adapter bus lock.
+ */
+struct fwk_ec_i2c_bus {
+	struct i2c_adapter adap;
+	struct i2c_adapter_quirks quirks;
+	struct fwk_ec_dev *ec;
+	u8 port;
+	u16 buf_size;
+	struct fwk_ec_command *msg;
+};
+
+/*
+ * Return how many of the @num messages fit in a single passthru command,
+ * given the request and response payload limits.
+ */
+static int fwk_ec_i2c_count_fit(const struct i2c_msg *msgs, int num,
+				size_t out_max, size_t in_max)
+{
+	size_t out = sizeof(struct ec_params_i2c_passthru);
+	size_t in = sizeof(struct ec_response_i2c_passthru);
+	int i;
+
+	num = min_t(int, num, FWK_EC_I2C_MAX_MSGS);
+
+	for (i = 0; i < num; i++) {
+		out += sizeof(struct ec_params_i2c_passthru_msg);
+		if (msgs[i].flags & I2C_M_RD)
+			in += msgs[i].len;
+		else
+			out += msgs[i].len;
+
+		if (out > out_max || in > in_max)
+			break;
+	}
+
+	return i;
+}
+
+static void fwk_ec_i2c_construct(struct fwk_ec_i2c_bus *bus,
+				 const struct i2c_msg *msgs, int num)
+{
+	struct fwk_ec_command *msg = bus->msg;
+	struct ec_params_i2c_passthru *params = (void *)msg->data;
+	struct ec_params_i2c_passthru_msg *params_msg = params->msg;
+	u8 *out = (u8 *)&params->msg[num];
+	int insize = sizeof(struct ec_response_i2c_passthru);
+	int i;
+
+	params->port = bus->port;
+	params->num_msgs = num;
+
+	for (i = 0; i < num; i++, params_msg++) {
+		params_msg->addr_flags = msgs[i].addr;
+		params_msg->len = msgs[i].len;
+
+		if (msgs[i].flags & I2C_M_RD) {
+			params_msg->addr_flags |= EC_I2C_FLAG_READ;
+			insize += msgs[i].len;
+		} else {
+			memcpy(out, msgs[i].buf, msgs[i].len);
+			out += msgs[i].len;
+		}
+	}
+
+	msg->version = 0;
+	msg->command = EC_CMD_I2C_PASSTHRU + bus->ec->cmd_offset;
+	msg->outsize = out - msg->data;
+	msg->insize = insize;
+}
+
+/*
+ * Copy the data read back to the messages. Return the number of messages
+ * the EC went through, or a negative error code.
+ */
+static int fwk_ec_i2c_parse(struct fwk_ec_i2c_bus *bus,
+			    struct i2c_msg *msgs, int num)
+{
+	struct ec_response_i2c_passthru *resp = (void *)bus->msg->data;
+	const u8 *in = resp->data;
+	int i;
+
+	if (resp->i2c_status & EC_I2C_STATUS_TIMEOUT)
+		return -ETIMEDOUT;
+	else if (resp->i2c_status & EC_I2C_STATUS_NAK)
+		return -ENXIO;
+	else if (resp->i2c_status & EC_I2C_STATUS_ERROR)
+		return -EIO;
+
+	/* The EC could go through fewer messages, but not more. */
+	if (resp->num_msgs > num)
+		return -EPROTO;
+
+	for (i = 0; i < resp->num_msgs; i++) {
+		if (!(msgs[i].flags & I2C_M_RD))
+			continue;
+
+		memcpy(msgs[i].buf, in, msgs[i].len);
+		in += msgs[i].len;
+	}
+
+	return resp->num_msgs;
+}
+
+static int fwk_ec_i2c_xfer(struct i2c_adapter *adap, struct i2c_msg *msgs,
+			   int num)
+{
+	struct fwk_ec_i2c_bus *bus = i2c_get_adapdata(adap);
+	struct fwk_ec_device *ec_dev = bus->ec->ec_dev;
+	size_t out_max, in_max;
+	int done = 0;
+	int ret, i, n;
+
+	for (i = 0; i < num; i++) {
+		if (msgs[i].flags & I2C_M_TEN)
+			return -EOPNOTSUPP;
+	}
+
+	/*
+	 * Hold the EC across the whole transfer, so that no other command
+	 * gets in between the passthru commands of a split transfer.
+	 */
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	out_max = min(bus->buf_size, ec_dev->max_request);
+	in_max = min(bus->buf_size, ec_dev->max_response);
+
+	while (done < num) {
+		n = fwk_ec_i2c_count_fit(&msgs[done], num - done,
+					 out_max, in_max);
+		if (!n) {
+			ret = -EOPNOTSUPP;
+			break;
+		}
+
+		fwk_ec_i2c_construct(bus, &msgs[done], n);
+
+		ret = fwk_ec_cmd_xfer_status_locked(ec_dev, bus->msg);
+		if (ret < 0) {
+			if (ret != -EACCES)
+				dev_err(&adap->dev,
+					"Error transferring EC i2c message %d\n",
+					ret);
+			break;
+		}
+
+		ret = fwk_ec_i2c_parse(bus, &msgs[done], n);
+		if (ret < 0)
+			break;
+
+		done += ret;
+		if (ret < n)
+			break;
+	}
+
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	return ret < 0 ? ret : done;
+}
+
+static u32 fwk_ec_i2c_functionality(struct i2c_adapter *adap)
+{
+	return I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL;
+}
+
+static const struct i2c_algorithm fwk_ec_i2c_algorithm = {
+	.master_xfer	= fwk_ec_i2c_xfer,
+	.functionality	= fwk_ec_i2c_functionality,
+};
+
+static int fwk_ec_i2c_add_bus(struct device *dev, struct fwk_ec_dev *ec,
+			      u8 port)
+{
+	struct fwk_ec_device *ec_dev = ec->ec_dev;
+	struct fwk_ec_i2c_bus *bus;
+
+	bus = devm_kzalloc(dev, sizeof(*bus), GFP_KERNEL);
+	if (!bus)
+		return -ENOMEM;
+
+	bus->ec = ec;
+	bus->port = port;
+	bus->buf_size = max(ec_dev->max_request, ec_dev->max_response);
+	bus->msg = devm_kzalloc(dev, sizeof(*bus->msg) + bus->buf_size,
+				GFP_KERNEL);
+	if (!bus->msg)
+		return -ENOMEM;
+
+	/*
+	 * A message too large for a passthru command on its own can't be
+	 * split, have the I2C core reject it upfront.
+	 */
+	bus->quirks.max_write_len = ec_dev->max_request -
+		sizeof(struct ec_params_i2c_passthru) -
+		sizeof(struct ec_params_i2c_passthru_msg);
+	bus->quirks.max_read_len = ec_dev->max_response -
+		sizeof(struct ec_response_i2c_passthru);
+
+	bus->adap.owner = THIS_MODULE;
+	snprintf(bus->adap.name, sizeof(bus->adap.name), "%s port %u",
+		 DRV_NAME, port);
+	bus->adap.algo = &fwk_ec_i2c_algorithm;
+	bus->adap.quirks = &bus->quirks;
+	bus->adap.dev.parent = dev;
+	bus->adap.retries = 3;
+	i2c_set_adapdata(&bus->adap, bus);
+
+	return devm_i2c_add_adapter(dev, &bus->adap);
+}
+
+/*
+ * The EC rejects EC_CMD_I2C_PASSTHRU_PROTECT for the ports it doesn't have,
+ * which makes it a way to list them. Protected ports are left out, as the
+ * EC denies passthru on them anyway.
+ */
+static int fwk_ec_i2c_find_ports(struct device *dev, struct fwk_ec_dev *ec,
+				 unsigned long *mask)
+{
+	struct fwk_ec_device *ec_dev = ec->ec_dev;
+	struct ec_params_i2c_passthru_protect params = {
+		.subcmd = EC_CMD_I2C_PASSTHRU_PROTECT_STATUS,
+	};
+	struct ec_response_i2c_passthru_protect resp;
+	int ret, port;
+
+	*mask = 0;
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	for (port = 0; port < FWK_EC_I2C_MAX_PORTS; port++) {
+		params.port = port;
+		ret = fwk_ec_cmd_locked(ec_dev, 0,
+					EC_CMD_I2C_PASSTHRU_PROTECT +
+					ec->cmd_offset,
+					&params, sizeof(params),
+					&resp, sizeof(resp));
+		if (ret == -EOPNOTSUPP)
+			break;
+		if (ret < 0)
+			continue;
+
+		if (resp.status) {
+			dev_info(dev, "port %d is protected, skipping\n", port);
+			continue;
+		}
+
+		*mask |= BIT(port);
+	}
+
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	return ret == -EOPNOTSUPP ? ret : 0;
+}
+
+static int fwk_ec_i2c_probe(struct platform_device *pdev)
+{
+	struct device *dev = &pdev->dev;
+	struct fwk_ec_dev *ec = dev_get_drvdata(dev->parent);
+	unsigned long mask;
+	int ret, port;
+
+	ret = fwk_ec_i2c_find_ports(dev, ec, &mask);
+	if (ret == -EOPNOTSUPP)
+		mask = ports;
+	else if (ret)
+		return ret;
+
+	if (!mask)
+		return -ENODEV;
+
+	for_each_set_bit(port, &mask, FWK_EC_I2C_MAX_PORTS) {
+		ret = fwk_ec_i2c_add_bus(dev, ec, port);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static const struct platform_device_id fwk_ec_i2c_id[] = {
+	{ DRV_NAME, 0 },
+	{}
+};
+MODULE_DEVICE_TABLE(platform, fwk_ec_i2c_id);
+
+static struct platform_driver fwk_ec_i2c_driver = {
+	.driver = {
+		.name = DRV_NAME,
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
+	.probe = fwk_ec_i2c_probe,
+	.id_table = fwk_ec_i2c_id,
+};
+module_platform_driver(fwk_ec_i2c_driver);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("ChromeOS EC I2C passthru adapter");
@@ -0,0 +1,232 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Keyboard backlight LED driver for the ChromeOS EC
+ *
+ * Brightness changes are not sent to the EC right away: they only update
+ * the wanted brightness, and a work item sends it, at most max_rate times
+ * a second. A fade going through dozens of levels thus costs a handful of
+ * EC commands, and the last level set always reaches the EC.
+ *
+ * The EC also changes the brightness on its own, e.g. on Fn+Space, so it
+ * is read back from the EC rather than cached, and every level set is sent
+ * even if it matches the last one sent.
+ */
+
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/leds.h>
+#include <linux/module.h>
+#include <fwk_ec_commands.h>
+#include <fwk_ec_proto.h>
+#include <linux/platform_device.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#define DRV_NAME	"fwk-ec-kbd-led"
+
+/* Longest wait before trying again to send a brightness the EC refused. */
+#define FWK_EC_KBD_LED_MAX_RETRY_MS	5000
+
+static unsigned int max_rate = 20;
+module_param(max_rate, uint, 0644);
+MODULE_PARM_DESC(max_rate,
+		 "Maximum keyboard backlight updates sent to the EC per second");
+
+/**
+ * struct fwk_ec_kbd_led - Keyboard backlight driver data.
+ * @cdev: LED class device.
+ * @ec: EC device the backlight belongs to.
+ * @work: Sends @wanted to the EC.
+ * @wanted: Brightness last set through the LED class device.
+ * @sent_at: Jiffies when the brightness was last sent.
+ * @retry_delay: Wait before trying again after a failed send, in jiffies,
+ *               0 after a successful one. Only used by @work.
+ */
+struct fwk_ec_kbd_led {
+	struct led_classdev cdev;
+	struct fwk_ec_dev *ec;
+	struct delayed_work work;
+	int wanted;
+	unsigned long sent_at;
+	unsigned long retry_delay;
+};
+
+static int fwk_ec_kbd_led_read(struct fwk_ec_kbd_led *led)
+{
+	struct fwk_ec_dev *ec = led->ec;
+	struct ec_response_pwm_get_keyboard_backlight resp;
+	int ret;
+
+	ret = fwk_ec_cmd(ec->ec_dev, 0,
+			 EC_CMD_PWM_GET_KEYBOARD_BACKLIGHT + ec->cmd_offset,
+			 NULL, 0, &resp, sizeof(resp));
+	if (ret < 0)
+		return ret;
+
+	return resp.enabled ? resp.percent : 0;
+}
+
+static int fwk_ec_kbd_led_send(struct fwk_ec_kbd_led *led, int brightness)
+{
+	struct fwk_ec_dev *ec = led->ec;
+	struct ec_params_pwm_set_keyboard_backlight params = {
+		.percent = brightness,
+	};
+	int ret;
+
+	ret = fwk_ec_cmd(ec->ec_dev, 0,
+			 EC_CMD_PWM_SET_KEYBOARD_BACKLIGHT + ec->cmd_offset,
+			 &params, sizeof(params), NULL, 0);
+
+	return ret < 0 ? ret : 0;
+}
+
+static void fwk_ec_kbd_led_work(struct work_struct *work)
+{
+	struct fwk_ec_kbd_led *led = container_of(to_delayed_work(work),
+						  struct fwk_ec_kbd_led, work);
+	int brightness = READ_ONCE(led->wanted);
+	unsigned long period;
+	unsigned int rate;
+	int ret;
+
+	ret = fwk_ec_kbd_led_send(led, brightness);
+	if (ret) {
+		dev_warn_ratelimited(led->cdev.dev,
+				     "failed to set brightness: %d\n", ret);
+
+		/*
+		 * Try again, doubling the wait each time, from the max_rate
+		 * period up to FWK_EC_KBD_LED_MAX_RETRY_MS, so that the last
+		 * brightness set still reaches the EC.
+		 */
+		rate = READ_ONCE(max_rate);
+		period = rate ? DIV_ROUND_UP(HZ, rate) : 1;
+		led->retry_delay = clamp(led->retry_delay * 2, period,
+				msecs_to_jiffies(FWK_EC_KBD_LED_MAX_RETRY_MS));
+		schedule_delayed_work(&led->work, led->retry_delay);
+		return;
+	}
+
+	led->retry_delay = 0;
+	WRITE_ONCE(led->sent_at, jiffies);
+}
+
+/* May be called from atomic context, e.g. by LED triggers. */
+static void fwk_ec_kbd_led_set(struct led_classdev *cdev,
+			       enum led_brightness brightness)
+{
+	struct fwk_ec_kbd_led *led = container_of(cdev, struct fwk_ec_kbd_led,
+						  cdev);
+	unsigned int rate = READ_ONCE(max_rate);
+	unsigned long next = jiffies;
+
+	WRITE_ONCE(led->wanted, brightness);
+
+	if (rate)
+		next = READ_ONCE(led->sent_at) + DIV_ROUND_UP(HZ, rate);
+
+	/*
+	 * Does nothing if an update is already pending: it will read the
+	 * new brightness when it runs.
+	 */
+	schedule_delayed_work(&led->work,
+			      time_after(next, jiffies) ? next - jiffies : 0);
+}
+
+static enum led_brightness fwk_ec_kbd_led_get(struct led_classdev *cdev)
+{
+	struct fwk_ec_kbd_led *led = container_of(cdev, struct fwk_ec_kbd_led,
+						  cdev);
+	int brightness;
+
+	/* The brightness last set has not reached the EC yet. */
+	if (delayed_work_pending(&led->work))
+		return READ_ONCE(led->wanted);
+
+	brightness = fwk_ec_kbd_led_read(led);
+	if (brightness < 0)
+		return READ_ONCE(led->wanted);
+
+	return brightness;
+}
+
+static int fwk_ec_kbd_led_probe(struct platform_device *pdev)
+{
+	struct device *dev = &pdev->dev;
+	struct fwk_ec_dev *ec = dev_get_drvdata(dev->parent);
+	struct fwk_ec_kbd_led *led;
+	int ret;
+
+	led = devm_kzalloc(dev, sizeof(*led), GFP_KERNEL);
+	if (!led)
+		return -ENOMEM;
+
+	led->ec = ec;
+	INIT_DELAYED_WORK(&led->work, fwk_ec_kbd_led_work);
+
+	ret = fwk_ec_kbd_led_read(led);
+	if (ret < 0)
+		return ret;
+
+	led->wanted = ret;
+	led->sent_at = jiffies;
+
+	led->cdev.name = "chromeos::kbd_backlight";
+	led->cdev.max_brightness = 100;
+	led->cdev.flags |= LED_CORE_SUSPENDRESUME;
+	led->cdev.brightness = led->wanted;
+	led->cdev.brightness_set = fwk_ec_kbd_led_set;
+	led->cdev.brightness_get = fwk_ec_kbd_led_get;
+
+	platform_set_drvdata(pdev, led);
+
+	return led_classdev_register(dev, &led->cdev);
+}
+
+static void fwk_ec_kbd_led_remove(struct platform_device *pdev)
+{
+	struct fwk_ec_kbd_led *led = platform_get_drvdata(pdev);
+
+	led_classdev_unregister(&led->cdev);
+
+	/*
+	 * Apply the last brightness now rather than dropping it, and stop
+	 * retrying if the EC refuses it.
+	 */
+	flush_delayed_work(&led->work);
+	cancel_delayed_work_sync(&led->work);
+}
+
+static int __maybe_unused fwk_ec_kbd_led_suspend(struct device *dev)
+{
+	struct fwk_ec_kbd_led *led = dev_get_drvdata(dev);
+
+	/* The LED core turned the backlight off, don't leave that pending. */
+	flush_delayed_work(&led->work);
+
+	return 0;
+}
+
+static SIMPLE_DEV_PM_OPS(fwk_ec_kbd_led_pm_ops, fwk_ec_kbd_led_suspend, NULL);
+
+static const struct platform_device_id fwk_ec_kbd_led_id[] = {
+	{ DRV_NAME, 0 },
+	{}
+};
+MODULE_DEVICE_TABLE(platform, fwk_ec_kbd_led_id);
+
+static struct platform_driver fwk_ec_kbd_led_driver = {
+	.driver = {
+		.name = DRV_NAME,
+		.pm = &fwk_ec_kbd_led_pm_ops,
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
+	.probe = fwk_ec_kbd_led_probe,
+	.remove_new = fwk_ec_kbd_led_remove,
+	.id_table = fwk_ec_kbd_led_id,
+};
+module_platform_driver(fwk_ec_kbd_led_driver);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("ChromeOS EC keyboard backlight LED driver");
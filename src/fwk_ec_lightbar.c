@@ -0,0 +1,515 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Lightbar driver for the ChromeOS EC
+ *
+ * The lightbar is driven through the subcommands of EC_CMD_LIGHTBAR_CMD.
+ * The driver remembers what it last set, brightness, program and userspace
+ * control, and drops the commands that would not change anything. Several
+ * LED colors written at once are sent in a single EC lock session. The
+ * attributes live on the platform device, and are linked from the EC class
+ * device as "lightbar".
+ *
+ * Neither the sequence nor the LED colors are cached: the EC changes the
+ * sequence on its own, on power state transitions or when a one-shot
+ * sequence ends, and each sequence repaints the LEDs.
+ */
+
+#include <linux/ctype.h>
+#include <linux/device.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <fwk_ec_commands.h>
+#include <fwk_ec_proto.h>
+#include <linux/platform_device.h>
+#include <linux/slab.h>
+#include <linux/stddef.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
+
+#define DRV_NAME	"fwk-ec-lightbar"
+
+/* Number of LEDs; LED index FWK_EC_LIGHTBAR_LEDS sets them all. */
+#define FWK_EC_LIGHTBAR_LEDS	4
+
+/* Most LED colors taken by a single write of led_rgb. */
+#define FWK_EC_LIGHTBAR_MAX_RGB	32
+
+/* Size of the parameters of a subcommand. */
+#define LB_PARAMS_SIZE(member)	offsetofend(struct ec_params_lightbar, member)
+
+/* Sequence names, in EC order. */
+static const char * const fwk_ec_lightbar_seqname[] = {
+	"ERROR", "S5", "S3", "S0", "S5S3", "S3S0",
+	"S0S3", "S3S5", "STOP", "RUN", "KONAMI", "TAP", "PROGRAM",
+};
+
+/**
+ * struct fwk_ec_lightbar - Lightbar driver data.
+ * @ec: EC device the lightbar belongs to.
+ * @lock: Protects @msg and the cached state.
+ * @msg: Command sent to the EC.
+ * @params: Parameters in @msg.
+ * @resp: Response in @msg.
+ * @version: Lightbar version, as reported by the EC.
+ * @flags: Lightbar flags, as reported by the EC.
+ * @brightness_valid: @brightness is known.
+ * @brightness: Brightness last set.
+ * @program_valid: @program is known.
+ * @program: Program last uploaded.
+ * @userspace_control: Userspace took over the suspend and resume
+ *                     sequences.
+ */
+struct fwk_ec_lightbar {
+	struct fwk_ec_dev *ec;
+	struct mutex lock;
+	struct fwk_ec_command *msg;
+	struct ec_params_lightbar *params;
+	struct ec_response_lightbar *resp;
+	u32 version;
+	u32 flags;
+	bool brightness_valid;
+	u8 brightness;
+	bool program_valid;
+	struct lightbar_program program;
+	bool userspace_control;
+};
+
+/* Send the subcommand in params. Called with lock and the EC lock held. */
+static int fwk_ec_lightbar_xfer_locked(struct fwk_ec_lightbar *lb,
+					size_t outsize, size_t insize)
+{
+	struct fwk_ec_dev *ec = lb->ec;
+	int ret;
+
+	lb->msg->version = 0;
+	lb->msg->command = EC_CMD_LIGHTBAR_CMD + ec->cmd_offset;
+	lb->msg->outsize = outsize;
+	lb->msg->insize = insize;
+
+	ret = fwk_ec_cmd_xfer_status_locked(ec->ec_dev, lb->msg);
+
+	return ret < 0 ? ret : 0;
+}
+
+/* Same as fwk_ec_lightbar_xfer_locked(), in its own EC lock session. */
+static int fwk_ec_lightbar_xfer(struct fwk_ec_lightbar *lb,
+				 size_t outsize, size_t insize)
+{
+	struct fwk_ec_device *ec_dev = lb->ec->ec_dev;
+	int ret;
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	ret = fwk_ec_lightbar_xfer_locked(lb, outsize, insize);
+
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	return ret;
+}
+
+/* Forget everything set, the EC may not have kept it. */
+static void fwk_ec_lightbar_invalidate(struct fwk_ec_lightbar *lb)
+{
+	mutex_lock(&lb->lock);
+	lb->brightness_valid = false;
+	lb->program_valid = false;
+	mutex_unlock(&lb->lock);
+}
+
+static ssize_t version_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct fwk_ec_lightbar *lb = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u %u\n", lb->version, lb->flags);
+}
+
+static ssize_t brightness_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct fwk_ec_lightbar *lb = dev_get_drvdata(dev);
+	int ret = 0;
+
+	mutex_lock(&lb->lock);
+
+	if (!lb->brightness_valid) {
+		lb->params->cmd = LIGHTBAR_CMD_GET_BRIGHTNESS;
+		ret = fwk_ec_lightbar_xfer(lb, LB_PARAMS_SIZE(cmd),
+					   sizeof(lb->resp->get_brightness));
+		if (!ret) {
+			lb->brightness = lb->resp->get_brightness.num;
+			lb->brightness_valid = true;
+		}
+	}
+
+	if (!ret)
+		ret = sysfs_emit(buf, "%u\n", lb->brightness);
+
+	mutex_unlock(&lb->lock);
+
+	return ret;
+}
+
+static ssize_t brightness_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct fwk_ec_lightbar *lb = dev_get_drvdata(dev);
+	u8 val;
+	int ret;
+
+	ret = kstrtou8(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	mutex_lock(&lb->lock);
+
+	if (lb->brightness_valid && lb->brightness == val)
+		goto unlock;
+
+	lb->params->cmd = LIGHTBAR_CMD_SET_BRIGHTNESS;
+	lb->params->set_brightness.num = val;
+	ret = fwk_ec_lightbar_xfer(lb, LB_PARAMS_SIZE(set_brightness), 0);
+
+	lb->brightness = val;
+	lb->brightness_valid = !ret;
+unlock:
+	mutex_unlock(&lb->lock);
+
+	return ret ?: count;
+}
+
+/* Set the colors of the LEDs in one EC lock session. Called with lock held. */
+static int fwk_ec_lightbar_set_rgb(struct fwk_ec_lightbar *lb,
+				    u8 (*quads)[4], int n)
+{
+	struct fwk_ec_device *ec_dev = lb->ec->ec_dev;
+	int ret, i;
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < n; i++) {
+		lb->params->cmd = LIGHTBAR_CMD_SET_RGB;
+		lb->params->set_rgb.led = quads[i][0];
+		lb->params->set_rgb.red = quads[i][1];
+		lb->params->set_rgb.green = quads[i][2];
+		lb->params->set_rgb.blue = quads[i][3];
+
+		ret = fwk_ec_lightbar_xfer_locked(lb, LB_PARAMS_SIZE(set_rgb),
+						  0);
+		if (ret)
+			break;
+	}
+
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	return ret;
+}
+
+/*
+ * Takes quadruples of "LED R G B", LED FWK_EC_LIGHTBAR_LEDS or above
+ * meaning all of them, e.g. "0 255 0 0 1 0 255 0".
+ */
+static ssize_t led_rgb_store(struct device *dev,
+			     struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct fwk_ec_lightbar *lb = dev_get_drvdata(dev);
+	u8 (*quads)[4];
+	unsigned int val;
+	int i = 0, j = 0;
+	int ret, len;
+
+	quads = kcalloc(FWK_EC_LIGHTBAR_MAX_RGB, sizeof(*quads), GFP_KERNEL);
+	if (!quads)
+		return -ENOMEM;
+
+	while (sscanf(buf, "%u%n", &val, &len) == 1) {
+		if (val > U8_MAX || i == FWK_EC_LIGHTBAR_MAX_RGB) {
+			ret = -EINVAL;
+			goto out;
+		}
+
+		quads[i][j] = val;
+		if (++j == 4) {
+			i++;
+			j = 0;
+		}
+
+		buf += len;
+	}
+
+	while (isspace(*buf))
+		buf++;
+	if (*buf || j || !i) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	mutex_lock(&lb->lock);
+	ret = fwk_ec_lightbar_set_rgb(lb, quads, i);
+	mutex_unlock(&lb->lock);
+out:
+	kfree(quads);
+
+	return ret ?: count;
+}
+
+static ssize_t sequence_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct fwk_ec_lightbar *lb = dev_get_drvdata(dev);
+	int ret;
+
+	mutex_lock(&lb->lock);
+
+	lb->params->cmd = LIGHTBAR_CMD_GET_SEQ;
+	ret = fwk_ec_lightbar_xfer(lb, LB_PARAMS_SIZE(cmd),
+				   sizeof(lb->resp->get_seq));
+	if (ret)
+		goto unlock;
+
+	if (lb->resp->get_seq.num < ARRAY_SIZE(fwk_ec_lightbar_seqname))
+		ret = sysfs_emit(buf, "%s\n",
+				 fwk_ec_lightbar_seqname[lb->resp->get_seq.num]);
+	else
+		ret = sysfs_emit(buf, "%u\n", lb->resp->get_seq.num);
+unlock:
+	mutex_unlock(&lb->lock);
+
+	return ret;
+}
+
+/* Takes a sequence name or number. */
+static ssize_t sequence_store(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct fwk_ec_lightbar *lb = dev_get_drvdata(dev);
+	u8 num;
+	int ret;
+
+	ret = sysfs_match_string(fwk_ec_lightbar_seqname, buf);
+	if (ret >= 0) {
+		num = ret;
+	} else {
+		ret = kstrtou8(buf, 0, &num);
+		if (ret)
+			return ret;
+	}
+
+	mutex_lock(&lb->lock);
+	lb->params->cmd = LIGHTBAR_CMD_SEQ;
+	lb->params->seq.num = num;
+	ret = fwk_ec_lightbar_xfer(lb, LB_PARAMS_SIZE(seq), 0);
+	mutex_unlock(&lb->lock);
+
+	return ret ?: count;
+}
+
+/*
+ * Takes the raw program, run by the PROGRAM sequence. The whole program is
+ * uploaded with a single command, carrying only the program bytes, and not
+ * uploaded again if it did not change.
+ */
+static ssize_t program_store(struct device *dev,
+			     struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct fwk_ec_lightbar *lb = dev_get_drvdata(dev);
+	struct fwk_ec_device *ec_dev = lb->ec->ec_dev;
+	size_t outsize;
+	int ret = 0;
+
+	if (!count || count > EC_LB_PROG_LEN)
+		return -EINVAL;
+
+	outsize = offsetof(struct ec_params_lightbar, set_program.data) + count;
+	if (outsize > ec_dev->max_request)
+		return -EINVAL;
+
+	mutex_lock(&lb->lock);
+
+	if (lb->program_valid && lb->program.size == count &&
+	    !memcmp(lb->program.data, buf, count))
+		goto unlock;
+
+	lb->params->cmd = LIGHTBAR_CMD_SET_PROGRAM;
+	lb->params->set_program.size = count;
+	memcpy(lb->params->set_program.data, buf, count);
+	ret = fwk_ec_lightbar_xfer(lb, outsize, 0);
+
+	lb->program = lb->params->set_program;
+	lb->program_valid = !ret;
+unlock:
+	mutex_unlock(&lb->lock);
+
+	return ret ?: count;
+}
+
+static ssize_t userspace_control_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct fwk_ec_lightbar *lb = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%d\n", READ_ONCE(lb->userspace_control));
+}
+
+/*
+ * When set, the EC leaves the suspend and resume sequences to userspace,
+ * and the driver runs them itself when the system suspends and resumes.
+ */
+static ssize_t userspace_control_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	struct fwk_ec_lightbar *lb = dev_get_drvdata(dev);
+	bool enable;
+	int ret;
+
+	ret = kstrtobool(buf, &enable);
+	if (ret)
+		return ret;
+
+	mutex_lock(&lb->lock);
+
+	if (lb->userspace_control == enable)
+		goto unlock;
+
+	lb->params->cmd = LIGHTBAR_CMD_MANUAL_SUSPEND_CTRL;
+	lb->params->manual_suspend_ctrl.enable = enable;
+	ret = fwk_ec_lightbar_xfer(lb, LB_PARAMS_SIZE(manual_suspend_ctrl), 0);
+	if (!ret)
+		WRITE_ONCE(lb->userspace_control, enable);
+unlock:
+	mutex_unlock(&lb->lock);
+
+	return ret ?: count;
+}
+
+static DEVICE_ATTR_RO(version);
+static DEVICE_ATTR_RW(brightness);
+static DEVICE_ATTR_WO(led_rgb);
+static DEVICE_ATTR_RW(sequence);
+static DEVICE_ATTR_WO(program);
+static DEVICE_ATTR_RW(userspace_control);
+
+static struct attribute *fwk_ec_lightbar_attrs[] = {
+	&dev_attr_version.attr,
+	&dev_attr_brightness.attr,
+	&dev_attr_led_rgb.attr,
+	&dev_attr_sequence.attr,
+	&dev_attr_program.attr,
+	&dev_attr_userspace_control.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(fwk_ec_lightbar);
+
+static void fwk_ec_lightbar_remove_link(void *data)
+{
+	struct fwk_ec_dev *ec = data;
+
+	sysfs_remove_link(&ec->class_dev.kobj, "lightbar");
+}
+
+static int fwk_ec_lightbar_probe(struct platform_device *pdev)
+{
+	struct device *dev = &pdev->dev;
+	struct fwk_ec_dev *ec = dev_get_drvdata(dev->parent);
+	struct fwk_ec_lightbar *lb;
+	int ret;
+
+	lb = devm_kzalloc(dev, sizeof(*lb), GFP_KERNEL);
+	if (!lb)
+		return -ENOMEM;
+
+	lb->msg = devm_kzalloc(dev, sizeof(*lb->msg) +
+			       max(sizeof(*lb->params), sizeof(*lb->resp)),
+			       GFP_KERNEL);
+	if (!lb->msg)
+		return -ENOMEM;
+
+	lb->ec = ec;
+	lb->params = (struct ec_params_lightbar *)lb->msg->data;
+	lb->resp = (struct ec_response_lightbar *)lb->msg->data;
+	mutex_init(&lb->lock);
+
+	/* The cell is added on some devices that turn out not to have one. */
+	lb->params->cmd = LIGHTBAR_CMD_VERSION;
+	ret = fwk_ec_lightbar_xfer(lb, LB_PARAMS_SIZE(cmd),
+				   sizeof(lb->resp->version));
+	if (ret)
+		return -ENODEV;
+
+	lb->version = lb->resp->version.num;
+	lb->flags = lb->resp->version.flags;
+
+	platform_set_drvdata(pdev, lb);
+
+	ret = sysfs_create_link(&ec->class_dev.kobj, &dev->kobj, "lightbar");
+	if (ret)
+		return ret;
+
+	return devm_add_action_or_reset(dev, fwk_ec_lightbar_remove_link, ec);
+}
+
+static int __maybe_unused fwk_ec_lightbar_suspend(struct device *dev)
+{
+	struct fwk_ec_lightbar *lb = dev_get_drvdata(dev);
+	int ret = 0;
+
+	mutex_lock(&lb->lock);
+	if (lb->userspace_control) {
+		lb->params->cmd = LIGHTBAR_CMD_SUSPEND;
+		ret = fwk_ec_lightbar_xfer(lb, LB_PARAMS_SIZE(cmd), 0);
+	}
+	mutex_unlock(&lb->lock);
+
+	return ret;
+}
+
+static int __maybe_unused fwk_ec_lightbar_resume(struct device *dev)
+{
+	struct fwk_ec_lightbar *lb = dev_get_drvdata(dev);
+	int ret = 0;
+
+	fwk_ec_lightbar_invalidate(lb);
+
+	mutex_lock(&lb->lock);
+	if (lb->userspace_control) {
+		lb->params->cmd = LIGHTBAR_CMD_RESUME;
+		ret = fwk_ec_lightbar_xfer(lb, LB_PARAMS_SIZE(cmd), 0);
+	}
+	mutex_unlock(&lb->lock);
+
+	return ret;
+}
+
+static SIMPLE_DEV_PM_OPS(fwk_ec_lightbar_pm_ops,
+			 fwk_ec_lightbar_suspend, fwk_ec_lightbar_resume);
+
+static const struct platform_device_id fwk_ec_lightbar_id[] = {
+	{ DRV_NAME, 0 },
+	{}
+};
+MODULE_DEVICE_TABLE(platform, fwk_ec_lightbar_id);
+
+static struct platform_driver fwk_ec_lightbar_driver = {
+	.driver = {
+		.name = DRV_NAME,
+		.dev_groups = fwk_ec_lightbar_groups,
+		.pm = &fwk_ec_lightbar_pm_ops,
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
+	.probe = fwk_ec_lightbar_probe,
+	.id_table = fwk_ec_lightbar_id,
+};
+module_platform_driver(fwk_ec_lightbar_driver);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("ChromeOS EC lightbar driver");
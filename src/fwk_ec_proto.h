@@ -8,10 +8,12 @@
 #ifndef __LINUX_FWK_EC_PROTO_H
 #define __LINUX_FWK_EC_PROTO_H
 
+#include <linux/atomic.h>
 #include <linux/device.h>
 #include <linux/lockdep_types.h>
 #include <linux/mutex.h>
 #include <linux/notifier.h>
+#include <linux/seqlock.h>
 
 #include <fwk_ec_commands.h>
 
@@ -26,6 +28,7 @@
 
 #define FWK_EC_DEV_EC_INDEX 0
 #define FWK_EC_DEV_PD_INDEX 1
+#define FWK_EC_DEV_MAX_INDEX FWK_EC_DEV_PD_INDEX
 
 /*
  * The EC is unresponsive for a time after a reboot command.  Add a
@@ -50,6 +53,9 @@
  */
 #define ACPI_NOTIFY_FWK_EC_PANIC 0xB0
 
+/* How long a charger state snapshot is served from the cache by default. */
+#define FWK_EC_CHARGE_TTL_MS_DEFAULT	1000
+
 /*
  * Command interface between EC and AP, for LPC, I2C and SPI interfaces.
  */
@@ -85,6 +91,102 @@ struct fwk_ec_command {
 	uint8_t data[];
 };
 
+/**
+ * struct fwk_ec_feature_cache - Cached EC_CMD_GET_FEATURES response.
+ * @seq: Sequence lock protecting the other fields. Writers hold the EC
+ *       lock as well, readers do not take any lock. A seqlock rather than
+ *       a bare seqcount, as the EC lock does not disable preemption.
+ * @flags: Feature bitmap as reported by the EC.
+ * @valid: True once @flags holds a successful response.
+ * @retry_after: After a failure, jiffies before which the EC is not asked
+ *               again.
+ */
+struct fwk_ec_feature_cache {
+	seqlock_t seq;
+	u32 flags[2];
+	bool valid;
+	unsigned long retry_after;
+};
+
+/* Responses kept in the Type-C cache, see struct fwk_ec_typec_cache. */
+enum fwk_ec_typec_entry {
+	FWK_EC_TYPEC_STATUS,
+	FWK_EC_TYPEC_POWER_INFO,
+	FWK_EC_TYPEC_MUX_INFO,
+	FWK_EC_TYPEC_ENTRIES,
+};
+
+/**
+ * struct fwk_ec_typec_cache - Cached Type-C state of a USB-C port.
+ * @seq: Sequence lock protecting the fields below @invalidations. Writers
+ *       hold the EC lock as well, readers do not take any lock.
+ * @invalidations: Bumped each time the state of the port may have changed.
+ *                 Does not need any lock.
+ * @valid: Bitmask of the enum fwk_ec_typec_entry responses held.
+ * @gen: @invalidations when each response was requested. A response is
+ *       stale once @invalidations moved past it.
+ * @status: EC_CMD_TYPEC_STATUS response.
+ * @power_info: EC_CMD_USB_PD_POWER_INFO response.
+ * @mux_info: EC_CMD_USB_PD_MUX_INFO response.
+ */
+struct fwk_ec_typec_cache {
+	seqlock_t seq;
+	atomic_t invalidations;
+	unsigned long valid;
+	int gen[FWK_EC_TYPEC_ENTRIES];
+	struct ec_response_typec_status status;
+	struct ec_response_usb_pd_power_info power_info;
+	struct ec_response_usb_pd_mux_info mux_info;
+};
+
+/**
+ * struct fwk_ec_charge_snapshot - Charger state, gathered in one EC lock
+ *                                 session.
+ * @timestamp: Boot time clock when the state was gathered, in ns.
+ * @ac: Non-zero if AC is connected.
+ * @chg_voltage: Charger voltage, in mV.
+ * @chg_current: Charger current, in mA.
+ * @chg_input_current: Charger input current limit, in mA.
+ * @batt_state_of_charge: Battery state of charge, in %.
+ * @params_valid: Bitmask of the CS_PARAM_* read into @params.
+ * @params: CHARGE_STATE_CMD_GET_PARAM values, indexed by CS_PARAM_*.
+ * @power_info_valid: Non-zero if @power_info was read.
+ * @power_info: EC_CMD_POWER_INFO response.
+ *
+ * This is also the layout of the debugfs charge_snapshot file.
+ */
+struct fwk_ec_charge_snapshot {
+	u64 timestamp;
+	s32 ac;
+	s32 chg_voltage;
+	s32 chg_current;
+	s32 chg_input_current;
+	s32 batt_state_of_charge;
+	u32 params_valid;
+	u32 params[CS_NUM_BASE_PARAMS];
+	u32 power_info_valid;
+	struct ec_response_power_info power_info;
+};
+
+/**
+ * struct fwk_ec_charge_cache - Cached charger state.
+ * @seq: Sequence lock protecting the fields below @invalidations. Writers
+ *       hold the EC lock as well, readers do not take any lock.
+ * @invalidations: Bumped on AC and battery events. Does not need any lock.
+ * @valid: True once @snap holds a snapshot.
+ * @gen: @invalidations when @snap was gathered.
+ * @expires: Jiffies after which @snap is too old to be served.
+ * @snap: Last snapshot.
+ */
+struct fwk_ec_charge_cache {
+	seqlock_t seq;
+	atomic_t invalidations;
+	bool valid;
+	int gen;
+	unsigned long expires;
+	struct fwk_ec_charge_snapshot snap;
+};
+
 /**
  * struct fwk_ec_device - Information about a ChromeOS EC device.
  * @phys_name: Name of physical comms layer (e.g. 'i2c-4').
@@ -155,6 +257,15 @@ struct fwk_ec_command {
  * @pd: The platform_device used by the mfd driver to interface with the
  *      PD behind an EC.
  * @panic_notifier: EC panic notifier.
+ * @features: EC_CMD_GET_FEATURES cache for the EC and each device behind it,
+ *            indexed by passthru index (see EC_CMD_PASSTHRU_OFFSET()).
+ *            Survives re-probes of the fwk_ec_dev instances, and is
+ *            invalidated when the EC protocol is queried again (e.g. after
+ *            a sysjump).
+ * @typec: Type-C state cache of each USB-C port of the EC, see
+ *         fwk_ec_typec_get_status().
+ * @charge_ttl_ms: How long a charger state snapshot is served from @charge.
+ * @charge: Charger state cache, see fwk_ec_get_charge_snapshot().
  */
 struct fwk_ec_device {
 	/* These are used by other drivers that want to talk to the EC */
@@ -203,6 +314,12 @@ struct fwk_ec_device {
 	struct platform_device *pd;
 
 	struct blocking_notifier_head panic_notifier;
+
+	struct fwk_ec_feature_cache features[FWK_EC_DEV_MAX_INDEX + 1];
+	struct fwk_ec_typec_cache typec[EC_USB_PD_MAX_PORTS];
+
+	u16 charge_ttl_ms;
+	struct fwk_ec_charge_cache charge;
 };
 
 /**
@@ -225,7 +342,6 @@ struct fwk_ec_platform {
  * @debug_info: fwk_ec_debugfs structure for debugging information.
  * @has_kb_wake_angle: True if at least 2 accelerometer are connected to the EC.
  * @cmd_offset: Offset to apply for each command.
- * @features: Features supported by the EC.
  */
 struct fwk_ec_dev {
 	struct device class_dev;
@@ -234,11 +350,26 @@ struct fwk_ec_dev {
 	struct fwk_ec_debugfs *debug_info;
 	bool has_kb_wake_angle;
 	u16 cmd_offset;
-	struct ec_response_get_features features;
 };
 
 #define to_fwk_ec_dev(dev)  container_of(dev, struct fwk_ec_dev, class_dev)
 
+/**
+ * struct fwk_ec_accel_snapshot - Legacy accelerometer data, as published by
+ *                                the EC in the memory map.
+ * @sample_id: Sample id from EC_MEMMAP_ACC_STATUS, incremented by the EC on
+ *             every update.
+ * @lid_angle: Lid angle in degrees, or LID_ANGLE_UNRELIABLE.
+ * @accel: x, y and z of the first (lid) and second (base) accelerometers.
+ * @gyro: x, y and z of the gyroscope.
+ */
+struct fwk_ec_accel_snapshot {
+	u8 sample_id;
+	s16 lid_angle;
+	s16 accel[2][3];
+	s16 gyro[3];
+};
+
 int fwk_ec_prepare_tx(struct fwk_ec_device *ec_dev,
 		       struct fwk_ec_command *msg);
 
@@ -251,21 +382,60 @@ int fwk_ec_cmd_xfer(struct fwk_ec_device *ec_dev,
 int fwk_ec_cmd_xfer_status(struct fwk_ec_device *ec_dev,
 			    struct fwk_ec_command *msg);
 
+int fwk_ec_cmd_xfer_locked(struct fwk_ec_device *ec_dev,
+			    struct fwk_ec_command *msg);
+
+int fwk_ec_cmd_xfer_status_locked(struct fwk_ec_device *ec_dev,
+				   struct fwk_ec_command *msg);
+
 int fwk_ec_query_all(struct fwk_ec_device *ec_dev);
 
+void fwk_ec_init_features(struct fwk_ec_device *ec_dev);
+
 int fwk_ec_get_next_event(struct fwk_ec_device *ec_dev,
 			   bool *wake_event,
 			   bool *has_more_events);
 
 u32 fwk_ec_get_host_event(struct fwk_ec_device *ec_dev);
 
+int fwk_ec_get_features_locked(struct fwk_ec_dev *ec);
+
 bool fwk_ec_check_features(struct fwk_ec_dev *ec, int feature);
 
 int fwk_ec_get_sensor_count(struct fwk_ec_dev *ec);
 
+int fwk_ec_get_sensor_count_locked(struct fwk_ec_dev *ec);
+
+int fwk_ec_read_accel_snapshot(struct fwk_ec_device *ec_dev,
+				struct fwk_ec_accel_snapshot *snap);
+
+void fwk_ec_typec_invalidate(struct fwk_ec_device *ec_dev, int port);
+
+int fwk_ec_typec_get_status(struct fwk_ec_device *ec_dev, int port,
+			     struct ec_response_typec_status *status);
+
+int fwk_ec_usb_pd_get_power_info(struct fwk_ec_device *ec_dev, int port,
+				  struct ec_response_usb_pd_power_info *info);
+
+int fwk_ec_usb_pd_get_mux_info(struct fwk_ec_device *ec_dev, int port,
+				struct ec_response_usb_pd_mux_info *info);
+
+int fwk_ec_get_charge_snapshot(struct fwk_ec_device *ec_dev,
+				struct fwk_ec_charge_snapshot *snap);
+
+int fwk_ec_fp_frame_read(struct fwk_ec_dev *ec, unsigned int index,
+			  void *buf, size_t size);
+
+int fwk_ec_tp_frames_read(struct fwk_ec_dev *ec, const u32 *sizes,
+			   unsigned int n_frames, unsigned long frames,
+			   void *buf);
+
 int fwk_ec_cmd(struct fwk_ec_device *ec_dev, unsigned int version, int command, const void *outdata,
 		    size_t outsize, void *indata, size_t insize);
 
+int fwk_ec_cmd_locked(struct fwk_ec_device *ec_dev, unsigned int version, int command,
+		       const void *outdata, size_t outsize, void *indata, size_t insize);
+
 /**
  * fwk_ec_get_time_ns() - Return time in ns.
  *
@@ -15,6 +15,8 @@
 
 #define EC_COMMAND_RETRIES	50
 
+static void fwk_ec_invalidate_features(struct fwk_ec_device *ec_dev);
+
 static const int fwk_ec_error_map[] = {
 	[EC_RES_INVALID_COMMAND] = -EOPNOTSUPP,
 	[EC_RES_ERROR] = -EIO,
@@ -518,6 +520,10 @@ int fwk_ec_query_all(struct fwk_ec_device *ec_dev)
 		}
 	}
 
+	/* The EC may have jumped to an image with different features. */
+	fwk_ec_invalidate_features(ec_dev);
+	fwk_ec_typec_invalidate(ec_dev, -1);
+
 	devm_kfree(dev, ec_dev->din);
 	devm_kfree(dev, ec_dev->dout);
 
@@ -584,40 +590,56 @@ exit:
 }
 EXPORT_SYMBOL(fwk_ec_query_all);
 
+/*
+ * Return the USB-C port whose state @msg may change, or -1. The parameters
+ * are overwritten by the response, so this is looked at before sending.
+ */
+static int fwk_ec_typec_cmd_port(struct fwk_ec_command *msg)
+{
+	struct ec_params_usb_pd_control *pd_control;
+
+	if (!msg->outsize)
+		return -1;
+
+	switch (msg->command) {
+	case EC_CMD_USB_PD_MUX_ACK:
+	case EC_CMD_TYPEC_CONTROL:
+		return msg->data[0];
+	case EC_CMD_USB_PD_CONTROL:
+		if (msg->outsize < sizeof(*pd_control))
+			return -1;
+		/* Without any change requested, this is a status query. */
+		pd_control = (struct ec_params_usb_pd_control *)msg->data;
+		if (pd_control->role || pd_control->mux || pd_control->swap)
+			return pd_control->port;
+		return -1;
+	default:
+		return -1;
+	}
+}
+
 /**
- * fwk_ec_cmd_xfer() - Send a command to the ChromeOS EC.
+ * fwk_ec_cmd_xfer_locked() - Send a command to the ChromeOS EC, lock held.
  * @ec_dev: EC device.
  * @msg: Message to write.
  *
- * Call this to send a command to the ChromeOS EC. This should be used instead
- * of calling the EC's cmd_xfer() callback directly. This function does not
- * convert EC command execution error codes to Linux error codes. Most
- * in-kernel users will want to use fwk_ec_cmd_xfer_status() instead since
- * that function implements the conversion.
+ * Same as fwk_ec_cmd_xfer(), but the caller must already hold the EC lock
+ * (taken with ec_dev->ec_mutex_lock()). This lets a caller issue several
+ * commands back to back in a single lock session.
  *
- * Return:
- * >0 - EC command was executed successfully. The return value is the number
- *      of bytes returned by the EC (excluding the header).
- * =0 - EC communication was successful. EC command execution results are
- *      reported in msg->result. The result will be EC_RES_SUCCESS if the
- *      command was executed successfully or report an EC command execution
- *      error.
- * <0 - EC communication error. Return value is the Linux error code.
+ * Return: see fwk_ec_cmd_xfer().
  */
-int fwk_ec_cmd_xfer(struct fwk_ec_device *ec_dev, struct fwk_ec_command *msg)
+int fwk_ec_cmd_xfer_locked(struct fwk_ec_device *ec_dev,
+			    struct fwk_ec_command *msg)
 {
+	int typec_port;
 	int ret;
 
-	ret = ec_dev->ec_mutex_lock(ec_dev);
-	if (ret)
-		return ret;
-
 	if (ec_dev->proto_version == EC_PROTO_VERSION_UNKNOWN) {
 		ret = fwk_ec_query_all(ec_dev);
 		if (ret) {
 			dev_err(ec_dev->dev,
 				"EC version unknown and query failed; aborting command\n");
-			ec_dev->ec_mutex_unlock(ec_dev);
 			return ret;
 		}
 	}
@@ -633,7 +655,6 @@ int fwk_ec_cmd_xfer(struct fwk_ec_device *ec_dev, struct fwk_ec_command *msg)
 				"request of size %u is too big (max: %u)\n",
 				msg->outsize,
 				ec_dev->max_request);
-			ec_dev->ec_mutex_unlock(ec_dev);
 			return -EMSGSIZE;
 		}
 	} else {
@@ -642,37 +663,61 @@ int fwk_ec_cmd_xfer(struct fwk_ec_device *ec_dev, struct fwk_ec_command *msg)
 				"passthru rq of size %u is too big (max: %u)\n",
 				msg->outsize,
 				ec_dev->max_passthru);
-			ec_dev->ec_mutex_unlock(ec_dev);
 			return -EMSGSIZE;
 		}
 	}
 
+	typec_port = fwk_ec_typec_cmd_port(msg);
+
 	ret = fwk_ec_send_command(ec_dev, msg);
-	ec_dev->ec_mutex_unlock(ec_dev);
+
+	if (typec_port >= 0 && ret >= 0 && msg->result == EC_RES_SUCCESS)
+		fwk_ec_typec_invalidate(ec_dev, typec_port);
 
 	return ret;
 }
-EXPORT_SYMBOL(fwk_ec_cmd_xfer);
+EXPORT_SYMBOL(fwk_ec_cmd_xfer_locked);
 
 /**
- * fwk_ec_cmd_xfer_status() - Send a command to the ChromeOS EC.
+ * fwk_ec_cmd_xfer() - Send a command to the ChromeOS EC.
  * @ec_dev: EC device.
  * @msg: Message to write.
  *
- * Call this to send a command to the ChromeOS EC. This should be used instead of calling the EC's
- * cmd_xfer() callback directly. It returns success status only if both the command was transmitted
- * successfully and the EC replied with success status.
+ * Call this to send a command to the ChromeOS EC. This should be used instead
+ * of calling the EC's cmd_xfer() callback directly. This function does not
+ * convert EC command execution error codes to Linux error codes. Most
+ * in-kernel users will want to use fwk_ec_cmd_xfer_status() instead since
+ * that function implements the conversion.
  *
  * Return:
- * >=0 - The number of bytes transferred.
- * <0 - Linux error code
+ * >0 - EC command was executed successfully. The return value is the number
+ *      of bytes returned by the EC (excluding the header).
+ * =0 - EC communication was successful. EC command execution results are
+ *      reported in msg->result. The result will be EC_RES_SUCCESS if the
+ *      command was executed successfully or report an EC command execution
+ *      error.
+ * <0 - EC communication error. Return value is the Linux error code.
  */
-int fwk_ec_cmd_xfer_status(struct fwk_ec_device *ec_dev,
-			    struct fwk_ec_command *msg)
+int fwk_ec_cmd_xfer(struct fwk_ec_device *ec_dev, struct fwk_ec_command *msg)
 {
-	int ret, mapped;
+	int ret;
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	ret = fwk_ec_cmd_xfer_locked(ec_dev, msg);
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	return ret;
+}
+EXPORT_SYMBOL(fwk_ec_cmd_xfer);
+
+static int fwk_ec_map_xfer_status(struct fwk_ec_device *ec_dev,
+				   struct fwk_ec_command *msg, int ret)
+{
+	int mapped;
 
-	ret = fwk_ec_cmd_xfer(ec_dev, msg);
 	if (ret < 0)
 		return ret;
 
@@ -685,8 +730,49 @@ int fwk_ec_cmd_xfer_status(struct fwk_ec_device *ec_dev,
 
 	return ret;
 }
+
+/**
+ * fwk_ec_cmd_xfer_status() - Send a command to the ChromeOS EC.
+ * @ec_dev: EC device.
+ * @msg: Message to write.
+ *
+ * Call this to send a command to the ChromeOS EC. This should be used instead of calling the EC's
+ * cmd_xfer() callback directly. It returns success status only if both the command was transmitted
+ * successfully and the EC replied with success status.
+ *
+ * Return:
+ * >=0 - The number of bytes transferred.
+ * <0 - Linux error code
+ */
+int fwk_ec_cmd_xfer_status(struct fwk_ec_device *ec_dev,
+			    struct fwk_ec_command *msg)
+{
+	return fwk_ec_map_xfer_status(ec_dev, msg,
+				       fwk_ec_cmd_xfer(ec_dev, msg));
+}
 EXPORT_SYMBOL(fwk_ec_cmd_xfer_status);
 
+/**
+ * fwk_ec_cmd_xfer_status_locked() - Send a command to the ChromeOS EC, lock
+ *                                    held.
+ * @ec_dev: EC device.
+ * @msg: Message to write.
+ *
+ * Same as fwk_ec_cmd_xfer_status(), but the caller must already hold the EC
+ * lock.
+ *
+ * Return:
+ * >=0 - The number of bytes transferred.
+ * <0 - Linux error code
+ */
+int fwk_ec_cmd_xfer_status_locked(struct fwk_ec_device *ec_dev,
+				   struct fwk_ec_command *msg)
+{
+	return fwk_ec_map_xfer_status(ec_dev, msg,
+				       fwk_ec_cmd_xfer_locked(ec_dev, msg));
+}
+EXPORT_SYMBOL(fwk_ec_cmd_xfer_status_locked);
+
 static int get_next_event_xfer(struct fwk_ec_device *ec_dev,
 			       struct fwk_ec_command *msg,
 			       struct ec_response_get_next_event_v1 *event,
@@ -837,9 +923,21 @@ int fwk_ec_get_next_event(struct fwk_ec_device *ec_dev,
 			EC_MKBP_HAS_MORE_EVENTS;
 	ec_dev->event_data.event_type &= EC_MKBP_EVENT_TYPE_MASK;
 
+	host_event = fwk_ec_get_host_event(ec_dev);
+
+	/* The events don't tell which port changed, forget them all. */
+	if (host_event & (EC_HOST_EVENT_MASK(EC_HOST_EVENT_PD_MCU) |
+			  EC_HOST_EVENT_MASK(EC_HOST_EVENT_USB_MUX)))
+		fwk_ec_typec_invalidate(ec_dev, -1);
+
+	if (host_event & (EC_HOST_EVENT_MASK(EC_HOST_EVENT_AC_CONNECTED) |
+			  EC_HOST_EVENT_MASK(EC_HOST_EVENT_AC_DISCONNECTED) |
+			  EC_HOST_EVENT_MASK(EC_HOST_EVENT_BATTERY) |
+			  EC_HOST_EVENT_MASK(EC_HOST_EVENT_BATTERY_STATUS)))
+		atomic_inc(&ec_dev->charge.invalidations);
+
 	if (wake_event) {
 		event_type = ec_dev->event_data.event_type;
-		host_event = fwk_ec_get_host_event(ec_dev);
 
 		/*
 		 * Sensor events need to be parsed by the sensor sub-device.
@@ -892,6 +990,143 @@ u32 fwk_ec_get_host_event(struct fwk_ec_device *ec_dev)
 }
 EXPORT_SYMBOL(fwk_ec_get_host_event);
 
+/* Don't ask the EC for its features again sooner than this after a failure */
+#define FWK_EC_FEATURES_RETRY_MS	1000
+
+static struct fwk_ec_feature_cache *fwk_ec_feature_cache(struct fwk_ec_dev *ec)
+{
+	unsigned int idx = ec->cmd_offset / EC_CMD_PASSTHRU_OFFSET(1);
+
+	if (WARN_ON_ONCE(idx > FWK_EC_DEV_MAX_INDEX))
+		return NULL;
+
+	return &ec->ec_dev->features[idx];
+}
+
+/**
+ * fwk_ec_init_features() - Initialize the EC features, Type-C and charger
+ *                          caches.
+ * @ec_dev: EC device.
+ *
+ * Called once when the EC device is registered.
+ */
+void fwk_ec_init_features(struct fwk_ec_device *ec_dev)
+{
+	int i;
+
+	for (i = 0; i <= FWK_EC_DEV_MAX_INDEX; i++) {
+		seqlock_init(&ec_dev->features[i].seq);
+		ec_dev->features[i].valid = false;
+		ec_dev->features[i].retry_after = jiffies;
+	}
+
+	for (i = 0; i < EC_USB_PD_MAX_PORTS; i++) {
+		seqlock_init(&ec_dev->typec[i].seq);
+		atomic_set(&ec_dev->typec[i].invalidations, 0);
+		ec_dev->typec[i].valid = 0;
+	}
+
+	seqlock_init(&ec_dev->charge.seq);
+	atomic_set(&ec_dev->charge.invalidations, 0);
+	ec_dev->charge.valid = false;
+}
+EXPORT_SYMBOL(fwk_ec_init_features);
+
+/*
+ * Forget the cached features, e.g. because the EC jumped to another image.
+ *
+ * LOCKING: the caller has ec_dev->lock mutex, or the caller knows there is
+ * no other command in progress.
+ */
+static void fwk_ec_invalidate_features(struct fwk_ec_device *ec_dev)
+{
+	struct fwk_ec_feature_cache *cache;
+	int i;
+
+	for (i = 0; i <= FWK_EC_DEV_MAX_INDEX; i++) {
+		cache = &ec_dev->features[i];
+
+		write_seqlock(&cache->seq);
+		cache->valid = false;
+		cache->retry_after = jiffies;
+		write_sequnlock(&cache->seq);
+	}
+}
+
+/*
+ * Lockless lookup of the features cache.
+ *
+ * Return: true if the cache is valid, in which case @flags is filled in.
+ */
+static bool fwk_ec_read_features(struct fwk_ec_feature_cache *cache,
+				  u32 *flags, unsigned long *retry_after)
+{
+	unsigned int seq;
+	bool valid;
+
+	do {
+		seq = read_seqbegin(&cache->seq);
+		valid = cache->valid;
+		flags[0] = cache->flags[0];
+		flags[1] = cache->flags[1];
+		*retry_after = cache->retry_after;
+	} while (read_seqretry(&cache->seq, seq));
+
+	return valid;
+}
+
+/**
+ * fwk_ec_get_features_locked() - Read the EC features bitmap, lock held.
+ *
+ * @ec: EC device, does not have to be connected directly to the AP,
+ *      can be daisy chained through another device.
+ *
+ * Fill in the features cache of @ec if it is not valid yet. The caller must
+ * hold the EC lock. A failure is not cached: the EC will be asked again,
+ * once FWK_EC_FEATURES_RETRY_MS have passed.
+ *
+ * Return: 0 on success or negative error code.
+ */
+int fwk_ec_get_features_locked(struct fwk_ec_dev *ec)
+{
+	struct fwk_ec_feature_cache *cache = fwk_ec_feature_cache(ec);
+	struct ec_response_get_features features;
+	int ret;
+
+	if (!cache)
+		return -EINVAL;
+
+	if (cache->valid)
+		return 0;
+
+	/* features bitmap not read yet */
+	ret = fwk_ec_cmd_locked(ec->ec_dev, 0,
+				 EC_CMD_GET_FEATURES + ec->cmd_offset,
+				 NULL, 0, &features, sizeof(features));
+
+	write_seqlock(&cache->seq);
+	if (ret < 0) {
+		cache->retry_after = jiffies +
+			msecs_to_jiffies(FWK_EC_FEATURES_RETRY_MS);
+	} else {
+		cache->flags[0] = features.flags[0];
+		cache->flags[1] = features.flags[1];
+		cache->valid = true;
+	}
+	write_sequnlock(&cache->seq);
+
+	if (ret < 0) {
+		dev_warn(ec->dev, "cannot get EC features: %d\n", ret);
+		return ret;
+	}
+
+	dev_dbg(ec->dev, "EC features %08x %08x\n",
+		features.flags[0], features.flags[1]);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(fwk_ec_get_features_locked);
+
 /**
  * fwk_ec_check_features() - Test for the presence of EC features
  *
@@ -900,39 +1135,51 @@ EXPORT_SYMBOL(fwk_ec_get_host_event);
  * @feature: One of ec_feature_code bit.
  *
  * Call this function to test whether the ChromeOS EC supports a feature.
+ * Once the features have been read, this does not take any lock nor talk to
+ * the EC.
  *
  * Return: true if supported, false if not (or if an error was encountered).
  */
 bool fwk_ec_check_features(struct fwk_ec_dev *ec, int feature)
 {
-	struct ec_response_get_features *features = &ec->features;
-	int ret;
+	struct fwk_ec_feature_cache *cache = fwk_ec_feature_cache(ec);
+	struct fwk_ec_device *ec_dev = ec->ec_dev;
+	unsigned long retry_after;
+	u32 flags[2];
 
-	if (features->flags[0] == -1U && features->flags[1] == -1U) {
-		/* features bitmap not read yet */
-		ret = fwk_ec_cmd(ec->ec_dev, 0, EC_CMD_GET_FEATURES + ec->cmd_offset,
-				  NULL, 0, features, sizeof(*features));
-		if (ret < 0) {
-			dev_warn(ec->dev, "cannot get EC features: %d\n", ret);
-			memset(features, 0, sizeof(*features));
-		}
+	if (!cache)
+		return false;
+
+	if (!fwk_ec_read_features(cache, flags, &retry_after)) {
+		if (time_before(jiffies, retry_after))
+			return false;
+
+		if (ec_dev->ec_mutex_lock(ec_dev))
+			return false;
 
-		dev_dbg(ec->dev, "EC features %08x %08x\n",
-			features->flags[0], features->flags[1]);
+		fwk_ec_get_features_locked(ec);
+		ec_dev->ec_mutex_unlock(ec_dev);
+
+		if (!fwk_ec_read_features(cache, flags, &retry_after))
+			return false;
 	}
 
-	return !!(features->flags[feature / 32] & EC_FEATURE_MASK_0(feature));
+	return !!(flags[feature / 32] & EC_FEATURE_MASK_0(feature));
 }
 EXPORT_SYMBOL_GPL(fwk_ec_check_features);
 
 /**
- * fwk_ec_get_sensor_count() - Return the number of MEMS sensors supported.
+ * fwk_ec_get_sensor_count_locked() - Return the number of MEMS sensors
+ *                                     supported, lock held.
  *
  * @ec: EC device, does not have to be connected directly to the AP,
  *      can be daisy chained through another device.
+ *
+ * Same as fwk_ec_get_sensor_count(), but the caller must hold the EC lock.
+ *
  * Return: < 0 in case of error.
  */
-int fwk_ec_get_sensor_count(struct fwk_ec_dev *ec)
+int fwk_ec_get_sensor_count_locked(struct fwk_ec_dev *ec)
 {
 	/*
 	 * Issue a command to get the number of sensor reported.
@@ -958,7 +1205,7 @@ int fwk_ec_get_sensor_count(struct fwk_ec_dev *ec)
 	params = (struct ec_params_motion_sense *)msg->data;
 	params->cmd = MOTIONSENSE_CMD_DUMP;
 
-	ret = fwk_ec_cmd_xfer_status(ec->ec_dev, msg);
+	ret = fwk_ec_cmd_xfer_status_locked(ec->ec_dev, msg);
 	if (ret < 0) {
 		sensor_count = ret;
 	} else {
@@ -989,8 +1236,157 @@ int fwk_ec_get_sensor_count(struct fwk_ec_dev *ec)
 	}
 	return sensor_count;
 }
+EXPORT_SYMBOL_GPL(fwk_ec_get_sensor_count_locked);
+
+/**
+ * fwk_ec_get_sensor_count() - Return the number of MEMS sensors supported.
+ *
+ * @ec: EC device, does not have to be connected directly to the AP,
+ *      can be daisy chained through another device.
+ * Return: < 0 in case of error.
+ */
+int fwk_ec_get_sensor_count(struct fwk_ec_dev *ec)
+{
+	struct fwk_ec_device *ec_dev = ec->ec_dev;
+	int ret;
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	ret = fwk_ec_get_sensor_count_locked(ec);
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	return ret;
+}
 EXPORT_SYMBOL_GPL(fwk_ec_get_sensor_count);
 
+/* Give up reading the accelerometers after that many attempts. */
+#define FWK_EC_ACCEL_READ_ATTEMPTS	50
+
+/* Accelerometer status byte up to the end of the gyroscope data. */
+#define FWK_EC_ACCEL_MAP_SIZE	(EC_MEMMAP_GYRO_DATA + 3 * sizeof(u16) - \
+				 EC_MEMMAP_ACC_STATUS)
+#define FWK_EC_ACCEL_MAP(offset)	((offset) - EC_MEMMAP_ACC_STATUS)
+
+/**
+ * fwk_ec_read_accel_snapshot() - Read the legacy accelerometer data.
+ *
+ * @ec_dev: EC device.
+ * @snap: Where to store the data.
+ *
+ * Read the accelerometer status and data, then the status again, from the
+ * memory map, and start over if the EC was updating the data (busy bit set,
+ * or sample id changed in between). This gives a consistent set of vectors
+ * without sending any host command. Each attempt holds the EC lock, which
+ * on LPC also keeps the ACPI AML off the memory map, and the lock is
+ * dropped between attempts.
+ *
+ * Must be called without the EC lock held.
+ *
+ * Return: 0 on success, -ENODEV if the EC does not publish accelerometer
+ * data, -EBUSY if no consistent snapshot could be read, or negative error
+ * code.
+ */
+int fwk_ec_read_accel_snapshot(struct fwk_ec_device *ec_dev,
+				struct fwk_ec_accel_snapshot *snap)
+{
+	u8 map[FWK_EC_ACCEL_MAP_SIZE];
+	u8 status;
+	int attempt, i, ret;
+
+	if (!ec_dev->cmd_readmem)
+		return -ENODEV;
+
+	for (attempt = 0; attempt < FWK_EC_ACCEL_READ_ATTEMPTS; attempt++) {
+		/* Small delay every so often. */
+		if (attempt && attempt % 5 == 0)
+			usleep_range(500, 1000);
+
+		ret = ec_dev->ec_mutex_lock(ec_dev);
+		if (ret)
+			return ret;
+
+		/* Never matches a busy status, if not read again below. */
+		status = 0;
+
+		ret = ec_dev->cmd_readmem(ec_dev, EC_MEMMAP_ACC_STATUS,
+					  sizeof(map), map);
+		if (ret >= 0 &&
+		    (map[0] & EC_MEMMAP_ACC_STATUS_PRESENCE_BIT) &&
+		    !(map[0] & EC_MEMMAP_ACC_STATUS_BUSY_BIT))
+			ret = ec_dev->cmd_readmem(ec_dev, EC_MEMMAP_ACC_STATUS,
+						  1, &status);
+
+		ec_dev->ec_mutex_unlock(ec_dev);
+
+		if (ret < 0)
+			return ret;
+
+		if (!(map[0] & EC_MEMMAP_ACC_STATUS_PRESENCE_BIT))
+			return -ENODEV;
+
+		if (status == map[0])
+			break;
+	}
+
+	if (attempt == FWK_EC_ACCEL_READ_ATTEMPTS)
+		return -EBUSY;
+
+	snap->sample_id = map[0] & EC_MEMMAP_ACC_STATUS_SAMPLE_ID_MASK;
+	snap->lid_angle = get_unaligned_le16(
+			&map[FWK_EC_ACCEL_MAP(EC_MEMMAP_ACC_DATA)]);
+	for (i = 0; i < 3; i++) {
+		snap->accel[0][i] = get_unaligned_le16(
+			&map[FWK_EC_ACCEL_MAP(EC_MEMMAP_ACC_DATA) + 2 + 2 * i]);
+		snap->accel[1][i] = get_unaligned_le16(
+			&map[FWK_EC_ACCEL_MAP(EC_MEMMAP_ACC_DATA) + 8 + 2 * i]);
+		snap->gyro[i] = get_unaligned_le16(
+			&map[FWK_EC_ACCEL_MAP(EC_MEMMAP_GYRO_DATA) + 2 * i]);
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(fwk_ec_read_accel_snapshot);
+
+static int __fwk_ec_cmd(struct fwk_ec_device *ec_dev,
+			unsigned int version,
+			int command,
+			const void *outdata,
+			size_t outsize,
+			void *indata,
+			size_t insize,
+			bool locked)
+{
+	struct fwk_ec_command *msg;
+	int ret;
+
+	msg = kzalloc(sizeof(*msg) + max(insize, outsize), GFP_KERNEL);
+	if (!msg)
+		return -ENOMEM;
+
+	msg->version = version;
+	msg->command = command;
+	msg->outsize = outsize;
+	msg->insize = insize;
+
+	if (outsize)
+		memcpy(msg->data, outdata, outsize);
+
+	if (locked)
+		ret = fwk_ec_cmd_xfer_status_locked(ec_dev, msg);
+	else
+		ret = fwk_ec_cmd_xfer_status(ec_dev, msg);
+	if (ret < 0)
+		goto error;
+
+	if (insize)
+		memcpy(indata, msg->data, insize);
+error:
+	kfree(msg);
+	return ret;
+}
+
 /**
  * fwk_ec_cmd - Send a command to the EC.
  *
@@ -1012,30 +1408,466 @@ int fwk_ec_cmd(struct fwk_ec_device *ec_dev,
 		void *indata,
 		size_t insize)
 {
+	return __fwk_ec_cmd(ec_dev, version, command, outdata, outsize,
+			    indata, insize, false);
+}
+EXPORT_SYMBOL_GPL(fwk_ec_cmd);
+
+/**
+ * fwk_ec_cmd_locked - Send a command to the EC, lock held.
+ *
+ * @ec_dev: EC device
+ * @version: EC command version
+ * @command: EC command
+ * @outdata: EC command output data
+ * @outsize: Size of outdata
+ * @indata: EC command input data
+ * @insize: Size of indata
+ *
+ * Same as fwk_ec_cmd(), but the caller must hold the EC lock.
+ *
+ * Return: >= 0 on success, negative error number on failure.
+ */
+int fwk_ec_cmd_locked(struct fwk_ec_device *ec_dev,
+		       unsigned int version,
+		       int command,
+		       const void *outdata,
+		       size_t outsize,
+		       void *indata,
+		       size_t insize)
+{
+	return __fwk_ec_cmd(ec_dev, version, command, outdata, outsize,
+			    indata, insize, true);
+}
+EXPORT_SYMBOL_GPL(fwk_ec_cmd_locked);
+
+static const struct {
+	u16 command;
+	size_t offset;
+	size_t size;
+} fwk_ec_typec_entries[FWK_EC_TYPEC_ENTRIES] = {
+	[FWK_EC_TYPEC_STATUS] = {
+		.command = EC_CMD_TYPEC_STATUS,
+		.offset = offsetof(struct fwk_ec_typec_cache, status),
+		.size = sizeof(struct ec_response_typec_status),
+	},
+	[FWK_EC_TYPEC_POWER_INFO] = {
+		.command = EC_CMD_USB_PD_POWER_INFO,
+		.offset = offsetof(struct fwk_ec_typec_cache, power_info),
+		.size = sizeof(struct ec_response_usb_pd_power_info),
+	},
+	[FWK_EC_TYPEC_MUX_INFO] = {
+		.command = EC_CMD_USB_PD_MUX_INFO,
+		.offset = offsetof(struct fwk_ec_typec_cache, mux_info),
+		.size = sizeof(struct ec_response_usb_pd_mux_info),
+	},
+};
+
+/**
+ * fwk_ec_typec_invalidate() - Forget the cached Type-C state of a port.
+ * @ec_dev: EC device.
+ * @port: USB-C port, or -1 for all of them.
+ *
+ * The EC core calls this on PD and USB mux host events, and when a command
+ * that changes the state of a port (e.g. EC_CMD_USB_PD_MUX_ACK) succeeds.
+ * Drivers that learn about a change some other way may call it too. This
+ * does not take any lock.
+ */
+void fwk_ec_typec_invalidate(struct fwk_ec_device *ec_dev, int port)
+{
+	int i;
+
+	if (port >= EC_USB_PD_MAX_PORTS)
+		return;
+
+	for (i = 0; i < EC_USB_PD_MAX_PORTS; i++) {
+		if (port < 0 || port == i)
+			atomic_inc(&ec_dev->typec[i].invalidations);
+	}
+}
+EXPORT_SYMBOL_GPL(fwk_ec_typec_invalidate);
+
+/*
+ * Lockless lookup of a Type-C cache entry.
+ *
+ * Return: true if the entry is valid, in which case @dest is filled in.
+ */
+static bool fwk_ec_typec_read(struct fwk_ec_typec_cache *cache,
+			      enum fwk_ec_typec_entry entry, void *dest)
+{
+	unsigned int seq;
+	bool valid;
+
+	do {
+		seq = read_seqbegin(&cache->seq);
+		valid = test_bit(entry, &cache->valid) &&
+			cache->gen[entry] == atomic_read(&cache->invalidations);
+		if (valid)
+			memcpy(dest, (u8 *)cache + fwk_ec_typec_entries[entry].offset,
+			       fwk_ec_typec_entries[entry].size);
+	} while (read_seqretry(&cache->seq, seq));
+
+	return valid;
+}
+
+static int fwk_ec_typec_get(struct fwk_ec_device *ec_dev, int port,
+			    enum fwk_ec_typec_entry entry, void *dest)
+{
+	struct fwk_ec_typec_cache *cache;
+	/* All three commands only take the port. */
+	struct ec_params_usb_pd_mux_info params;
+	int gen;
+	int ret;
+
+	if (port < 0 || port >= EC_USB_PD_MAX_PORTS)
+		return -EINVAL;
+
+	cache = &ec_dev->typec[port];
+
+	/*
+	 * The cache is only as good as the events invalidating it: without
+	 * MKBP, the host events are not seen here, so always ask the EC.
+	 */
+	if (ec_dev->mkbp_event_supported &&
+	    fwk_ec_typec_read(cache, entry, dest))
+		return 0;
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	/* Sampled before asking, so that a change meanwhile is not missed. */
+	gen = atomic_read(&cache->invalidations);
+	params.port = port;
+
+	ret = fwk_ec_cmd_locked(ec_dev, 0, fwk_ec_typec_entries[entry].command,
+				&params, sizeof(params),
+				dest, fwk_ec_typec_entries[entry].size);
+	if (ret >= 0) {
+		write_seqlock(&cache->seq);
+		memcpy((u8 *)cache + fwk_ec_typec_entries[entry].offset, dest,
+		       fwk_ec_typec_entries[entry].size);
+		cache->gen[entry] = gen;
+		__set_bit(entry, &cache->valid);
+		write_sequnlock(&cache->seq);
+	}
+
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	return ret < 0 ? ret : 0;
+}
+
+/**
+ * fwk_ec_typec_get_status() - Get the EC_CMD_TYPEC_STATUS of a port.
+ * @ec_dev: EC device.
+ * @port: USB-C port.
+ * @status: Filled in with the status.
+ *
+ * The status is served from the Type-C cache of @ec_dev when it is still
+ * valid, the EC is only asked otherwise. It stays valid until a PD or USB
+ * mux event, or a command changing the state of @port.
+ *
+ * Return: 0 on success or negative error code.
+ */
+int fwk_ec_typec_get_status(struct fwk_ec_device *ec_dev, int port,
+			     struct ec_response_typec_status *status)
+{
+	return fwk_ec_typec_get(ec_dev, port, FWK_EC_TYPEC_STATUS, status);
+}
+EXPORT_SYMBOL_GPL(fwk_ec_typec_get_status);
+
+/**
+ * fwk_ec_usb_pd_get_power_info() - Get the EC_CMD_USB_PD_POWER_INFO of a port.
+ * @ec_dev: EC device.
+ * @port: USB-C port; PD_POWER_CHARGING_PORT is not supported.
+ * @info: Filled in with the power info.
+ *
+ * Cached like fwk_ec_typec_get_status().
+ *
+ * Return: 0 on success or negative error code.
+ */
+int fwk_ec_usb_pd_get_power_info(struct fwk_ec_device *ec_dev, int port,
+				  struct ec_response_usb_pd_power_info *info)
+{
+	return fwk_ec_typec_get(ec_dev, port, FWK_EC_TYPEC_POWER_INFO, info);
+}
+EXPORT_SYMBOL_GPL(fwk_ec_usb_pd_get_power_info);
+
+/**
+ * fwk_ec_usb_pd_get_mux_info() - Get the EC_CMD_USB_PD_MUX_INFO of a port.
+ * @ec_dev: EC device.
+ * @port: USB-C port.
+ * @info: Filled in with the mux info.
+ *
+ * Cached like fwk_ec_typec_get_status().
+ *
+ * Return: 0 on success or negative error code.
+ */
+int fwk_ec_usb_pd_get_mux_info(struct fwk_ec_device *ec_dev, int port,
+				struct ec_response_usb_pd_mux_info *info)
+{
+	return fwk_ec_typec_get(ec_dev, port, FWK_EC_TYPEC_MUX_INFO, info);
+}
+EXPORT_SYMBOL_GPL(fwk_ec_usb_pd_get_mux_info);
+
+static bool fwk_ec_charge_fresh(struct fwk_ec_charge_cache *cache)
+{
+	return cache->valid &&
+	       cache->gen == atomic_read(&cache->invalidations) &&
+	       time_before(jiffies, cache->expires);
+}
+
+/* Gather the charger state. Called with the EC locked. */
+static int fwk_ec_charge_gather_locked(struct fwk_ec_device *ec_dev,
+				       struct fwk_ec_charge_snapshot *snap)
+{
+	struct ec_params_charge_state params = {};
+	struct ec_response_charge_state resp;
+	int i, ret;
+
+	memset(snap, 0, sizeof(*snap));
+
+	params.cmd = CHARGE_STATE_CMD_GET_STATE;
+	ret = fwk_ec_cmd_locked(ec_dev, 0, EC_CMD_CHARGE_STATE,
+				&params, sizeof(params), &resp, sizeof(resp));
+	if (ret < 0)
+		return ret;
+
+	snap->ac = resp.get_state.ac;
+	snap->chg_voltage = resp.get_state.chg_voltage;
+	snap->chg_current = resp.get_state.chg_current;
+	snap->chg_input_current = resp.get_state.chg_input_current;
+	snap->batt_state_of_charge = resp.get_state.batt_state_of_charge;
+
+	/* Chargers don't all have all the params, skip those missing. */
+	params.cmd = CHARGE_STATE_CMD_GET_PARAM;
+	for (i = 0; i < CS_NUM_BASE_PARAMS; i++) {
+		params.get_param.param = i;
+		ret = fwk_ec_cmd_locked(ec_dev, 0, EC_CMD_CHARGE_STATE,
+					&params, sizeof(params),
+					&resp, sizeof(resp));
+		if (ret < 0)
+			continue;
+
+		snap->params[i] = resp.get_param.value;
+		snap->params_valid |= BIT(i);
+	}
+
+	ret = fwk_ec_cmd_locked(ec_dev, 0, EC_CMD_POWER_INFO, NULL, 0,
+				&snap->power_info, sizeof(snap->power_info));
+	snap->power_info_valid = ret >= 0;
+
+	snap->timestamp = ktime_get_boottime_ns();
+
+	return 0;
+}
+
+/**
+ * fwk_ec_get_charge_snapshot() - Get the state of the charger.
+ * @ec_dev: EC device.
+ * @snap: Filled in with the charger state.
+ *
+ * The charge state, all the base charger params and the power info are read
+ * in one EC lock session, so they are consistent with each other. The
+ * snapshot is then served from a cache for @ec_dev->charge_ttl_ms, or until
+ * an AC or battery event.
+ *
+ * Return: 0 on success or negative error code.
+ */
+int fwk_ec_get_charge_snapshot(struct fwk_ec_device *ec_dev,
+				struct fwk_ec_charge_snapshot *snap)
+{
+	struct fwk_ec_charge_cache *cache = &ec_dev->charge;
+	unsigned int seq;
+	bool fresh;
+	int gen;
+	int ret;
+
+	do {
+		seq = read_seqbegin(&cache->seq);
+		fresh = fwk_ec_charge_fresh(cache);
+		if (fresh)
+			*snap = cache->snap;
+	} while (read_seqretry(&cache->seq, seq));
+
+	if (fresh)
+		return 0;
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	/* Someone else may have gathered it while we waited for the EC. */
+	if (fwk_ec_charge_fresh(cache)) {
+		*snap = cache->snap;
+		goto unlock;
+	}
+
+	gen = atomic_read(&cache->invalidations);
+
+	ret = fwk_ec_charge_gather_locked(ec_dev, snap);
+	if (ret)
+		goto unlock;
+
+	write_seqlock(&cache->seq);
+	cache->snap = *snap;
+	cache->gen = gen;
+	cache->expires = jiffies +
+			 msecs_to_jiffies(READ_ONCE(ec_dev->charge_ttl_ms));
+	cache->valid = true;
+	write_sequnlock(&cache->seq);
+
+unlock:
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(fwk_ec_get_charge_snapshot);
+
+/**
+ * fwk_ec_fp_frame_read() - Read a whole fingerprint frame or template.
+ * @ec: Fingerprint MCU device.
+ * @index: FP_FRAME_INDEX_RAW_IMAGE for the last captured image, or
+ *         FP_FRAME_INDEX_TEMPLATE + n for template n.
+ * @buf: Where to store the data.
+ * @size: Number of bytes to read, usually the frame_size or template_size
+ *        given by EC_CMD_FP_INFO.
+ *
+ * The frame is read with EC_CMD_FP_FRAME in chunks as large as the
+ * protocol allows, all within one EC lock session, so that no other
+ * command (e.g. a new capture) gets in the middle of it.
+ *
+ * Return: 0 on success or negative error code.
+ */
+int fwk_ec_fp_frame_read(struct fwk_ec_dev *ec, unsigned int index,
+			  void *buf, size_t size)
+{
+	struct fwk_ec_device *ec_dev = ec->ec_dev;
+	struct ec_params_fp_frame *params;
 	struct fwk_ec_command *msg;
+	size_t done, chunk;
 	int ret;
 
-	msg = kzalloc(sizeof(*msg) + max(insize, outsize), GFP_KERNEL);
-	if (!msg)
-		return -ENOMEM;
+	if (!size || size - 1 > FP_FRAME_OFFSET_MASK ||
+	    index > FP_FRAME_GET_BUFFER_INDEX(U32_MAX))
+		return -EINVAL;
 
-	msg->version = version;
-	msg->command = command;
-	msg->outsize = outsize;
-	msg->insize = insize;
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
 
-	if (outsize)
-		memcpy(msg->data, outdata, outsize);
+	/* max_response can only change with the EC locked. */
+	msg = kzalloc(sizeof(*msg) + max_t(size_t, sizeof(*params),
+					   ec_dev->max_response),
+		      GFP_KERNEL);
+	if (!msg) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
 
-	ret = fwk_ec_cmd_xfer_status(ec_dev, msg);
+	params = (struct ec_params_fp_frame *)msg->data;
+
+	for (done = 0; done < size; done += chunk) {
+		chunk = min_t(size_t, size - done, ec_dev->max_response);
+
+		msg->version = 0;
+		msg->command = EC_CMD_FP_FRAME + ec->cmd_offset;
+		msg->outsize = sizeof(*params);
+		msg->insize = chunk;
+		params->offset = (index << FP_FRAME_INDEX_SHIFT) | done;
+		params->size = chunk;
+
+		ret = fwk_ec_cmd_xfer_status_locked(ec_dev, msg);
+		if (ret < 0)
+			break;
+
+		memcpy(buf + done, msg->data, chunk);
+	}
+
+	kfree(msg);
+unlock:
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	return ret < 0 ? ret : 0;
+}
+EXPORT_SYMBOL_GPL(fwk_ec_fp_frame_read);
+
+/**
+ * fwk_ec_tp_frames_read() - Snapshot and read touchpad frames.
+ * @ec: Touchpad MCU device.
+ * @sizes: Size of each frame, as given by EC_CMD_TP_FRAME_INFO.
+ * @n_frames: Number of entries in @sizes.
+ * @frames: Bitmask of the frames to read.
+ * @buf: Where to store the frames. Frame n is stored right after frame
+ *       n - 1, whether frame n - 1 is read or not.
+ *
+ * Takes a snapshot with EC_CMD_TP_FRAME_SNAPSHOT, then reads the frames of
+ * @frames with EC_CMD_TP_FRAME_GET in chunks as large as the protocol
+ * allows, all within one EC lock session, so that the frames all come from
+ * that snapshot.
+ *
+ * Return: 0 on success or negative error code.
+ */
+int fwk_ec_tp_frames_read(struct fwk_ec_dev *ec, const u32 *sizes,
+			   unsigned int n_frames, unsigned long frames,
+			   void *buf)
+{
+	struct fwk_ec_device *ec_dev = ec->ec_dev;
+	struct ec_params_tp_frame_get *params;
+	struct fwk_ec_command *msg;
+	unsigned int i;
+	size_t done, chunk;
+	int ret;
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	msg = kzalloc(sizeof(*msg) + max_t(size_t, sizeof(*params),
+					   ec_dev->max_response),
+		      GFP_KERNEL);
+	if (!msg) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	msg->command = EC_CMD_TP_FRAME_SNAPSHOT + ec->cmd_offset;
+	ret = fwk_ec_cmd_xfer_status_locked(ec_dev, msg);
 	if (ret < 0)
-		goto error;
+		goto free;
 
-	if (insize)
-		memcpy(indata, msg->data, insize);
-error:
+	params = (struct ec_params_tp_frame_get *)msg->data;
+
+	for (i = 0; i < n_frames; buf += sizes[i++]) {
+		if (!(frames & BIT(i)))
+			continue;
+
+		for (done = 0; done < sizes[i]; done += chunk) {
+			chunk = min_t(size_t, sizes[i] - done,
+				      ec_dev->max_response);
+
+			msg->version = 0;
+			msg->command = EC_CMD_TP_FRAME_GET + ec->cmd_offset;
+			msg->outsize = sizeof(*params);
+			msg->insize = chunk;
+			params->frame_index = i;
+			params->offset = done;
+			params->size = chunk;
+
+			ret = fwk_ec_cmd_xfer_status_locked(ec_dev, msg);
+			if (ret < 0)
+				goto free;
+
+			memcpy(buf + done, msg->data, chunk);
+		}
+	}
+
+free:
 	kfree(msg);
-	return ret;
+unlock:
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	return ret < 0 ? ret : 0;
 }
-EXPORT_SYMBOL_GPL(fwk_ec_cmd);
+EXPORT_SYMBOL_GPL(fwk_ec_tp_frames_read);
 MODULE_LICENSE("GPL");
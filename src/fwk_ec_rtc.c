@@ -0,0 +1,482 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * RTC driver for the ChromeOS EC
+ *
+ * The EC clock only counts seconds and each access is a host command, so
+ * it is read once and then extrapolated from the host boot time clock. It
+ * is read again after an RTC event, after resume, and once the last read
+ * is older than resync_s. The alarm the EC holds is tracked too: setting
+ * the same alarm again doesn't reach the EC, and programming a new one
+ * takes a single EC lock session.
+ */
+
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/notifier.h>
+#include <fwk_ec_commands.h>
+#include <fwk_ec_proto.h>
+#include <linux/platform_device.h>
+#include <linux/rtc.h>
+#include <linux/slab.h>
+
+#define DRV_NAME	"fwk-ec-rtc"
+
+static unsigned int resync_s = 600;
+module_param(resync_s, uint, 0644);
+MODULE_PARM_DESC(resync_s,
+		 "Longest time the EC clock is extrapolated without reading it (s)");
+
+/**
+ * struct fwk_ec_rtc - Driver data for EC RTC.
+ * @ec: EC device the clock belongs to.
+ * @rtc: Pointer to RTC device.
+ * @notifier: Notifier info for responding to EC events.
+ * @lock: Protects the fields below.
+ * @synced: True if @ec_time and @synced_at can be extrapolated from.
+ * @ec_time: EC clock read at @synced_at.
+ * @synced_at: Boot time clock when @ec_time was read.
+ * @saved_alarm: Alarm time, kept while the alarm is disabled.
+ * @alarm_known: True if @programmed_alarm is what the EC holds.
+ * @programmed_alarm: Alarm time programmed in the EC, 0 for none.
+ */
+struct fwk_ec_rtc {
+	struct fwk_ec_dev *ec;
+	struct rtc_device *rtc;
+	struct notifier_block notifier;
+	struct mutex lock;
+	bool synced;
+	u32 ec_time;
+	ktime_t synced_at;
+	u32 saved_alarm;
+	bool alarm_known;
+	u32 programmed_alarm;
+};
+
+static int fwk_ec_rtc_get_locked(struct fwk_ec_rtc *ec_rtc, u32 command,
+				 u32 *response)
+{
+	struct fwk_ec_dev *ec = ec_rtc->ec;
+	struct ec_response_rtc resp;
+	int ret;
+
+	ret = fwk_ec_cmd_locked(ec->ec_dev, 0, command + ec->cmd_offset,
+				NULL, 0, &resp, sizeof(resp));
+	if (ret < 0)
+		return ret;
+
+	*response = resp.time;
+
+	return 0;
+}
+
+static int fwk_ec_rtc_set_locked(struct fwk_ec_rtc *ec_rtc, u32 command,
+				 u32 param)
+{
+	struct fwk_ec_dev *ec = ec_rtc->ec;
+	struct ec_params_rtc params = {
+		.time = param,
+	};
+	int ret;
+
+	ret = fwk_ec_cmd_locked(ec->ec_dev, 0, command + ec->cmd_offset,
+				&params, sizeof(params), NULL, 0);
+
+	return ret < 0 ? ret : 0;
+}
+
+/* Extrapolate the EC clock, if it was read recently enough. */
+static bool fwk_ec_rtc_extrapolate(struct fwk_ec_rtc *ec_rtc, u32 *now)
+{
+	u64 elapsed;
+
+	lockdep_assert_held(&ec_rtc->lock);
+
+	if (!ec_rtc->synced)
+		return false;
+
+	elapsed = ktime_divns(ktime_sub(ktime_get_boottime(),
+					ec_rtc->synced_at), NSEC_PER_SEC);
+	if (elapsed >= READ_ONCE(resync_s))
+		return false;
+
+	*now = ec_rtc->ec_time + elapsed;
+
+	return true;
+}
+
+/*
+ * Current time of the EC clock, read from the EC if it can't be
+ * extrapolated. Called with the EC locked.
+ */
+static int fwk_ec_rtc_now_locked(struct fwk_ec_rtc *ec_rtc, u32 *now)
+{
+	int ret;
+
+	if (fwk_ec_rtc_extrapolate(ec_rtc, now))
+		return 0;
+
+	ret = fwk_ec_rtc_get_locked(ec_rtc, EC_CMD_RTC_GET_VALUE, now);
+	if (ret < 0)
+		return ret;
+
+	ec_rtc->ec_time = *now;
+	ec_rtc->synced_at = ktime_get_boottime();
+	ec_rtc->synced = true;
+
+	return 0;
+}
+
+static int fwk_ec_rtc_now(struct fwk_ec_rtc *ec_rtc, u32 *now)
+{
+	struct fwk_ec_device *ec_dev = ec_rtc->ec->ec_dev;
+	int ret;
+
+	if (fwk_ec_rtc_extrapolate(ec_rtc, now))
+		return 0;
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	ret = fwk_ec_rtc_now_locked(ec_rtc, now);
+
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	return ret;
+}
+
+/*
+ * Have the EC alarm go off at @alarm, or clear it if @alarm is 0. Nothing
+ * is sent if the EC already holds that alarm.
+ */
+static int fwk_ec_rtc_program_alarm(struct fwk_ec_rtc *ec_rtc, u32 alarm)
+{
+	struct fwk_ec_device *ec_dev = ec_rtc->ec->ec_dev;
+	u32 offset = EC_RTC_ALARM_CLEAR;
+	u32 now;
+	int ret;
+
+	lockdep_assert_held(&ec_rtc->lock);
+
+	if (ec_rtc->alarm_known && ec_rtc->programmed_alarm == alarm)
+		return 0;
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	if (alarm) {
+		ret = fwk_ec_rtc_now_locked(ec_rtc, &now);
+		if (ret < 0)
+			goto unlock;
+
+		/* An offset of 0 clears the alarm, go off right away instead. */
+		offset = alarm > now ? alarm - now : 1;
+	}
+
+	ret = fwk_ec_rtc_set_locked(ec_rtc, EC_CMD_RTC_SET_ALARM, offset);
+	if (ret < 0) {
+		ec_rtc->alarm_known = false;
+		goto unlock;
+	}
+
+	ec_rtc->programmed_alarm = alarm;
+	ec_rtc->alarm_known = true;
+
+unlock:
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	return ret;
+}
+
+/* Find out which alarm the EC holds. Called with the EC locked. */
+static int fwk_ec_rtc_query_alarm_locked(struct fwk_ec_rtc *ec_rtc)
+{
+	u32 offset, now;
+	int ret;
+
+	ret = fwk_ec_rtc_now_locked(ec_rtc, &now);
+	if (ret < 0)
+		return ret;
+
+	ret = fwk_ec_rtc_get_locked(ec_rtc, EC_CMD_RTC_GET_ALARM, &offset);
+	if (ret < 0)
+		return ret;
+
+	ec_rtc->programmed_alarm = offset == EC_RTC_ALARM_CLEAR ?
+				   0 : now + offset;
+	ec_rtc->alarm_known = true;
+
+	return 0;
+}
+
+static int fwk_ec_rtc_read_time(struct device *dev, struct rtc_time *tm)
+{
+	struct fwk_ec_rtc *ec_rtc = dev_get_drvdata(dev);
+	u32 now;
+	int ret;
+
+	mutex_lock(&ec_rtc->lock);
+	ret = fwk_ec_rtc_now(ec_rtc, &now);
+	mutex_unlock(&ec_rtc->lock);
+
+	if (ret) {
+		dev_err(dev, "error getting time: %d\n", ret);
+		return ret;
+	}
+
+	rtc_time64_to_tm(now, tm);
+
+	return 0;
+}
+
+static int fwk_ec_rtc_set_time(struct device *dev, struct rtc_time *tm)
+{
+	struct fwk_ec_rtc *ec_rtc = dev_get_drvdata(dev);
+	struct fwk_ec_device *ec_dev = ec_rtc->ec->ec_dev;
+	time64_t time = rtc_tm_to_time64(tm);
+	int ret;
+
+	mutex_lock(&ec_rtc->lock);
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		goto out;
+
+	ret = fwk_ec_rtc_set_locked(ec_rtc, EC_CMD_RTC_SET_VALUE, (u32)time);
+	if (ret < 0) {
+		ec_rtc->synced = false;
+	} else {
+		/* No need to read back what was just written. */
+		ec_rtc->ec_time = time;
+		ec_rtc->synced_at = ktime_get_boottime();
+		ec_rtc->synced = true;
+	}
+
+	/* The EC alarm is relative, where it ends up is not known anymore. */
+	ec_rtc->alarm_known = false;
+
+	ec_dev->ec_mutex_unlock(ec_dev);
+out:
+	mutex_unlock(&ec_rtc->lock);
+
+	if (ret)
+		dev_err(dev, "error setting time: %d\n", ret);
+
+	return ret;
+}
+
+static int fwk_ec_rtc_read_alarm(struct device *dev, struct rtc_wkalrm *alrm)
+{
+	struct fwk_ec_rtc *ec_rtc = dev_get_drvdata(dev);
+	struct fwk_ec_device *ec_dev = ec_rtc->ec->ec_dev;
+	int ret = 0;
+
+	mutex_lock(&ec_rtc->lock);
+
+	if (!ec_rtc->alarm_known) {
+		ret = ec_dev->ec_mutex_lock(ec_dev);
+		if (ret)
+			goto out;
+
+		ret = fwk_ec_rtc_query_alarm_locked(ec_rtc);
+
+		ec_dev->ec_mutex_unlock(ec_dev);
+		if (ret) {
+			dev_err(dev, "error getting alarm: %d\n", ret);
+			goto out;
+		}
+	}
+
+	alrm->enabled = !!ec_rtc->programmed_alarm;
+	rtc_time64_to_tm(alrm->enabled ? ec_rtc->programmed_alarm :
+			 ec_rtc->saved_alarm, &alrm->time);
+out:
+	mutex_unlock(&ec_rtc->lock);
+
+	return ret;
+}
+
+static int fwk_ec_rtc_set_alarm(struct device *dev, struct rtc_wkalrm *alrm)
+{
+	struct fwk_ec_rtc *ec_rtc = dev_get_drvdata(dev);
+	time64_t alarm_time = rtc_tm_to_time64(&alrm->time);
+	int ret;
+
+	mutex_lock(&ec_rtc->lock);
+
+	ec_rtc->saved_alarm = (u32)alarm_time;
+	ret = fwk_ec_rtc_program_alarm(ec_rtc,
+				       alrm->enabled ? ec_rtc->saved_alarm : 0);
+
+	mutex_unlock(&ec_rtc->lock);
+
+	if (ret)
+		dev_err(dev, "error setting alarm: %d\n", ret);
+
+	return ret;
+}
+
+static int fwk_ec_rtc_alarm_irq_enable(struct device *dev,
+					unsigned int enabled)
+{
+	struct fwk_ec_rtc *ec_rtc = dev_get_drvdata(dev);
+	int ret;
+
+	mutex_lock(&ec_rtc->lock);
+	ret = fwk_ec_rtc_program_alarm(ec_rtc,
+				       enabled ? ec_rtc->saved_alarm : 0);
+	mutex_unlock(&ec_rtc->lock);
+
+	return ret;
+}
+
+static int fwk_ec_rtc_event(struct notifier_block *nb,
+			    unsigned long queued_during_suspend,
+			    void *_notify)
+{
+	struct fwk_ec_rtc *ec_rtc = container_of(nb, struct fwk_ec_rtc,
+						 notifier);
+	u32 host_event = fwk_ec_get_host_event(ec_rtc->ec->ec_dev);
+
+	if (!(host_event & EC_HOST_EVENT_MASK(EC_HOST_EVENT_RTC)))
+		return NOTIFY_DONE;
+
+	/* The alarm went off, and the EC cleared it. */
+	mutex_lock(&ec_rtc->lock);
+	ec_rtc->synced = false;
+	ec_rtc->programmed_alarm = 0;
+	ec_rtc->alarm_known = true;
+	mutex_unlock(&ec_rtc->lock);
+
+	rtc_update_irq(ec_rtc->rtc, 1, RTC_IRQF | RTC_AF);
+
+	return NOTIFY_OK;
+}
+
+static const struct rtc_class_ops fwk_ec_rtc_ops = {
+	.read_time		= fwk_ec_rtc_read_time,
+	.set_time		= fwk_ec_rtc_set_time,
+	.read_alarm		= fwk_ec_rtc_read_alarm,
+	.set_alarm		= fwk_ec_rtc_set_alarm,
+	.alarm_irq_enable	= fwk_ec_rtc_alarm_irq_enable,
+};
+
+static int __maybe_unused fwk_ec_rtc_suspend(struct device *dev)
+{
+	struct fwk_ec_rtc *ec_rtc = dev_get_drvdata(dev);
+
+	if (device_may_wakeup(dev))
+		return enable_irq_wake(ec_rtc->ec->ec_dev->irq);
+
+	return 0;
+}
+
+static int __maybe_unused fwk_ec_rtc_resume(struct device *dev)
+{
+	struct fwk_ec_rtc *ec_rtc = dev_get_drvdata(dev);
+
+	/*
+	 * The firmware may have set the clock while we were away, and the
+	 * alarm may have gone off without an event reaching us.
+	 */
+	mutex_lock(&ec_rtc->lock);
+	ec_rtc->synced = false;
+	ec_rtc->alarm_known = false;
+	mutex_unlock(&ec_rtc->lock);
+
+	if (device_may_wakeup(dev))
+		return disable_irq_wake(ec_rtc->ec->ec_dev->irq);
+
+	return 0;
+}
+
+static SIMPLE_DEV_PM_OPS(fwk_ec_rtc_pm_ops, fwk_ec_rtc_suspend,
+			 fwk_ec_rtc_resume);
+
+static int fwk_ec_rtc_probe(struct platform_device *pdev)
+{
+	struct fwk_ec_dev *ec = dev_get_drvdata(pdev->dev.parent);
+	struct fwk_ec_device *ec_dev = ec->ec_dev;
+	struct fwk_ec_rtc *ec_rtc;
+	int ret;
+
+	ec_rtc = devm_kzalloc(&pdev->dev, sizeof(*ec_rtc), GFP_KERNEL);
+	if (!ec_rtc)
+		return -ENOMEM;
+
+	ec_rtc->ec = ec;
+	mutex_init(&ec_rtc->lock);
+
+	platform_set_drvdata(pdev, ec_rtc);
+
+	/* Make sure the clock can be read, and learn the alarm with it. */
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return ret;
+
+	ret = fwk_ec_rtc_query_alarm_locked(ec_rtc);
+
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	if (ret) {
+		dev_err(&pdev->dev, "failed to read RTC: %d\n", ret);
+		return ret;
+	}
+
+	ret = device_init_wakeup(&pdev->dev, true);
+	if (ret)
+		return ret;
+
+	ec_rtc->rtc = devm_rtc_allocate_device(&pdev->dev);
+	if (IS_ERR(ec_rtc->rtc))
+		return PTR_ERR(ec_rtc->rtc);
+
+	ec_rtc->rtc->ops = &fwk_ec_rtc_ops;
+	ec_rtc->rtc->range_max = U32_MAX;
+
+	ret = devm_rtc_register_device(ec_rtc->rtc);
+	if (ret)
+		return ret;
+
+	ec_rtc->notifier.notifier_call = fwk_ec_rtc_event;
+	ret = blocking_notifier_chain_register(&ec_dev->event_notifier,
+					       &ec_rtc->notifier);
+	if (ret) {
+		dev_err(&pdev->dev, "failed to register notifier\n");
+		return ret;
+	}
+
+	return 0;
+}
+
+static void fwk_ec_rtc_remove(struct platform_device *pdev)
+{
+	struct fwk_ec_rtc *ec_rtc = platform_get_drvdata(pdev);
+
+	blocking_notifier_chain_unregister(&ec_rtc->ec->ec_dev->event_notifier,
+					   &ec_rtc->notifier);
+}
+
+static const struct platform_device_id fwk_ec_rtc_id[] = {
+	{ DRV_NAME, 0 },
+	{}
+};
+MODULE_DEVICE_TABLE(platform, fwk_ec_rtc_id);
+
+static struct platform_driver fwk_ec_rtc_driver = {
+	.driver = {
+		.name = DRV_NAME,
+		.pm = &fwk_ec_rtc_pm_ops,
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
+	.probe = fwk_ec_rtc_probe,
+	.remove_new = fwk_ec_rtc_remove,
+	.id_table = fwk_ec_rtc_id,
+};
+module_platform_driver(fwk_ec_rtc_driver);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("RTC driver for ChromeOS EC");
@@ -0,0 +1,520 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Sensor Hub driver for the ChromeOS EC
+ *
+ * The sensor hub enumerates the MEMS sensors behind the EC, registers a
+ * platform device for each of them, and, when the EC has a sensor FIFO,
+ * reads the FIFO and dispatches the samples to the IIO devices.
+ */
+
+#include <linux/init.h>
+#include <linux/device.h>
+#include <linux/kernel.h>
+#include <linux/lockdep.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <fwk_ec_commands.h>
+#include <fwk_ec_proto.h>
+#include <fwk_ec_sensorhub.h>
+#include <linux/platform_device.h>
+#include <linux/slab.h>
+#include <linux/types.h>
+
+#define DRV_NAME		"fwk-ec-sensorhub"
+
+/*
+ * Send one setting of one sensor. Called with cmd_lock and the EC lock
+ * held. @cached is updated with @value if the EC took it, and forgotten if
+ * the EC state is not known anymore.
+ */
+static int fwk_ec_sensorhub_set_locked(struct fwk_ec_sensorhub *sensorhub,
+					enum motionsense_command cmd,
+					int sensor_num, s32 value,
+					bool roundup, s32 *cached)
+{
+	struct ec_params_motion_sense *params = sensorhub->params;
+	int ret;
+
+	if (value == EC_MOTION_SENSE_NO_VALUE || value == *cached)
+		return 0;
+
+	params->cmd = cmd;
+	switch (cmd) {
+	case MOTIONSENSE_CMD_SENSOR_ODR:
+		params->sensor_odr.sensor_num = sensor_num;
+		params->sensor_odr.roundup = roundup;
+		params->sensor_odr.data = value;
+		break;
+	case MOTIONSENSE_CMD_SENSOR_RANGE:
+		params->sensor_range.sensor_num = sensor_num;
+		params->sensor_range.roundup = roundup;
+		params->sensor_range.data = value;
+		break;
+	case MOTIONSENSE_CMD_EC_RATE:
+		params->ec_rate.sensor_num = sensor_num;
+		params->ec_rate.roundup = roundup;
+		params->ec_rate.data = value;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	ret = fwk_ec_cmd_xfer_status_locked(sensorhub->ec->ec_dev,
+					    sensorhub->msg);
+	*cached = ret < 0 ? EC_MOTION_SENSE_NO_VALUE : value;
+
+	return ret < 0 ? ret : 0;
+}
+
+/**
+ * fwk_ec_sensorhub_configure() - Configure all the sensors at once.
+ * @sensorhub: Sensor Hub object.
+ * @config: Wanted configuration of each of the sensor_num sensors.
+ * @fifo_int_enable: 1 to enable the FIFO interrupt, 0 to disable it, or
+ *                   EC_MOTION_SENSE_NO_VALUE to leave it alone.
+ *
+ * Settings equal to the ones last set are skipped, the others are sent to
+ * the EC in a single EC lock session: range, ODR and EC rate of every
+ * sensor, then the FIFO interrupt state. Reapplying the same configuration
+ * thus costs no EC command at all, unless the EC may have lost it since:
+ * the cache is forgotten on resume and when the EC reports it was reset.
+ *
+ * The cached settings are the ones requested, not the ones the EC rounded
+ * them to: requesting the same value again is a no-op.
+ *
+ * Return: 0 on success, or an error when we can not communicate with the EC,
+ * in which case the settings past the failed one are not applied.
+ */
+int fwk_ec_sensorhub_configure(struct fwk_ec_sensorhub *sensorhub,
+			       const struct fwk_ec_sensor_config *config,
+			       int fifo_int_enable)
+{
+	struct fwk_ec_device *ec_dev = sensorhub->ec->ec_dev;
+	struct fwk_ec_sensor_config *cached;
+	int ret, i;
+
+	mutex_lock(&sensorhub->cmd_lock);
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		goto unlock;
+
+	/* Keep the version the FIFO reads use, all these take it. */
+	sensorhub->msg->outsize = sizeof(struct ec_params_motion_sense);
+	sensorhub->msg->insize = sizeof(struct ec_response_motion_sense);
+
+	for (i = 0; i < sensorhub->sensor_num; i++) {
+		cached = &sensorhub->config[i];
+
+		/* The rounding applies to the values cached as well. */
+		if (config[i].roundup != cached->roundup) {
+			cached->odr = EC_MOTION_SENSE_NO_VALUE;
+			cached->range = EC_MOTION_SENSE_NO_VALUE;
+			cached->ec_rate = EC_MOTION_SENSE_NO_VALUE;
+			cached->roundup = config[i].roundup;
+		}
+
+		ret = fwk_ec_sensorhub_set_locked(sensorhub,
+				MOTIONSENSE_CMD_SENSOR_RANGE, i,
+				config[i].range, config[i].roundup,
+				&cached->range);
+		if (ret)
+			goto ec_unlock;
+
+		ret = fwk_ec_sensorhub_set_locked(sensorhub,
+				MOTIONSENSE_CMD_SENSOR_ODR, i,
+				config[i].odr, config[i].roundup,
+				&cached->odr);
+		if (ret)
+			goto ec_unlock;
+
+		ret = fwk_ec_sensorhub_set_locked(sensorhub,
+				MOTIONSENSE_CMD_EC_RATE, i,
+				config[i].ec_rate, config[i].roundup,
+				&cached->ec_rate);
+		if (ret)
+			goto ec_unlock;
+	}
+
+	if (fifo_int_enable != EC_MOTION_SENSE_NO_VALUE &&
+	    fifo_int_enable != sensorhub->fifo_int_enable) {
+		sensorhub->params->cmd = MOTIONSENSE_CMD_FIFO_INT_ENABLE;
+		sensorhub->params->fifo_int_enable.enable = fifo_int_enable;
+
+		ret = fwk_ec_cmd_xfer_status_locked(ec_dev, sensorhub->msg);
+		sensorhub->fifo_int_enable = ret < 0 ?
+			EC_MOTION_SENSE_NO_VALUE : fifo_int_enable;
+		if (ret > 0)
+			ret = 0;
+	}
+
+ec_unlock:
+	ec_dev->ec_mutex_unlock(ec_dev);
+unlock:
+	mutex_unlock(&sensorhub->cmd_lock);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(fwk_ec_sensorhub_configure);
+
+/**
+ * fwk_ec_sensorhub_config_forget() - Forget the configuration last set.
+ * @sensorhub: Sensor Hub object.
+ * @sensor_num: Sensor whose settings are forgotten, or -1 for all of them
+ *              and the FIFO interrupt state.
+ *
+ * The next fwk_ec_sensorhub_configure() sends the forgotten settings again.
+ * Drivers sending MOTIONSENSE_CMD_SENSOR_ODR, MOTIONSENSE_CMD_SENSOR_RANGE
+ * or MOTIONSENSE_CMD_EC_RATE through @sensorhub->msg themselves must call
+ * it for the sensor they changed.
+ *
+ * Must be called with @sensorhub->cmd_lock held.
+ */
+void fwk_ec_sensorhub_config_forget(struct fwk_ec_sensorhub *sensorhub,
+				    int sensor_num)
+{
+	struct fwk_ec_sensor_config *config;
+	int i;
+
+	lockdep_assert_held(&sensorhub->cmd_lock);
+
+	for (i = 0; i < sensorhub->sensor_num; i++) {
+		if (sensor_num >= 0 && i != sensor_num)
+			continue;
+
+		config = &sensorhub->config[i];
+		config->odr = EC_MOTION_SENSE_NO_VALUE;
+		config->range = EC_MOTION_SENSE_NO_VALUE;
+		config->ec_rate = EC_MOTION_SENSE_NO_VALUE;
+	}
+	if (sensor_num < 0)
+		sensorhub->fifo_int_enable = EC_MOTION_SENSE_NO_VALUE;
+}
+EXPORT_SYMBOL_GPL(fwk_ec_sensorhub_config_forget);
+
+/* Nothing is known of the sensor configuration until it is set. */
+static int fwk_ec_sensorhub_config_init(struct device *dev,
+					struct fwk_ec_sensorhub *sensorhub)
+{
+	sensorhub->config = devm_kcalloc(dev, sensorhub->sensor_num,
+					 sizeof(*sensorhub->config),
+					 GFP_KERNEL);
+	if (!sensorhub->config)
+		return -ENOMEM;
+
+	mutex_lock(&sensorhub->cmd_lock);
+	fwk_ec_sensorhub_config_forget(sensorhub, -1);
+	mutex_unlock(&sensorhub->cmd_lock);
+
+	return 0;
+}
+
+/* A reset or sysjump of the EC loses the sensor configuration. */
+static int fwk_ec_sensorhub_reset_event(struct notifier_block *nb,
+					unsigned long queued_during_suspend,
+					void *_notify)
+{
+	struct fwk_ec_sensorhub *sensorhub =
+		container_of(nb, struct fwk_ec_sensorhub, reset_notifier);
+	u32 host_event = fwk_ec_get_host_event(sensorhub->ec->ec_dev);
+
+	if (!(host_event & EC_HOST_EVENT_MASK(EC_HOST_EVENT_INTERFACE_READY)))
+		return NOTIFY_DONE;
+
+	mutex_lock(&sensorhub->cmd_lock);
+	fwk_ec_sensorhub_config_forget(sensorhub, -1);
+	mutex_unlock(&sensorhub->cmd_lock);
+
+	return NOTIFY_OK;
+}
+
+static void fwk_ec_sensorhub_reset_unregister(void *arg)
+{
+	struct fwk_ec_sensorhub *sensorhub = arg;
+
+	blocking_notifier_chain_unregister(&sensorhub->ec->ec_dev->event_notifier,
+					   &sensorhub->reset_notifier);
+}
+
+static int fwk_ec_sensorhub_reset_register(struct device *dev,
+					   struct fwk_ec_sensorhub *sensorhub)
+{
+	int ret;
+
+	sensorhub->reset_notifier.notifier_call = fwk_ec_sensorhub_reset_event;
+	ret = blocking_notifier_chain_register(&sensorhub->ec->ec_dev->event_notifier,
+					       &sensorhub->reset_notifier);
+	if (ret)
+		return ret;
+
+	return devm_add_action_or_reset(dev, fwk_ec_sensorhub_reset_unregister,
+					sensorhub);
+}
+
+static void fwk_ec_sensorhub_free_sensor(void *arg)
+{
+	struct platform_device *pdev = arg;
+
+	platform_device_unregister(pdev);
+}
+
+static int fwk_ec_sensorhub_allocate_sensor(struct device *parent,
+					     char *sensor_name,
+					     int sensor_num)
+{
+	struct fwk_ec_sensor_platform sensor_platforms = {
+		.sensor_num = sensor_num,
+	};
+	struct platform_device *pdev;
+
+	pdev = platform_device_register_data(parent, sensor_name,
+					     PLATFORM_DEVID_AUTO,
+					     &sensor_platforms,
+					     sizeof(sensor_platforms));
+	if (IS_ERR(pdev))
+		return PTR_ERR(pdev);
+
+	return devm_add_action_or_reset(parent,
+					fwk_ec_sensorhub_free_sensor,
+					pdev);
+}
+
+static int fwk_ec_sensorhub_register(struct device *dev,
+				      struct fwk_ec_sensorhub *sensorhub)
+{
+	int sensor_type[MOTIONSENSE_TYPE_MAX] = { 0 };
+	struct fwk_ec_command *msg = sensorhub->msg;
+	struct fwk_ec_dev *ec = sensorhub->ec;
+	int ret, i;
+	char *name;
+
+	msg->version = 1;
+	msg->insize = sizeof(struct ec_response_motion_sense);
+	msg->outsize = sizeof(struct ec_params_motion_sense);
+
+	for (i = 0; i < sensorhub->sensor_num; i++) {
+		sensorhub->params->cmd = MOTIONSENSE_CMD_INFO;
+		sensorhub->params->info.sensor_num = i;
+
+		ret = fwk_ec_cmd_xfer_status(ec->ec_dev, msg);
+		if (ret < 0) {
+			dev_warn(dev, "no info for EC sensor %d : %d/%d\n",
+				 i, ret, msg->result);
+			continue;
+		}
+
+		switch (sensorhub->resp->info.type) {
+		case MOTIONSENSE_TYPE_ACCEL:
+			name = "fwk-ec-accel";
+			break;
+		case MOTIONSENSE_TYPE_BARO:
+			name = "fwk-ec-baro";
+			break;
+		case MOTIONSENSE_TYPE_GYRO:
+			name = "fwk-ec-gyro";
+			break;
+		case MOTIONSENSE_TYPE_MAG:
+			name = "fwk-ec-mag";
+			break;
+		case MOTIONSENSE_TYPE_PROX:
+			name = "fwk-ec-prox";
+			break;
+		case MOTIONSENSE_TYPE_LIGHT:
+			name = "fwk-ec-light";
+			break;
+		case MOTIONSENSE_TYPE_ACTIVITY:
+			name = "fwk-ec-activity";
+			break;
+		default:
+			dev_warn(dev, "unknown type %d\n",
+				 sensorhub->resp->info.type);
+			continue;
+		}
+
+		ret = fwk_ec_sensorhub_allocate_sensor(dev, name, i);
+		if (ret)
+			return ret;
+
+		sensor_type[sensorhub->resp->info.type]++;
+	}
+
+	if (sensor_type[MOTIONSENSE_TYPE_ACCEL] >= 2)
+		ec->has_kb_wake_angle = true;
+
+	if (fwk_ec_check_features(ec,
+				  EC_FEATURE_REFINED_TABLET_MODE_HYSTERESIS)) {
+		ret = fwk_ec_sensorhub_allocate_sensor(dev,
+							"fwk-ec-lid-angle",
+							0);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int fwk_ec_sensorhub_probe(struct platform_device *pdev)
+{
+	struct device *dev = &pdev->dev;
+	struct fwk_ec_dev *ec = dev_get_drvdata(dev->parent);
+	struct fwk_ec_sensorhub *data;
+	struct fwk_ec_command *msg;
+	u16 msg_size;
+	int ret, i, sensor_num;
+
+	msg_size = max((u16)sizeof(struct ec_params_motion_sense),
+		       ec->ec_dev->max_response);
+	msg = devm_kzalloc(dev, sizeof(struct fwk_ec_command) + msg_size,
+			   GFP_KERNEL);
+	if (!msg)
+		return -ENOMEM;
+
+	msg->command = EC_CMD_MOTION_SENSE_CMD + ec->cmd_offset;
+
+	data = devm_kzalloc(dev, sizeof(struct fwk_ec_sensorhub), GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+
+	mutex_init(&data->cmd_lock);
+
+	data->dev = dev;
+	data->ec = ec;
+	data->msg = msg;
+	data->msg_size = msg_size;
+	data->params = (struct ec_params_motion_sense *)msg->data;
+	data->resp = (struct ec_response_motion_sense *)msg->data;
+
+	dev_set_drvdata(dev, data);
+
+	/* Check whether this EC is a sensor hub. */
+	if (fwk_ec_check_features(ec, EC_FEATURE_MOTION_SENSE)) {
+		sensor_num = fwk_ec_get_sensor_count(ec);
+		if (sensor_num < 0) {
+			dev_err(dev,
+				"Unable to retrieve sensor information (err:%d)\n",
+				sensor_num);
+			return sensor_num;
+		}
+		if (sensor_num == 0) {
+			dev_err(dev, "Zero sensors reported.\n");
+			return -EINVAL;
+		}
+		data->sensor_num = sensor_num;
+
+		ret = fwk_ec_sensorhub_config_init(dev, data);
+		if (ret)
+			return ret;
+
+		ret = fwk_ec_sensorhub_reset_register(dev, data);
+		if (ret)
+			return ret;
+
+		/*
+		 * Prepare the ring handler before enumerating the
+		 * sensors.
+		 */
+		if (fwk_ec_check_features(ec, EC_FEATURE_MOTION_SENSE_FIFO)) {
+			ret = fwk_ec_sensorhub_ring_allocate(data);
+			if (ret)
+				return ret;
+		}
+
+		/* Enumerate the sensors.*/
+		ret = fwk_ec_sensorhub_register(dev, data);
+		if (ret)
+			return ret;
+
+		/*
+		 * When the EC does not have a FIFO, the sensors will query
+		 * their data themselves via sysfs or a software trigger.
+		 */
+		if (fwk_ec_check_features(ec, EC_FEATURE_MOTION_SENSE_FIFO)) {
+			ret = fwk_ec_sensorhub_ring_add(data);
+			if (ret)
+				return ret;
+			/*
+			 * The msg and its data is not under the control of the
+			 * ring handler.
+			 */
+			return devm_add_action_or_reset(dev,
+					fwk_ec_sensorhub_ring_remove,
+					data);
+		}
+
+	} else {
+		/*
+		 * If the device has sensors but does not claim to
+		 * be a sensor hub, we are in legacy mode.
+		 */
+		data->sensor_num = 2;
+
+		ret = fwk_ec_sensorhub_config_init(dev, data);
+		if (ret)
+			return ret;
+
+		ret = fwk_ec_sensorhub_reset_register(dev, data);
+		if (ret)
+			return ret;
+
+		for (i = 0; i < data->sensor_num; i++) {
+			ret = fwk_ec_sensorhub_allocate_sensor(dev,
+						"fwk-ec-accel-legacy", i);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+#ifdef CONFIG_PM_SLEEP
+/*
+ * When the EC is suspending, we must stop sending interrupt,
+ * we may use the same interrupt line for waking up the device.
+ * Tell the EC to stop sending non-interrupt event on the iio ring.
+ */
+static int fwk_ec_sensorhub_suspend(struct device *dev)
+{
+	struct fwk_ec_sensorhub *sensorhub = dev_get_drvdata(dev);
+	struct fwk_ec_dev *ec = sensorhub->ec;
+
+	if (fwk_ec_check_features(ec, EC_FEATURE_MOTION_SENSE_FIFO))
+		return fwk_ec_sensorhub_ring_fifo_enable(sensorhub, false);
+	return 0;
+}
+
+static int fwk_ec_sensorhub_resume(struct device *dev)
+{
+	struct fwk_ec_sensorhub *sensorhub = dev_get_drvdata(dev);
+	struct fwk_ec_dev *ec = sensorhub->ec;
+
+	/* The EC may have lost the sensor configuration while suspended. */
+	if (sensorhub->config) {
+		mutex_lock(&sensorhub->cmd_lock);
+		fwk_ec_sensorhub_config_forget(sensorhub, -1);
+		mutex_unlock(&sensorhub->cmd_lock);
+	}
+
+	if (fwk_ec_check_features(ec, EC_FEATURE_MOTION_SENSE_FIFO))
+		return fwk_ec_sensorhub_ring_fifo_enable(sensorhub, true);
+	return 0;
+}
+#endif
+
+static SIMPLE_DEV_PM_OPS(fwk_ec_sensorhub_pm_ops,
+		fwk_ec_sensorhub_suspend,
+		fwk_ec_sensorhub_resume);
+
+static struct platform_driver fwk_ec_sensorhub_driver = {
+	.driver = {
+		.name = DRV_NAME,
+		.pm = &fwk_ec_sensorhub_pm_ops,
+	},
+	.probe = fwk_ec_sensorhub_probe,
+};
+
+module_platform_driver(fwk_ec_sensorhub_driver);
+
+MODULE_ALIAS("platform:" DRV_NAME);
+MODULE_DESCRIPTION("ChromeOS EC MEMS Sensor Hub Driver");
+MODULE_LICENSE("GPL");
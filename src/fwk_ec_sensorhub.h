@@ -36,9 +36,38 @@ typedef int (*fwk_ec_sensorhub_push_data_cb_t)(struct iio_dev *indio_dev,
 						s16 *data,
 						s64 timestamp);
 
+/**
+ * struct fwk_ec_sensors_ring_batch - Samples of a single sensor, one array
+ *				       per field.
+ *
+ * @len: Number of samples.
+ * @axis: Value of each axis, for every sample.
+ * @timestamp: Timestamp of every sample, in host timespace.
+ * @flag: MOTIONSENSE_SENSOR_FLAG_* of every sample.
+ */
+struct fwk_ec_sensors_ring_batch {
+	int len;
+	s16 *axis[3];
+	s64 *timestamp;
+	u8 *flag;
+};
+
+/**
+ * typedef fwk_ec_sensorhub_push_batch_cb_t - Callback function to send all
+ *					       the samples of a sensor read
+ *					       from the FIFO at once.
+ *
+ * @indio_dev: The IIO device that will process the samples.
+ * @batch: Samples, in the order the EC acquired them. Only valid during the
+ *         call.
+ */
+typedef int (*fwk_ec_sensorhub_push_batch_cb_t)(struct iio_dev *indio_dev,
+		const struct fwk_ec_sensors_ring_batch *batch);
+
 struct fwk_ec_sensorhub_sensor_push_data {
 	struct iio_dev *indio_dev;
 	fwk_ec_sensorhub_push_data_cb_t push_data_cb;
+	fwk_ec_sensorhub_push_batch_cb_t push_batch_cb;
 };
 
 enum {
@@ -63,29 +92,58 @@ struct fwk_ec_sensors_ec_overflow_state {
 /* Length of the filter, how long to remember entries for */
 #define FWK_EC_SENSORHUB_TS_HISTORY_SIZE 64
 
+/**
+ * struct fwk_ec_sensors_ts_median - Running median of a history array.
+ *
+ * @lo: Max-heap of the indexes of the lower half of the values.
+ * @hi: Min-heap of the indexes of the upper half of the values.
+ * @pos: Position of each history entry in @lo or @hi.
+ * @lo_len: Number of entries in @lo.
+ * @hi_len: Number of entries in @hi.
+ */
+struct fwk_ec_sensors_ts_median {
+	u8 lo[FWK_EC_SENSORHUB_TS_HISTORY_SIZE];
+	u8 hi[FWK_EC_SENSORHUB_TS_HISTORY_SIZE];
+	u8 pos[FWK_EC_SENSORHUB_TS_HISTORY_SIZE];
+	u8 lo_len;
+	u8 hi_len;
+};
+
 /**
  * struct fwk_ec_sensors_ts_filter_state - Timestamp filetr state.
  *
- * @x_offset: x is EC interrupt time. x_offset its last value.
- * @y_offset: y is the difference between AP and EC time, y_offset its last
- *            value.
+ * @x_offset: x is EC interrupt time. x_offset is the origin the history is
+ *            stored relative to. It only moves when the history would not
+ *            fit in 32 bits anymore.
+ * @y_offset: y is the difference between AP and EC time, y_offset its
+ *            origin.
  * @x_history: The past history of x, relative to x_offset.
  * @y_history: The past history of y, relative to y_offset.
- * @m_history: rate between y and x.
+ * @m_history: rate between y and x, between an entry and the one before it.
+ * @history_head: Index of the newest entry in the history rings.
  * @history_len: Amount of valid historic data in the arrays.
- * @temp_buf: Temporary buffer used when updating the filter.
- * @median_m: median value of m_history
+ * @error_history: y-intercept of each entry, on a line of slope median_m.
+ * @m_median: Running median of m_history.
+ * @error_median: Running median of error_history.
+ * @fit_age: Number of updates since error_history was last computed
+ *           again, saturating.
+ * @median_m: median value of m_history, as of the last fit
  * @median_error: final error to apply to AP interrupt timestamp to get the
  *                "true timestamp" the event occurred.
  */
 struct fwk_ec_sensors_ts_filter_state {
 	s64 x_offset, y_offset;
-	s64 x_history[FWK_EC_SENSORHUB_TS_HISTORY_SIZE];
-	s64 y_history[FWK_EC_SENSORHUB_TS_HISTORY_SIZE];
-	s64 m_history[FWK_EC_SENSORHUB_TS_HISTORY_SIZE];
+	s32 x_history[FWK_EC_SENSORHUB_TS_HISTORY_SIZE];
+	s32 y_history[FWK_EC_SENSORHUB_TS_HISTORY_SIZE];
+	s32 m_history[FWK_EC_SENSORHUB_TS_HISTORY_SIZE];
+	int history_head;
 	int history_len;
 
-	s64 temp_buf[FWK_EC_SENSORHUB_TS_HISTORY_SIZE];
+	s32 error_history[FWK_EC_SENSORHUB_TS_HISTORY_SIZE];
+
+	struct fwk_ec_sensors_ts_median m_median;
+	struct fwk_ec_sensors_ts_median error_median;
+	u8 fit_age;
 
 	s64 median_m;
 	s64 median_error;
@@ -111,6 +169,24 @@ struct fwk_ec_sensors_ts_batch_state {
 	s64 newest_sensor_event;
 };
 
+/**
+ * struct fwk_ec_sensor_config - Configuration of a single sensor.
+ * @odr: Output data rate, in mHz.
+ * @range: Range, in the sensor units (g, dps, ...).
+ * @ec_rate: Rate at which the EC reads the sensor, in ms.
+ * @roundup: Round @odr and @range up rather than down, to the next value
+ *           the sensor supports.
+ *
+ * Any of @odr, @range and @ec_rate can be EC_MOTION_SENSE_NO_VALUE to
+ * leave that setting alone.
+ */
+struct fwk_ec_sensor_config {
+	s32 odr;
+	s32 range;
+	s32 ec_rate;
+	bool roundup;
+};
+
 /*
  * struct fwk_ec_sensorhub - Sensor Hub device data.
  *
@@ -118,6 +194,7 @@ struct fwk_ec_sensors_ts_batch_state {
  * @ec: Embedded Controller where the hub is located.
  * @sensor_num: Number of MEMS sensors present in the EC.
  * @msg: Structure to send FIFO requests.
+ * @msg_size: Size of the @msg data buffer, the EC max_response at probe.
  * @params: Pointer to parameters in msg.
  * @resp: Pointer to responses in msg.
  * @cmd_lock : Lock for sending msg.
@@ -143,6 +220,14 @@ struct fwk_ec_sensors_ts_batch_state {
  *			    given period.
  * @future_timestamp_total_ns: Total amount of time shaved.
  * @push_data: Array of callback to send datums to iio sensor object.
+ * @batch: Samples read from the FIFO, sorted by sensor.
+ * @batch_offset: Index in @batch of the first sample of each sensor.
+ * @config: Configuration last set on each sensor, with
+ *          EC_MOTION_SENSE_NO_VALUE for what is not known. Protected by
+ *          @cmd_lock.
+ * @fifo_int_enable: FIFO interrupt state last set, or
+ *                   EC_MOTION_SENSE_NO_VALUE. Protected by @cmd_lock.
+ * @reset_notifier: Notifier forgetting @config when the EC is reset.
  */
 struct fwk_ec_sensorhub {
 	struct device *dev;
@@ -150,6 +235,7 @@ struct fwk_ec_sensorhub {
 	int sensor_num;
 
 	struct fwk_ec_command *msg;
+	u16 msg_size;
 	struct ec_params_motion_sense *params;
 	struct ec_response_motion_sense *resp;
 	struct mutex cmd_lock;  /* Lock for protecting msg structure. */
@@ -175,6 +261,13 @@ struct fwk_ec_sensorhub {
 	s64 future_timestamp_total_ns;
 
 	struct fwk_ec_sensorhub_sensor_push_data *push_data;
+
+	struct fwk_ec_sensors_ring_batch batch;
+	unsigned int *batch_offset;
+
+	struct fwk_ec_sensor_config *config;
+	int fifo_int_enable;
+	struct notifier_block reset_notifier;
 };
 
 int fwk_ec_sensorhub_register_push_data(struct fwk_ec_sensorhub *sensorhub,
@@ -182,9 +275,20 @@ int fwk_ec_sensorhub_register_push_data(struct fwk_ec_sensorhub *sensorhub,
 					 struct iio_dev *indio_dev,
 					 fwk_ec_sensorhub_push_data_cb_t cb);
 
+int fwk_ec_sensorhub_register_push_batch(struct fwk_ec_sensorhub *sensorhub,
+					  u8 sensor_num,
+					  struct iio_dev *indio_dev,
+					  fwk_ec_sensorhub_push_batch_cb_t cb);
+
 void fwk_ec_sensorhub_unregister_push_data(struct fwk_ec_sensorhub *sensorhub,
 					    u8 sensor_num);
 
+int fwk_ec_sensorhub_configure(struct fwk_ec_sensorhub *sensorhub,
+			       const struct fwk_ec_sensor_config *config,
+			       int fifo_int_enable);
+void fwk_ec_sensorhub_config_forget(struct fwk_ec_sensorhub *sensorhub,
+				    int sensor_num);
+
 int fwk_ec_sensorhub_ring_allocate(struct fwk_ec_sensorhub *sensorhub);
 int fwk_ec_sensorhub_ring_add(struct fwk_ec_sensorhub *sensorhub);
 void fwk_ec_sensorhub_ring_remove(void *arg);
@@ -0,0 +1,1379 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Driver for Chrome OS EC Sensor hub FIFO.
+ *
+ * When the EC signals new FIFO data with an EC_MKBP_EVENT_SENSOR_FIFO
+ * event, the whole FIFO is drained in a single EC lock session, using
+ * FIFO_READ requests as large as the EC response buffer allows. The EC
+ * timestamps are then translated to the AP timebase, spread over batches,
+ * and the samples are pushed to the IIO devices.
+ */
+
+#include <linux/delay.h>
+#include <linux/device.h>
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <fwk_ec_commands.h>
+#include <fwk_ec_proto.h>
+#include <fwk_ec_sensorhub.h>
+#include <linux/platform_device.h>
+#include <linux/slab.h>
+
+/* Precision of fixed point for the m values from the filter */
+#define M_PRECISION BIT(23)
+
+/* Only activate the filter once we have at least this many elements. */
+#define TS_HISTORY_THRESHOLD 8
+
+/*
+ * If we don't have any history entries for this long, empty the filter to
+ * make sure there are no big discontinuities.
+ */
+#define TS_HISTORY_BORED_US 500000
+
+/* Move the origin of the history once it gets this far from the entries. */
+#define TS_HISTORY_REBASE_LIMIT BIT(30)
+
+/*
+ * Compute the errors again once the median of m moved enough to shift the
+ * oldest entry by TS_FIT_TOLERANCE_NS, but at most once every history
+ * length / TS_FIT_INTERVAL_DIV updates: the median of m moves with the
+ * interrupt jitter, and each refit is a pass over the history.
+ */
+#define TS_FIT_TOLERANCE_NS 1000
+#define TS_FIT_INTERVAL_DIV 4
+
+/* To measure by how much the filter is overshooting, if it happens. */
+#define FUTURE_TS_ANALYTICS_COUNT_MAX 100
+
+/**
+ * fwk_ec_sensorhub_register_push_data() - register the callback to the hub.
+ *
+ * @sensorhub : Sensor Hub object
+ * @sensor_num : The sensor the caller is interested in.
+ * @indio_dev : The iio device to use when a sample arrives.
+ * @cb : The callback to call when a sample arrives.
+ *
+ * The callback cb will be used by fwk_ec_sensorhub_ring to distribute events
+ * from the EC.
+ *
+ * Return: 0 when callback is registered.
+ *         EINVAL is the sensor number is invalid or the slot already used.
+ */
+int fwk_ec_sensorhub_register_push_data(struct fwk_ec_sensorhub *sensorhub,
+					 u8 sensor_num,
+					 struct iio_dev *indio_dev,
+					 fwk_ec_sensorhub_push_data_cb_t cb)
+{
+	if (sensor_num >= sensorhub->sensor_num)
+		return -EINVAL;
+	if (sensorhub->push_data[sensor_num].indio_dev)
+		return -EINVAL;
+
+	sensorhub->push_data[sensor_num].indio_dev = indio_dev;
+	sensorhub->push_data[sensor_num].push_data_cb = cb;
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(fwk_ec_sensorhub_register_push_data);
+
+/**
+ * fwk_ec_sensorhub_register_push_batch() - register a batch callback to the
+ *					     hub.
+ *
+ * @sensorhub : Sensor Hub object
+ * @sensor_num : The sensor the caller is interested in.
+ * @indio_dev : The iio device to use when samples arrive.
+ * @cb : The callback to call with all the samples read from the FIFO for
+ *       this sensor.
+ *
+ * Same as fwk_ec_sensorhub_register_push_data(), but @cb is called once per
+ * FIFO read with all the samples of the sensor, instead of once per sample.
+ *
+ * Return: 0 when callback is registered.
+ *         EINVAL is the sensor number is invalid or the slot already used.
+ */
+int fwk_ec_sensorhub_register_push_batch(struct fwk_ec_sensorhub *sensorhub,
+					  u8 sensor_num,
+					  struct iio_dev *indio_dev,
+					  fwk_ec_sensorhub_push_batch_cb_t cb)
+{
+	if (sensor_num >= sensorhub->sensor_num)
+		return -EINVAL;
+	if (sensorhub->push_data[sensor_num].indio_dev)
+		return -EINVAL;
+
+	sensorhub->push_data[sensor_num].indio_dev = indio_dev;
+	sensorhub->push_data[sensor_num].push_batch_cb = cb;
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(fwk_ec_sensorhub_register_push_batch);
+
+void fwk_ec_sensorhub_unregister_push_data(struct fwk_ec_sensorhub *sensorhub,
+					    u8 sensor_num)
+{
+	sensorhub->push_data[sensor_num].indio_dev = NULL;
+	sensorhub->push_data[sensor_num].push_data_cb = NULL;
+	sensorhub->push_data[sensor_num].push_batch_cb = NULL;
+}
+EXPORT_SYMBOL_GPL(fwk_ec_sensorhub_unregister_push_data);
+
+/**
+ * fwk_ec_sensorhub_ring_fifo_enable() - Enable or disable interrupt generation
+ *					  for FIFO events.
+ * @sensorhub: Sensor Hub object
+ * @on: true when events are requested.
+ *
+ * To be called before sleeping or when noone is listening.
+ * Return: 0 on success, or an error when we can not communicate with the EC.
+ *
+ */
+int fwk_ec_sensorhub_ring_fifo_enable(struct fwk_ec_sensorhub *sensorhub,
+				       bool on)
+{
+	int ret, i;
+
+	mutex_lock(&sensorhub->cmd_lock);
+	if (sensorhub->tight_timestamps)
+		for (i = 0; i < sensorhub->sensor_num; i++)
+			sensorhub->batch_state[i].last_len = 0;
+
+	sensorhub->params->cmd = MOTIONSENSE_CMD_FIFO_INT_ENABLE;
+	sensorhub->params->fifo_int_enable.enable = on;
+
+	sensorhub->msg->outsize = sizeof(struct ec_params_motion_sense);
+	sensorhub->msg->insize = sizeof(struct ec_response_motion_sense);
+
+	ret = fwk_ec_cmd_xfer_status(sensorhub->ec->ec_dev, sensorhub->msg);
+	sensorhub->fifo_int_enable = ret < 0 ? EC_MOTION_SENSE_NO_VALUE : on;
+	mutex_unlock(&sensorhub->cmd_lock);
+
+	/* We expect to receive a payload of 4 bytes, ignore. */
+	if (ret > 0)
+		ret = 0;
+
+	return ret;
+}
+
+/*
+ * The medians of m_history and error_history are maintained incrementally,
+ * each with two heaps of history indexes: lo, a max-heap holding the lower
+ * half of the values, and hi, a min-heap holding the upper half. hi has as
+ * many entries as lo, or one more, so that its top is the element of rank
+ * n / 2. Each index knows its position in the heaps (pos), so that the
+ * entry leaving the window can be removed in O(log n) as well.
+ */
+#define TS_MEDIAN_POS_HI BIT(7)
+
+static bool fwk_ec_sensor_ring_median_before(const s32 *values, bool hi,
+					     u8 a, u8 b)
+{
+	if (hi)
+		return values[a] < values[b];
+	return values[a] > values[b];
+}
+
+static void
+fwk_ec_sensor_ring_median_set(struct fwk_ec_sensors_ts_median *med,
+			      bool hi, int pos, u8 idx)
+{
+	if (hi) {
+		med->hi[pos] = idx;
+		med->pos[idx] = pos | TS_MEDIAN_POS_HI;
+	} else {
+		med->lo[pos] = idx;
+		med->pos[idx] = pos;
+	}
+}
+
+/* Move the entry at @pos up or down to restore the heap property. */
+static void
+fwk_ec_sensor_ring_median_sift(struct fwk_ec_sensors_ts_median *med,
+			       const s32 *values, bool hi, int pos)
+{
+	u8 *heap = hi ? med->hi : med->lo;
+	int len = hi ? med->hi_len : med->lo_len;
+	u8 idx = heap[pos];
+	int parent, child;
+
+	while (pos > 0) {
+		parent = (pos - 1) / 2;
+		if (!fwk_ec_sensor_ring_median_before(values, hi, idx,
+						      heap[parent]))
+			break;
+		fwk_ec_sensor_ring_median_set(med, hi, pos, heap[parent]);
+		pos = parent;
+	}
+
+	for (;;) {
+		child = 2 * pos + 1;
+		if (child >= len)
+			break;
+		if (child + 1 < len &&
+		    fwk_ec_sensor_ring_median_before(values, hi, heap[child + 1],
+						     heap[child]))
+			child++;
+		if (!fwk_ec_sensor_ring_median_before(values, hi, heap[child],
+						      idx))
+			break;
+		fwk_ec_sensor_ring_median_set(med, hi, pos, heap[child]);
+		pos = child;
+	}
+
+	fwk_ec_sensor_ring_median_set(med, hi, pos, idx);
+}
+
+static void
+fwk_ec_sensor_ring_median_push(struct fwk_ec_sensors_ts_median *med,
+			       const s32 *values, bool hi, u8 idx)
+{
+	u8 *len = hi ? &med->hi_len : &med->lo_len;
+
+	fwk_ec_sensor_ring_median_set(med, hi, (*len)++, idx);
+	fwk_ec_sensor_ring_median_sift(med, values, hi, *len - 1);
+}
+
+static u8
+fwk_ec_sensor_ring_median_pop(struct fwk_ec_sensors_ts_median *med,
+			      const s32 *values, bool hi, int pos)
+{
+	u8 *heap = hi ? med->hi : med->lo;
+	u8 *len = hi ? &med->hi_len : &med->lo_len;
+	u8 idx = heap[pos];
+
+	if (pos != --(*len)) {
+		fwk_ec_sensor_ring_median_set(med, hi, pos, heap[*len]);
+		fwk_ec_sensor_ring_median_sift(med, values, hi, pos);
+	}
+
+	return idx;
+}
+
+static void
+fwk_ec_sensor_ring_median_balance(struct fwk_ec_sensors_ts_median *med,
+				  const s32 *values)
+{
+	while (med->hi_len > med->lo_len + 1)
+		fwk_ec_sensor_ring_median_push(med, values, false,
+			fwk_ec_sensor_ring_median_pop(med, values, true, 0));
+
+	while (med->lo_len > med->hi_len)
+		fwk_ec_sensor_ring_median_push(med, values, true,
+			fwk_ec_sensor_ring_median_pop(med, values, false, 0));
+}
+
+/* Add @values[@idx] to the median. */
+static void
+fwk_ec_sensor_ring_median_add(struct fwk_ec_sensors_ts_median *med,
+			      const s32 *values, u8 idx)
+{
+	bool hi = !med->hi_len || values[idx] >= values[med->hi[0]];
+
+	fwk_ec_sensor_ring_median_push(med, values, hi, idx);
+	fwk_ec_sensor_ring_median_balance(med, values);
+}
+
+/* Remove @values[@idx] from the median. */
+static void
+fwk_ec_sensor_ring_median_del(struct fwk_ec_sensors_ts_median *med,
+			      const s32 *values, u8 idx)
+{
+	u8 pos = med->pos[idx];
+
+	fwk_ec_sensor_ring_median_pop(med, values, pos & TS_MEDIAN_POS_HI,
+				      pos & ~TS_MEDIAN_POS_HI);
+	fwk_ec_sensor_ring_median_balance(med, values);
+}
+
+/*
+ * IRQ Timestamp Filtering
+ *
+ * Lower down in fwk_ec_sensor_ring_process_event(), for each sensor event
+ * we have to calculate it's timestamp in the AP timebase. There are 3 time
+ * points:
+ *   a - EC timebase, sensor event
+ *   b - EC timebase, IRQ
+ *   c - AP timebase, IRQ
+ *   a' - what we want: sensor even in AP timebase
+ *
+ * While a and b are recorded at accurate times (due to the EC real time
+ * nature); c is pretty untrustworthy, even though it's recorded the
+ * first thing in ec_irq_handler(). There is a very good change we'll get
+ * added latency due to:
+ *   other irqs
+ *   ddrfreq
+ *   cpuidle
+ *
+ * Normally a' = c - b + a, but if we do that naive math any jitter in c
+ * will get coupled in a', which we don't want. We want a function
+ * a' = fwk_ec_sensor_ring_ts_filter(a) which will filter out outliers in c.
+ *
+ * Think of a graph of AP time(b) on the y axis vs EC time(c) on the x axis.
+ * The slope of the line won't be exactly 1, there will be some clock drift
+ * between the 2 chips for various reasons (mechanical stress, temperature,
+ * voltage). We need to extrapolate values for a future x, without trusting
+ * recent y values too much.
+ *
+ * We use a median filter for the slope, then another median filter for the
+ * y-intercept to calculate this function:
+ *   dx[n] = x[n-1] - x[n]
+ *   dy[n] = x[n-1] - x[n]
+ *   m[n] = dy[n] / dx[n]
+ *   median_m = median(m[n-k:n])
+ *   error[i] = y[n-i] - median_m * x[n-i]
+ *   median_error = median(error[:k])
+ *   predicted_y = median_m * x + median_error
+ *
+ * Implementation differences from above:
+ * - Redefined y to be actually c - b, this gives us a lot more precision
+ * to do the math. (c-b)/b variations are more obvious than c/b variations.
+ * - Since we don't have floating point, any operations involving slope are
+ * done using fixed point math (*M_PRECISION)
+ * - Since x and y grow with time, the graph is kept relative to an origin
+ * (x_offset, y_offset) close to the samples, this way math involving
+ * *x[n-i] will not overflow, and the history fits in 32 bits
+ * - EC timestamps are kept in us, it improves the slope calculation precision
+ * - The errors are computed with the slope of the last fit, median_m, and
+ * their median kept up to date as entries come and go. They are only all
+ * computed again, with a new median_m, every so often when the median of m
+ * moved away (see TS_FIT_TOLERANCE_NS).
+ */
+
+/* Index of the i-th newest entry of the history rings. */
+static inline int
+fwk_ec_sensor_ring_ts_idx(const struct fwk_ec_sensors_ts_filter_state *state,
+			  int i)
+{
+	return (state->history_head - i) &
+	       (FWK_EC_SENSORHUB_TS_HISTORY_SIZE - 1);
+}
+
+static inline s32 fwk_ec_sensor_ring_ts_clamp(s64 val)
+{
+	return clamp_t(s64, val, S32_MIN, S32_MAX);
+}
+
+/* y-intercept of the entry at @idx, on a line of slope median_m. */
+static inline s32
+fwk_ec_sensor_ring_ts_error(const struct fwk_ec_sensors_ts_filter_state
+			    *state, int idx)
+{
+	return fwk_ec_sensor_ring_ts_clamp(state->y_history[idx] -
+		div_s64(state->median_m * state->x_history[idx], M_PRECISION));
+}
+
+/* Compute all the errors again, after median_m or the origin changed. */
+static void
+fwk_ec_sensor_ring_ts_filter_refit(struct fwk_ec_sensors_ts_filter_state
+				   *state)
+{
+	int i, idx;
+
+	memset(&state->error_median, 0, sizeof(state->error_median));
+	state->fit_age = 0;
+
+	for (i = 0; i < state->history_len; i++) {
+		idx = fwk_ec_sensor_ring_ts_idx(state, i);
+		state->error_history[idx] =
+			fwk_ec_sensor_ring_ts_error(state, idx);
+		fwk_ec_sensor_ring_median_add(&state->error_median,
+					      state->error_history, idx);
+	}
+}
+
+/*
+ * Move the origin of the history to (@x, @y). This only happens when the
+ * history would not fit in 32 bits anymore, so about every 18 minutes of
+ * continuous sensor activity.
+ */
+static void
+fwk_ec_sensor_ring_ts_filter_rebase(struct fwk_ec_sensors_ts_filter_state
+				    *state,
+				    s64 x, s64 y)
+{
+	int i, idx;
+
+	for (i = 0; i < state->history_len; i++) {
+		idx = fwk_ec_sensor_ring_ts_idx(state, i);
+		state->x_history[idx] = fwk_ec_sensor_ring_ts_clamp(
+			state->x_history[idx] + state->x_offset - x);
+		state->y_history[idx] = fwk_ec_sensor_ring_ts_clamp(
+			state->y_history[idx] + state->y_offset - y);
+	}
+
+	state->x_offset = x;
+	state->y_offset = y;
+
+	fwk_ec_sensor_ring_ts_filter_refit(state);
+}
+
+/**
+ * fwk_ec_sensor_ring_ts_filter_update() - Update filter history.
+ *
+ * @state: Filter information.
+ * @b: IRQ timestamp, EC timebase (us)
+ * @c: IRQ timestamp, AP timebase (ns)
+ *
+ * Given a new IRQ timestamp pair (EC and AP timebases), add it to the filter
+ * history.
+ *
+ * The history is a ring, so adding an entry does not move the others, and
+ * the medians of m and of the error are updated in O(log n). The errors
+ * only need a pass over the history when the slope of the fit changes, or
+ * the origin moves.
+ */
+static void
+fwk_ec_sensor_ring_ts_filter_update(struct fwk_ec_sensors_ts_filter_state
+				    *state,
+				    s64 b, s64 c)
+{
+	const int size = FWK_EC_SENSORHUB_TS_HISTORY_SIZE;
+	s64 x, y;
+	s64 dx = 0, dy = 0;
+	s64 m; /* stored as *M_PRECISION */
+	s64 last_x, last_y;
+	s64 span, m_tolerance;
+	int idx;
+
+	BUILD_BUG_ON(!is_power_of_2(FWK_EC_SENSORHUB_TS_HISTORY_SIZE));
+	BUILD_BUG_ON(FWK_EC_SENSORHUB_TS_HISTORY_SIZE > TS_MEDIAN_POS_HI);
+
+	/* we trust b the most, that'll be independent variable */
+	x = b;
+	/* y is the offset between AP and EC times, in ns */
+	y = c - b * 1000;
+
+	if (state->history_len) {
+		idx = state->history_head;
+		last_x = state->x_history[idx] + state->x_offset;
+		last_y = state->y_history[idx] + state->y_offset;
+
+		dx = last_x - x;
+		if (dx == 0)
+			return; /* we already have this irq in the history */
+		dy = last_y - y;
+
+		/* Empty filter if we haven't seen any action in a while. */
+		if (-dx > TS_HISTORY_BORED_US)
+			state->history_len = 0;
+	}
+
+	if (!state->history_len) {
+		state->x_offset = x;
+		state->y_offset = y;
+		memset(&state->m_median, 0, sizeof(state->m_median));
+		memset(&state->error_median, 0, sizeof(state->error_median));
+		state->median_m = 0;
+		state->median_error = 0;
+	} else if (abs(x - state->x_offset) > TS_HISTORY_REBASE_LIMIT ||
+		   abs(y - state->y_offset) > TS_HISTORY_REBASE_LIMIT) {
+		fwk_ec_sensor_ring_ts_filter_rebase(state, x, y);
+	}
+
+	idx = (state->history_head + 1) & (size - 1);
+
+	/*
+	 * The oldest entry is overwritten. Its m was not in the median, since
+	 * it came from an entry that already left the history; the m of the
+	 * next one leaves now for the same reason.
+	 */
+	if (state->history_len == size) {
+		fwk_ec_sensor_ring_median_del(&state->m_median,
+					      state->m_history,
+					      (idx + 1) & (size - 1));
+		fwk_ec_sensor_ring_median_del(&state->error_median,
+					      state->error_history, idx);
+	}
+
+	if (state->history_len) {
+		m = div64_s64(dy * M_PRECISION, dx);
+		state->m_history[idx] = fwk_ec_sensor_ring_ts_clamp(m);
+		fwk_ec_sensor_ring_median_add(&state->m_median,
+					      state->m_history, idx);
+	}
+
+	state->x_history[idx] = x - state->x_offset;
+	state->y_history[idx] = y - state->y_offset;
+	state->error_history[idx] = fwk_ec_sensor_ring_ts_error(state, idx);
+	fwk_ec_sensor_ring_median_add(&state->error_median,
+				      state->error_history, idx);
+	state->history_head = idx;
+
+	if (state->history_len < size)
+		state->history_len++;
+
+	/* Precalculate things for the filter. */
+	if (state->history_len > TS_HISTORY_THRESHOLD) {
+		m = state->m_history[state->m_median.hi[0]];
+
+		/*
+		 * Refit when using median_m rather than the median of m would
+		 * move the oldest entry by more than TS_FIT_TOLERANCE_NS, and
+		 * the last refit is old enough to amortize this one.
+		 */
+		span = (s64)state->x_history[idx] -
+		       state->x_history[fwk_ec_sensor_ring_ts_idx(state,
+					state->history_len - 1)];
+		span = max_t(s64, abs(span), 1);
+		m_tolerance = div64_s64((s64)TS_FIT_TOLERANCE_NS * M_PRECISION,
+					span);
+		if (state->fit_age < U8_MAX)
+			state->fit_age++;
+		if (abs(m - state->median_m) > m_tolerance &&
+		    state->fit_age >= state->history_len / TS_FIT_INTERVAL_DIV) {
+			state->median_m = m;
+			fwk_ec_sensor_ring_ts_filter_refit(state);
+		}
+
+		/* median_error is still in the offset coordinate system. */
+		state->median_error =
+			state->error_history[state->error_median.hi[0]];
+	} else {
+		state->median_error = 0;
+	}
+}
+
+/**
+ * fwk_ec_sensor_ring_ts_filter() - Translate EC timebase timestamp to AP
+ *                                  timebase
+ *
+ * @state: filter information.
+ * @x: any ec timestamp (in us).
+ *
+ * fwk_ec_sensor_ring_ts_filter(a) => a' event timestamp in AP timespace.
+ * Return: timestamp in AP timespace.
+ */
+static s64
+fwk_ec_sensor_ring_ts_filter(struct fwk_ec_sensors_ts_filter_state *state,
+			     s64 x)
+{
+	return div_s64(state->median_m * (x - state->x_offset), M_PRECISION)
+	       + state->median_error + state->y_offset + x * 1000;
+}
+
+/*
+ * Since a and b were originally 32 bit values from the EC,
+ * they overflow relatively often, casting is not enough, so we need to
+ * add an offset.
+ */
+static void
+fwk_ec_sensor_ring_fix_overflow(s64 *ts,
+				const s64 overflow_period,
+				struct fwk_ec_sensors_ec_overflow_state
+				*state)
+{
+	s64 adjust;
+
+	*ts += state->offset;
+	if (abs(state->last - *ts) > (overflow_period / 2)) {
+		adjust = state->last > *ts ? overflow_period : -overflow_period;
+		state->offset += adjust;
+		*ts += adjust;
+	}
+	state->last = *ts;
+}
+
+static void
+fwk_ec_sensor_ring_check_for_past_timestamp(struct fwk_ec_sensorhub
+					    *sensorhub,
+					    struct fwk_ec_sensors_ring_sample
+					    *sample)
+{
+	const u8 sensor_id = sample->sensor_id;
+
+	/* If this event is earlier than one we saw before... */
+	if (sensorhub->batch_state[sensor_id].newest_sensor_event >
+	    sample->timestamp)
+		/* mark it for spreading. */
+		sample->timestamp =
+			sensorhub->batch_state[sensor_id].last_ts;
+	else
+		sensorhub->batch_state[sensor_id].newest_sensor_event =
+			sample->timestamp;
+}
+
+/**
+ * fwk_ec_sensor_ring_process_event() - Process one EC FIFO event
+ *
+ * @sensorhub: Sensor Hub object.
+ * @fifo_info: FIFO information from the EC (includes b point, EC timebase).
+ * @fifo_timestamp: EC IRQ, kernel timebase (aka c).
+ * @current_timestamp: calculated event timestamp, kernel timebase (aka a').
+ * @in: incoming FIFO event from EC (includes a point, EC timebase).
+ * @out: outgoing event to user space (includes a').
+ *
+ * Process one EC event, add it in the ring if necessary.
+ *
+ * Return: true if out event has been populated.
+ */
+static bool
+fwk_ec_sensor_ring_process_event(struct fwk_ec_sensorhub *sensorhub,
+				 const struct ec_response_motion_sense_fifo_info
+				 *fifo_info,
+				 const ktime_t fifo_timestamp,
+				 ktime_t *current_timestamp,
+				 struct ec_response_motion_sensor_data *in,
+				 struct fwk_ec_sensors_ring_sample *out)
+{
+	const s64 now = fwk_ec_get_time_ns();
+	int axis, async_flags;
+
+	/* Do not populate the filter based on asynchronous events. */
+	async_flags = in->flags &
+		(MOTIONSENSE_SENSOR_FLAG_ODR | MOTIONSENSE_SENSOR_FLAG_FLUSH);
+
+	if (in->flags & MOTIONSENSE_SENSOR_FLAG_TIMESTAMP && !async_flags) {
+		s64 a = in->timestamp;
+		s64 b = fifo_info->timestamp;
+		s64 c = fifo_timestamp;
+
+		fwk_ec_sensor_ring_fix_overflow(&a, 1LL << 32,
+						&sensorhub->overflow_a);
+		fwk_ec_sensor_ring_fix_overflow(&b, 1LL << 32,
+						&sensorhub->overflow_b);
+
+		if (sensorhub->tight_timestamps) {
+			fwk_ec_sensor_ring_ts_filter_update(
+					&sensorhub->filter, b, c);
+			*current_timestamp = fwk_ec_sensor_ring_ts_filter(
+					&sensorhub->filter, a);
+		} else {
+			s64 new_timestamp;
+
+			/*
+			 * Disable filtering since we might add more jitter
+			 * if b is in a random point in time.
+			 */
+			new_timestamp = c - b * 1000 + a * 1000;
+			/*
+			 * The timestamp can be stale if we had to use the fifo
+			 * info timestamp.
+			 */
+			if (new_timestamp - *current_timestamp > 0)
+				*current_timestamp = new_timestamp;
+		}
+	}
+
+	if (in->flags & MOTIONSENSE_SENSOR_FLAG_ODR) {
+		if (sensorhub->tight_timestamps) {
+			sensorhub->batch_state[in->sensor_num].last_len = 0;
+			sensorhub->batch_state[in->sensor_num].penul_len = 0;
+		}
+		/*
+		 * ODR change is only useful for the sensor_ring, it does not
+		 * convey information to clients.
+		 */
+		return false;
+	}
+
+	if (in->flags & MOTIONSENSE_SENSOR_FLAG_FLUSH) {
+		out->sensor_id = in->sensor_num;
+		out->timestamp = *current_timestamp;
+		out->flag = in->flags;
+		if (sensorhub->tight_timestamps)
+			sensorhub->batch_state[out->sensor_id].last_len = 0;
+		/*
+		 * No other payload information provided with
+		 * flush ack.
+		 */
+		return true;
+	}
+
+	if (in->flags & MOTIONSENSE_SENSOR_FLAG_TIMESTAMP)
+		/* If we just have a timestamp, skip this entry. */
+		return false;
+
+	/* Regular sample */
+	out->sensor_id = in->sensor_num;
+
+	if (*current_timestamp - now > 0) {
+		/*
+		 * This fix is needed to overcome the timestamp filter putting
+		 * events in the future.
+		 */
+		sensorhub->future_timestamp_total_ns +=
+			*current_timestamp - now;
+		if (++sensorhub->future_timestamp_count ==
+				FUTURE_TS_ANALYTICS_COUNT_MAX) {
+			s64 avg = div_s64(sensorhub->future_timestamp_total_ns,
+					sensorhub->future_timestamp_count);
+			dev_warn_ratelimited(sensorhub->dev,
+					     "100 timestamps in the future, %lldns shaved on average\n",
+					     avg);
+			sensorhub->future_timestamp_count = 0;
+			sensorhub->future_timestamp_total_ns = 0;
+		}
+		out->timestamp = now;
+	} else {
+		out->timestamp = *current_timestamp;
+	}
+
+	out->flag = in->flags;
+	for (axis = 0; axis < 3; axis++)
+		out->vector[axis] = in->data[axis];
+
+	if (sensorhub->tight_timestamps)
+		fwk_ec_sensor_ring_check_for_past_timestamp(sensorhub, out);
+	return true;
+}
+
+/*
+ * fwk_ec_sensor_ring_unpack: Sort the samples read from the FIFO by sensor.
+ *
+ * The samples are copied from the ring into sensorhub->batch, one array per
+ * field, the samples of each sensor being contiguous and in FIFO order.
+ * Spreading and pushing a sensor then only walks its own samples.
+ */
+static void
+fwk_ec_sensor_ring_unpack(struct fwk_ec_sensorhub *sensorhub,
+			  struct fwk_ec_sensors_ring_sample *last_out)
+{
+	struct fwk_ec_sensors_ring_batch *batch = &sensorhub->batch;
+	unsigned int *offset = sensorhub->batch_offset;
+	struct fwk_ec_sensors_ring_sample *in;
+	unsigned int i, pos;
+
+	memset(offset, 0, (sensorhub->sensor_num + 1) * sizeof(*offset));
+
+	for (in = sensorhub->ring; in < last_out; in++)
+		if (in->sensor_id < sensorhub->sensor_num)
+			offset[in->sensor_id + 1]++;
+
+	for (i = 1; i <= sensorhub->sensor_num; i++)
+		offset[i] += offset[i - 1];
+
+	for (in = sensorhub->ring; in < last_out; in++) {
+		if (in->sensor_id >= sensorhub->sensor_num)
+			continue;
+
+		pos = offset[in->sensor_id]++;
+		batch->axis[0][pos] = in->vector[0];
+		batch->axis[1][pos] = in->vector[1];
+		batch->axis[2][pos] = in->vector[2];
+		batch->timestamp[pos] = in->timestamp;
+		batch->flag[pos] = in->flag;
+	}
+
+	/* Each offset now points at the end of its sensor, move them back. */
+	for (i = sensorhub->sensor_num; i > 0; i--)
+		offset[i] = offset[i - 1];
+	offset[0] = 0;
+}
+
+/* Get the samples of sensor @id out of sensorhub->batch. */
+static void
+fwk_ec_sensor_ring_batch_get(struct fwk_ec_sensorhub *sensorhub, int id,
+			     struct fwk_ec_sensors_ring_batch *batch)
+{
+	unsigned int start = sensorhub->batch_offset[id];
+	int axis;
+
+	batch->len = sensorhub->batch_offset[id + 1] - start;
+	for (axis = 0; axis < 3; axis++)
+		batch->axis[axis] = sensorhub->batch.axis[axis] + start;
+	batch->timestamp = sensorhub->batch.timestamp + start;
+	batch->flag = sensorhub->batch.flag + start;
+}
+
+/* Keep sample @from of @batch for pushing, as sample @to. */
+static inline void
+fwk_ec_sensor_ring_batch_keep(struct fwk_ec_sensors_ring_batch *batch,
+			      int from, int to)
+{
+	int axis;
+
+	if (from == to)
+		return;
+
+	for (axis = 0; axis < 3; axis++)
+		batch->axis[axis][to] = batch->axis[axis][from];
+	batch->timestamp[to] = batch->timestamp[from];
+	batch->flag[to] = batch->flag[from];
+}
+
+/*
+ * fwk_ec_sensor_ring_spread: Calculate proper timestamps of the samples of
+ *                            one sensor.
+ *
+ * This is the new spreading code, assumes every sample's timestamp
+ * precedes the sample. Run if tight_timestamps == true.
+ *
+ * Sometimes the EC receives only one interrupt (hence timestamp) for
+ * a batch of samples. Only the first sample will have the correct
+ * timestamp. So we must interpolate the other samples.
+ * We use the previous batch timestamp and our current batch timestamp
+ * as a way to calculate period, then spread the samples evenly.
+ *
+ * s0 int, 0ms
+ * s1 int, 10ms
+ * s2 int, 20ms
+ * 30ms point goes by, no interrupt, previous one is still asserted
+ * downloading s2 and s3
+ * s3 sample, 20ms (incorrect timestamp)
+ * s4 int, 40ms
+ *
+ * The batches are [(s0), (s1), (s2, s3), (s4)]. Since the 3rd batch
+ * has 2 samples in them, we adjust the timestamp of s3.
+ * s2 - s1 = 10ms, so s3 must be s2 + 10ms => 20ms. If s1 would have
+ * been part of a bigger batch things would have gotten a little
+ * more complicated.
+ *
+ * Note: we also assume another sensor sample doesn't break up a batch
+ * in 2 or more partitions. Example, there can't ever be a sync sensor
+ * in between S2 and S3. This simplifies the following code.
+ *
+ * The samples to push are packed at the start of @batch.
+ *
+ * Return: the number of samples to push.
+ */
+static int
+fwk_ec_sensor_ring_spread(struct fwk_ec_sensorhub *sensorhub, int id,
+			  struct fwk_ec_sensors_ring_batch *batch)
+{
+	struct fwk_ec_sensors_ts_batch_state *state =
+		&sensorhub->batch_state[id];
+	int start, end, next, i, out = 0;
+
+	for (start = 0; start < batch->len; start = next) {
+		/*
+		 * For each batch (where all samples have the same
+		 * timestamp).
+		 */
+		s64 batch_timestamp = batch->timestamp[start];
+		int batch_len, sample_idx, spread_start;
+		s64 sample_period;
+
+		next = start + 1;
+
+		/*
+		 * Do not start a batch from a flush, as it happens
+		 * asynchronously to the regular flow of events. Flushes
+		 * carry no data for the IIO devices.
+		 */
+		if (batch->flag[start] & MOTIONSENSE_SENSOR_FLAG_FLUSH)
+			continue;
+
+		if (batch_timestamp <= state->last_ts) {
+			/* Continuation of the last batch. */
+			batch_timestamp = state->last_ts;
+			batch_len = state->last_len;
+
+			sample_idx = batch_len;
+			spread_start = start;
+
+			state->last_ts = state->penul_ts;
+			state->last_len = state->penul_len;
+		} else {
+			/*
+			 * The first sample in the batch is guaranteed to be
+			 * correct, the rest will follow later on.
+			 */
+			sample_idx = 1;
+			batch_len = 1;
+			fwk_ec_sensor_ring_batch_keep(batch, start, out++);
+			spread_start = start + 1;
+		}
+
+		/* Find all samples have the same timestamp. */
+		for (end = spread_start; end < batch->len; end++) {
+			if (batch->timestamp[end] != batch_timestamp)
+				/* we discovered the next batch */
+				break;
+			if (batch->flag[end] & MOTIONSENSE_SENSOR_FLAG_FLUSH)
+				/* break on flush packets */
+				break;
+			batch_len++;
+		}
+		next = max(end, start + 1);
+
+		if (batch_len == 1)
+			goto done_with_this_batch;
+
+		/* Can we calculate period? */
+		if (state->last_len == 0) {
+			dev_warn(sensorhub->dev, "Sensor %d: lost %d samples when spreading\n",
+				 id, batch_len - 1);
+			goto done_with_this_batch;
+			/*
+			 * Note: we're dropping the rest of the samples
+			 * in this batch since we have no idea where
+			 * they're supposed to go without a period
+			 * calculation.
+			 */
+		}
+
+		sample_period = div_s64(batch_timestamp - state->last_ts,
+					state->last_len);
+		dev_dbg(sensorhub->dev,
+			"Adjusting %d samples, sensor %d last_batch @%lld (%d samples) batch_timestamp=%lld => period=%lld\n",
+			batch_len, id, state->last_ts, state->last_len,
+			batch_timestamp, sample_period);
+
+		/* Adjust timestamps of the rest of the batch. */
+		for (i = spread_start; i < next; i++) {
+			batch->timestamp[i] = batch_timestamp +
+				sample_period * sample_idx;
+			sample_idx++;
+			fwk_ec_sensor_ring_batch_keep(batch, i, out++);
+		}
+
+done_with_this_batch:
+		state->penul_ts = state->last_ts;
+		state->penul_len = state->last_len;
+
+		state->last_ts = batch_timestamp;
+		state->last_len = batch_len;
+	}
+
+	return out;
+}
+
+/*
+ * fwk_ec_sensor_ring_spread_legacy: Calculate proper timestamps of the
+ * samples of one sensor (legacy).
+ *
+ * Note: This assumes we're running old firmware, where timestamp
+ * is inserted after its sample(s)e. There can be several samples between
+ * timestamps, so several samples can have the same timestamp.
+ *
+ *                        timestamp | count
+ *                        -----------------
+ *          1st sample --> TS1      | 1
+ *                         TS2      | 2
+ *                         TS2      | 3
+ *                         TS3      | 4
+ *           last_out -->
+ *
+ *
+ * We spread time for the samples using period p = (current - TS1)/4.
+ * between TS1 and TS2: [TS1+p/4, TS1+2p/4, TS1+3p/4, current_timestamp].
+ *
+ * The samples to push are packed at the start of @batch.
+ *
+ * Return: the number of samples to push.
+ */
+static int
+fwk_ec_sensor_ring_spread_legacy(struct fwk_ec_sensors_ring_batch *batch,
+				 s64 current_timestamp)
+{
+	s64 timestamp = batch->timestamp[0];
+	s64 time_period;
+	int i, out = 0;
+
+	/* Spread uniformly between the first and last samples. */
+	time_period = div_s64(current_timestamp - timestamp, batch->len);
+
+	for (i = 0; i < batch->len; i++) {
+		timestamp += time_period;
+		batch->timestamp[i] = timestamp;
+		if (!(batch->flag[i] & MOTIONSENSE_SENSOR_FLAG_FLUSH))
+			fwk_ec_sensor_ring_batch_keep(batch, i, out++);
+	}
+
+	return out;
+}
+
+/*
+ * Hand the samples to the IIO device: all at once if it registered a batch
+ * callback, one by one otherwise.
+ */
+static void
+fwk_ec_sensor_ring_push(struct fwk_ec_sensorhub *sensorhub, int id,
+			struct fwk_ec_sensors_ring_batch *batch)
+{
+	struct fwk_ec_sensorhub_sensor_push_data *push_data =
+		&sensorhub->push_data[id];
+	s16 vector[3];
+	int i, axis;
+
+	if (!batch->len)
+		return;
+
+	if (push_data->push_batch_cb) {
+		push_data->push_batch_cb(push_data->indio_dev, batch);
+		return;
+	}
+
+	if (!push_data->push_data_cb)
+		return;
+
+	for (i = 0; i < batch->len; i++) {
+		for (axis = 0; axis < 3; axis++)
+			vector[axis] = batch->axis[axis][i];
+		push_data->push_data_cb(push_data->indio_dev, vector,
+					batch->timestamp[i]);
+	}
+}
+
+/*
+ * Largest number of vectors a single FIFO_READ response can carry. The EC
+ * truncates larger requests to its response buffer anyway, so asking for
+ * more only costs extra bytes on the bus. The response buffer may also
+ * have grown past msg since probe, after a sysjump.
+ */
+static u32 fwk_ec_sensorhub_fifo_read_max(struct fwk_ec_sensorhub *sensorhub)
+{
+	struct fwk_ec_device *ec_dev = sensorhub->ec->ec_dev;
+
+	return (min(ec_dev->max_response, sensorhub->msg_size) -
+		sizeof(sensorhub->resp->fifo_read)) /
+	       sizeof(struct ec_response_motion_sensor_data);
+}
+
+/**
+ * fwk_ec_sensorhub_ring_handler() - The trigger handler function
+ *
+ * @sensorhub: Sensor Hub object.
+ *
+ * Called by the notifier, process the EC sensor FIFO queue.
+ *
+ * The FIFO information (when vectors were lost) and all the FIFO_READ
+ * requests are sent in a single EC lock session, so that draining the FIFO
+ * is not interleaved with other EC users.
+ */
+static void fwk_ec_sensorhub_ring_handler(struct fwk_ec_sensorhub *sensorhub)
+{
+	struct ec_response_motion_sense_fifo_info *fifo_info =
+		sensorhub->fifo_info;
+	struct fwk_ec_dev *ec = sensorhub->ec;
+	struct fwk_ec_device *ec_dev = ec->ec_dev;
+	ktime_t fifo_timestamp, current_timestamp;
+	int i, j, number_data, ret;
+	struct ec_response_motion_sensor_data *in;
+	struct fwk_ec_sensors_ring_sample *out, *last_out;
+	u32 read_max = fwk_ec_sensorhub_fifo_read_max(sensorhub);
+
+	mutex_lock(&sensorhub->cmd_lock);
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret) {
+		dev_warn(sensorhub->dev, "cannot lock EC: %d\n", ret);
+		goto error;
+	}
+
+	/* Get FIFO information if there are lost vectors. */
+	if (fifo_info->total_lost) {
+		int fifo_info_length =
+			sizeof(struct ec_response_motion_sense_fifo_info) +
+			sizeof(u16) * sensorhub->sensor_num;
+
+		/* Need to retrieve the number of lost vectors per sensor */
+		sensorhub->params->cmd = MOTIONSENSE_CMD_FIFO_INFO;
+		sensorhub->msg->outsize = 1;
+		sensorhub->msg->insize = fifo_info_length;
+
+		if (fwk_ec_cmd_xfer_status_locked(ec_dev, sensorhub->msg) < 0)
+			goto error_ec_unlock;
+
+		memcpy(fifo_info, &sensorhub->resp->fifo_info,
+		       fifo_info_length);
+
+		/*
+		 * Update collection time, will not be as precise as the
+		 * non-error case.
+		 */
+		fifo_timestamp = fwk_ec_get_time_ns();
+	} else {
+		fifo_timestamp = sensorhub->fifo_timestamp[
+			FWK_EC_SENSOR_NEW_TS];
+	}
+
+	if (fifo_info->count > sensorhub->fifo_size ||
+	    fifo_info->size != sensorhub->fifo_size) {
+		dev_warn(sensorhub->dev,
+			 "Mismatch EC data: count %d, size %d - expected %d\n",
+			 fifo_info->count, fifo_info->size,
+			 sensorhub->fifo_size);
+		goto error_ec_unlock;
+	}
+
+	/* Copy elements in the main fifo */
+	current_timestamp = sensorhub->fifo_timestamp[FWK_EC_SENSOR_LAST_TS];
+	out = sensorhub->ring;
+	for (i = 0; i < fifo_info->count; i += number_data) {
+		sensorhub->params->cmd = MOTIONSENSE_CMD_FIFO_READ;
+		sensorhub->params->fifo_read.max_data_vector =
+			min_t(u32, fifo_info->count - i, read_max);
+		sensorhub->msg->outsize =
+			sizeof(struct ec_params_motion_sense);
+		sensorhub->msg->insize =
+			sizeof(sensorhub->resp->fifo_read) +
+			sensorhub->params->fifo_read.max_data_vector *
+			  sizeof(struct ec_response_motion_sensor_data);
+		ret = fwk_ec_cmd_xfer_status_locked(ec_dev, sensorhub->msg);
+		if (ret < 0) {
+			dev_warn(sensorhub->dev, "Fifo error: %d\n", ret);
+			break;
+		}
+		number_data = sensorhub->resp->fifo_read.number_data;
+		if (number_data == 0) {
+			dev_dbg(sensorhub->dev, "Unexpected empty FIFO\n");
+			break;
+		}
+		if (number_data > fifo_info->count - i) {
+			dev_warn(sensorhub->dev,
+				 "Invalid EC data: too many entry received: %d, expected %d\n",
+				 number_data, fifo_info->count - i);
+			break;
+		}
+		if (out + number_data >
+		    sensorhub->ring + fifo_info->count) {
+			dev_warn(sensorhub->dev,
+				 "Too many samples: %d (%zd data) to %d entries for expected %d entries\n",
+				 i, out - sensorhub->ring, i + number_data,
+				 fifo_info->count);
+			break;
+		}
+
+		for (in = sensorhub->resp->fifo_read.data, j = 0;
+		     j < number_data; j++, in++) {
+			if (fwk_ec_sensor_ring_process_event(
+						sensorhub, fifo_info,
+						fifo_timestamp,
+						&current_timestamp,
+						in, out))
+				out++;
+		}
+	}
+	ec_dev->ec_mutex_unlock(ec_dev);
+	mutex_unlock(&sensorhub->cmd_lock);
+	last_out = out;
+
+	if (out == sensorhub->ring)
+		/* Unexpected empty FIFO. */
+		goto ring_handler_end;
+
+	/*
+	 * Check if current_timestamp is ahead of the last sample. Normally,
+	 * the EC appends a timestamp after the last sample, but if the AP
+	 * is slow to respond to the IRQ, the EC may have added new samples.
+	 * Use the FIFO info timestamp as last timestamp then.
+	 */
+	if (!sensorhub->tight_timestamps &&
+	    (last_out - 1)->timestamp == current_timestamp)
+		current_timestamp = fifo_timestamp;
+
+	/* Warn on lost samples. */
+	if (fifo_info->total_lost)
+		for (i = 0; i < sensorhub->sensor_num; i++) {
+			if (fifo_info->lost[i]) {
+				dev_warn_ratelimited(sensorhub->dev,
+						     "Sensor %d: lost: %d out of %d\n",
+						     i, fifo_info->lost[i],
+						     fifo_info->total_lost);
+				if (sensorhub->tight_timestamps)
+					sensorhub->batch_state[i].last_len = 0;
+			}
+		}
+
+	/*
+	 * Sort the samples by sensor, spread them in case of batching, then
+	 * push them to the IIO devices.
+	 */
+	fwk_ec_sensor_ring_unpack(sensorhub, last_out);
+
+	for (i = 0; i < sensorhub->sensor_num; i++) {
+		struct fwk_ec_sensors_ring_batch batch;
+
+		fwk_ec_sensor_ring_batch_get(sensorhub, i, &batch);
+		if (!batch.len)
+			continue;
+
+		if (sensorhub->tight_timestamps)
+			batch.len = fwk_ec_sensor_ring_spread(sensorhub, i,
+							      &batch);
+		else
+			batch.len = fwk_ec_sensor_ring_spread_legacy(&batch,
+							current_timestamp);
+
+		fwk_ec_sensor_ring_push(sensorhub, i, &batch);
+	}
+
+ring_handler_end:
+	sensorhub->fifo_timestamp[FWK_EC_SENSOR_LAST_TS] = current_timestamp;
+	return;
+
+error_ec_unlock:
+	ec_dev->ec_mutex_unlock(ec_dev);
+error:
+	mutex_unlock(&sensorhub->cmd_lock);
+}
+
+static int fwk_ec_sensorhub_event(struct notifier_block *nb,
+				  unsigned long queued_during_suspend,
+				  void *_notify)
+{
+	struct fwk_ec_sensorhub *sensorhub;
+	struct fwk_ec_device *ec_dev;
+
+	sensorhub = container_of(nb, struct fwk_ec_sensorhub, notifier);
+	ec_dev = sensorhub->ec->ec_dev;
+
+	if (ec_dev->event_data.event_type != EC_MKBP_EVENT_SENSOR_FIFO)
+		return NOTIFY_DONE;
+
+	if (ec_dev->event_size != sizeof(ec_dev->event_data.data.sensor_fifo)) {
+		dev_warn(ec_dev->dev, "Invalid fifo info size\n");
+		return NOTIFY_DONE;
+	}
+
+	if (queued_during_suspend)
+		return NOTIFY_OK;
+
+	memcpy(sensorhub->fifo_info, &ec_dev->event_data.data.sensor_fifo.info,
+	       sizeof(*sensorhub->fifo_info));
+	sensorhub->fifo_timestamp[FWK_EC_SENSOR_NEW_TS] =
+		ec_dev->last_event_time;
+	fwk_ec_sensorhub_ring_handler(sensorhub);
+
+	return NOTIFY_OK;
+}
+
+/**
+ * fwk_ec_sensorhub_ring_allocate() - Prepare the FIFO functionality if the EC
+ *				       supports it.
+ *
+ * @sensorhub : Sensor Hub object.
+ *
+ * Return: 0 on success.
+ */
+int fwk_ec_sensorhub_ring_allocate(struct fwk_ec_sensorhub *sensorhub)
+{
+	int fifo_info_length =
+		sizeof(struct ec_response_motion_sense_fifo_info) +
+		sizeof(u16) * sensorhub->sensor_num;
+
+	/* Allocate the array for lost events. */
+	sensorhub->fifo_info = devm_kzalloc(sensorhub->dev, fifo_info_length,
+					    GFP_KERNEL);
+	if (!sensorhub->fifo_info)
+		return -ENOMEM;
+
+	/*
+	 * Allocate the callback area based on the number of sensors.
+	 * Add one for the sensor ring.
+	 */
+	sensorhub->push_data = devm_kcalloc(sensorhub->dev,
+			sensorhub->sensor_num,
+			sizeof(*sensorhub->push_data),
+			GFP_KERNEL);
+	if (!sensorhub->push_data)
+		return -ENOMEM;
+
+	sensorhub->tight_timestamps = fwk_ec_check_features(
+			sensorhub->ec,
+			EC_FEATURE_MOTION_SENSE_TIGHT_TIMESTAMPS);
+
+	if (sensorhub->tight_timestamps) {
+		sensorhub->batch_state = devm_kcalloc(sensorhub->dev,
+				sensorhub->sensor_num,
+				sizeof(*sensorhub->batch_state),
+				GFP_KERNEL);
+		if (!sensorhub->batch_state)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Allocate the arrays the samples are sorted into by sensor, large enough for
+ * a full FIFO.
+ */
+static int
+fwk_ec_sensorhub_ring_batch_allocate(struct fwk_ec_sensorhub *sensorhub)
+{
+	struct fwk_ec_sensors_ring_batch *batch = &sensorhub->batch;
+	struct device *dev = sensorhub->dev;
+	int size = sensorhub->fifo_size;
+	int axis;
+
+	for (axis = 0; axis < 3; axis++) {
+		batch->axis[axis] = devm_kcalloc(dev, size,
+						 sizeof(*batch->axis[axis]),
+						 GFP_KERNEL);
+		if (!batch->axis[axis])
+			return -ENOMEM;
+	}
+
+	batch->timestamp = devm_kcalloc(dev, size, sizeof(*batch->timestamp),
+					GFP_KERNEL);
+	batch->flag = devm_kcalloc(dev, size, sizeof(*batch->flag),
+				   GFP_KERNEL);
+	sensorhub->batch_offset = devm_kcalloc(dev, sensorhub->sensor_num + 1,
+					       sizeof(*sensorhub->batch_offset),
+					       GFP_KERNEL);
+	if (!batch->timestamp || !batch->flag || !sensorhub->batch_offset)
+		return -ENOMEM;
+
+	batch->len = size;
+
+	return 0;
+}
+
+/**
+ * fwk_ec_sensorhub_ring_add() - Add the FIFO functionality if the EC
+ *				  supports it.
+ *
+ * @sensorhub : Sensor Hub object.
+ *
+ * Return: 0 on success.
+ */
+int fwk_ec_sensorhub_ring_add(struct fwk_ec_sensorhub *sensorhub)
+{
+	struct fwk_ec_dev *ec = sensorhub->ec;
+	int ret;
+	int fifo_info_length =
+		sizeof(struct ec_response_motion_sense_fifo_info) +
+		sizeof(u16) * sensorhub->sensor_num;
+
+	/* Retrieve FIFO information */
+	sensorhub->msg->version = 2;
+	sensorhub->params->cmd = MOTIONSENSE_CMD_FIFO_INFO;
+	sensorhub->msg->outsize = 1;
+	sensorhub->msg->insize = fifo_info_length;
+
+	ret = fwk_ec_cmd_xfer_status(ec->ec_dev, sensorhub->msg);
+	if (ret < 0)
+		return ret;
+
+	/*
+	 * Allocate the full fifo. We need to copy the whole FIFO to set
+	 * timestamps properly.
+	 */
+	sensorhub->fifo_size = sensorhub->resp->fifo_info.size;
+	sensorhub->ring = devm_kcalloc(sensorhub->dev, sensorhub->fifo_size,
+				       sizeof(*sensorhub->ring), GFP_KERNEL);
+	if (!sensorhub->ring)
+		return -ENOMEM;
+
+	ret = fwk_ec_sensorhub_ring_batch_allocate(sensorhub);
+	if (ret)
+		return ret;
+
+	sensorhub->fifo_timestamp[FWK_EC_SENSOR_LAST_TS] =
+		fwk_ec_get_time_ns();
+
+	/* Register the notifier that will act as a top half interrupt. */
+	sensorhub->notifier.notifier_call = fwk_ec_sensorhub_event;
+	ret = blocking_notifier_chain_register(&ec->ec_dev->event_notifier,
+					       &sensorhub->notifier);
+	if (ret < 0)
+		return ret;
+
+	/* Start collection samples. */
+	return fwk_ec_sensorhub_ring_fifo_enable(sensorhub, true);
+}
+
+void fwk_ec_sensorhub_ring_remove(void *arg)
+{
+	struct fwk_ec_sensorhub *sensorhub = arg;
+	struct fwk_ec_device *ec_dev = sensorhub->ec->ec_dev;
+
+	blocking_notifier_chain_unregister(&ec_dev->event_notifier,
+					   &sensorhub->notifier);
+	fwk_ec_sensorhub_ring_fifo_enable(sensorhub, false);
+}
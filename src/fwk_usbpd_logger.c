@@ -0,0 +1,561 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Logging driver for ChromeOS EC based USBPD Charger.
+ *
+ * The EC keeps a log of PD events, handed out one entry per
+ * EC_CMD_PD_GET_LOG_ENTRY. When the EC signals PD activity, all the pending
+ * entries are drained in one EC lock session and stored in a ring buffer,
+ * which is read through a debugfs file. Each open file has its own cursor
+ * in the ring, so several readers can follow the log independently.
+ */
+
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/notifier.h>
+#include <fwk_ec_commands.h>
+#include <fwk_ec_proto.h>
+#include <linux/platform_device.h>
+#include <linux/poll.h>
+#include <linux/rtc.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#define DRV_NAME		"fwk-usbpd-logger"
+#define FWK_USBPD_MAX_LOG_ENTRIES	30
+#define FWK_USBPD_LOG_UPDATE_DELAY	msecs_to_jiffies(60000)
+#define FWK_USBPD_DATA_SIZE		16
+#define FWK_USBPD_LOG_RESP_SIZE	(sizeof(struct ec_response_pd_log) + \
+					 FWK_USBPD_DATA_SIZE)
+#define FWK_USBPD_BUFFER_SIZE		(sizeof(struct fwk_ec_command) + \
+					 FWK_USBPD_LOG_RESP_SIZE)
+/* Number of entries kept for the readers, a power of 2. */
+#define FWK_USBPD_RING_SIZE		256
+
+/* Buffer for building the PDLOG string */
+#define BUF_SIZE	80
+/* Buffer for a whole line: date, port and PDLOG string */
+#define LINE_SIZE	(BUF_SIZE + 48)
+
+/**
+ * struct fwk_usbpd_log_entry - A PD log entry, as stored in the ring.
+ * @time: Wall clock time of the event.
+ * @type: Event type, see PD_EVENT_*.
+ * @size_port: Port number and payload size.
+ * @data: Type-defined data.
+ * @payload: Optional additional data.
+ */
+struct fwk_usbpd_log_entry {
+	ktime_t time;
+	u8 type;
+	u8 size_port;
+	u16 data;
+	u8 payload[FWK_USBPD_DATA_SIZE];
+};
+
+/**
+ * struct logger_data - Logger driver data.
+ * @dev: Device, mostly used for logging.
+ * @ec_dev: EC device the log is read from.
+ * @ec_buffer: Command buffer for EC_CMD_PD_GET_LOG_ENTRY.
+ * @log_work: Drains the EC log, on PD events and on a slow poll.
+ * @notifier: EC event notifier, for EC_HOST_EVENT_PD_MCU.
+ * @drained: Entries read in the last drain, before they are published.
+ * @lock: Protects @ring and @head.
+ * @ring: The last FWK_USBPD_RING_SIZE entries.
+ * @head: Number of entries ever stored; the next one goes in
+ *        @ring[@head % FWK_USBPD_RING_SIZE].
+ * @wq: Readers waiting for new entries.
+ * @file: The debugfs file.
+ */
+struct logger_data {
+	struct device *dev;
+	struct fwk_ec_dev *ec_dev;
+	u8 ec_buffer[FWK_USBPD_BUFFER_SIZE];
+	struct delayed_work log_work;
+	struct notifier_block notifier;
+	struct fwk_usbpd_log_entry drained[FWK_USBPD_MAX_LOG_ENTRIES];
+	struct mutex lock;
+	struct fwk_usbpd_log_entry ring[FWK_USBPD_RING_SIZE];
+	u64 head;
+	wait_queue_head_t wq;
+	struct dentry *file;
+};
+
+/**
+ * struct logger_reader - State of an open log file.
+ * @logger: Logger driver data.
+ * @cursor: Sequence number of the next entry to read.
+ * @line: Formatted line not entirely read yet.
+ * @line_len: Length of @line.
+ * @line_off: Offset of the unread part of @line.
+ */
+struct logger_reader {
+	struct logger_data *logger;
+	u64 cursor;
+	char line[LINE_SIZE];
+	int line_len;
+	int line_off;
+};
+
+static struct dentry *fwk_usbpd_logger_dir;
+
+static const char * const chg_type_names[] = {
+	"None", "PD", "Type-C", "Proprietary", "DCP", "CDP", "SDP",
+	"Other", "VBUS"
+};
+
+static const char * const role_names[] = {
+	"Disconnected", "SRC", "SNK", "SNK (not charging)"
+};
+
+static const char * const fault_names[] = {
+	"---", "OCP", "fast OCP", "OVP", "Discharge"
+};
+
+__printf(3, 4)
+static int append_str(char *buf, int pos, const char *fmt, ...)
+{
+	va_list args;
+	int i;
+
+	va_start(args, fmt);
+	i = vsnprintf(buf + pos, BUF_SIZE - pos, fmt, args);
+	va_end(args);
+
+	return i;
+}
+
+static int fwk_usbpd_format_log_entry(const struct fwk_usbpd_log_entry *r,
+				      char *line, size_t size)
+{
+	const char *fault, *role, *chg_type;
+	const struct usb_chg_measures *meas;
+	const struct mcdp_info *minfo;
+	int role_idx, type_idx;
+	char buf[BUF_SIZE + 1];
+	struct rtc_time rt;
+	int len = 0;
+	s32 rem;
+	int i;
+
+	buf[0] = '\0';
+	rt = rtc_ktime_to_tm(r->time);
+
+	switch (r->type) {
+	case PD_EVENT_MCU_CHARGE:
+		if (r->data & CHARGE_FLAGS_OVERRIDE)
+			len += append_str(buf, len, "override ");
+
+		if (r->data & CHARGE_FLAGS_DELAYED_OVERRIDE)
+			len += append_str(buf, len, "pending_override ");
+
+		role_idx = r->data & CHARGE_FLAGS_ROLE_MASK;
+		role = role_idx < ARRAY_SIZE(role_names) ?
+			role_names[role_idx] : "Unknown";
+
+		type_idx = (r->data & CHARGE_FLAGS_TYPE_MASK)
+			 >> CHARGE_FLAGS_TYPE_SHIFT;
+
+		chg_type = type_idx < ARRAY_SIZE(chg_type_names) ?
+			chg_type_names[type_idx] : "???";
+
+		if (role_idx == USB_PD_PORT_POWER_DISCONNECTED ||
+		    role_idx == USB_PD_PORT_POWER_SOURCE) {
+			len += append_str(buf, len, "%s", role);
+			break;
+		}
+
+		meas = (const struct usb_chg_measures *)r->payload;
+		len += append_str(buf, len, "%s %s %s %dmV max %dmV / %dmA",
+				  role,	r->data & CHARGE_FLAGS_DUAL_ROLE ?
+				  "DRP" : "Charger",
+				  chg_type, meas->voltage_now,
+				  meas->voltage_max, meas->current_max);
+		break;
+	case PD_EVENT_ACC_RW_FAIL:
+		len += append_str(buf, len, "RW signature check failed");
+		break;
+	case PD_EVENT_PS_FAULT:
+		fault = r->data < ARRAY_SIZE(fault_names) ? fault_names[r->data]
+							  : "???";
+		len += append_str(buf, len, "Power supply fault: %s", fault);
+		break;
+	case PD_EVENT_VIDEO_DP_MODE:
+		len += append_str(buf, len, "DP mode %sabled", r->data == 1 ?
+				  "en" : "dis");
+		break;
+	case PD_EVENT_VIDEO_CODEC:
+		minfo = (const struct mcdp_info *)r->payload;
+		len += append_str(buf, len, "HDMI info: family:%04x chipid:%04x ",
+				  MCDP_FAMILY(minfo->family),
+				  MCDP_CHIPID(minfo->chipid));
+		len += append_str(buf, len, "irom:%d.%d.%d fw:%d.%d.%d",
+				  minfo->irom.major, minfo->irom.minor,
+				  minfo->irom.build, minfo->fw.major,
+				  minfo->fw.minor, minfo->fw.build);
+		break;
+	default:
+		len += append_str(buf, len, "Event %02x (%04x) [", r->type,
+				  r->data);
+
+		for (i = 0; i < PD_LOG_SIZE(r->size_port); i++)
+			len += append_str(buf, len, "%02x ", r->payload[i]);
+
+		len += append_str(buf, len, "]");
+		break;
+	}
+
+	div_s64_rem(ktime_to_ms(r->time), MSEC_PER_SEC, &rem);
+	return scnprintf(line, size,
+			 "PDLOG %d/%02d/%02d %02d:%02d:%02d.%03d P%d %s\n",
+			 rt.tm_year + 1900, rt.tm_mon + 1, rt.tm_mday,
+			 rt.tm_hour, rt.tm_min, rt.tm_sec, rem,
+			 PD_LOG_PORT(r->size_port), buf);
+}
+
+/*
+ * Read all the pending log entries in a single EC lock session.
+ *
+ * The EC timestamps entries with their age, in 1024th of a second, at the
+ * time they are read. Each entry is dated from the middle of its own
+ * command, which cancels out the transfer time on average.
+ *
+ * Return: the number of entries read.
+ */
+static int fwk_usbpd_log_drain(struct logger_data *logger)
+{
+	struct fwk_ec_device *ec_dev = logger->ec_dev->ec_dev;
+	struct fwk_ec_command *msg = (struct fwk_ec_command *)logger->ec_buffer;
+	struct ec_response_pd_log *r = (struct ec_response_pd_log *)msg->data;
+	struct fwk_usbpd_log_entry *entry;
+	ktime_t before, after;
+	int entries = 0;
+	int ret;
+
+	ret = ec_dev->ec_mutex_lock(ec_dev);
+	if (ret)
+		return 0;
+
+	while (entries < FWK_USBPD_MAX_LOG_ENTRIES) {
+		msg->version = 0;
+		msg->command = logger->ec_dev->cmd_offset +
+			       EC_CMD_PD_GET_LOG_ENTRY;
+		msg->outsize = 0;
+		msg->insize = FWK_USBPD_LOG_RESP_SIZE;
+
+		before = ktime_get_real();
+		ret = fwk_ec_cmd_xfer_status_locked(ec_dev, msg);
+		after = ktime_get_real();
+		if (ret < 0) {
+			dev_dbg(logger->dev, "Cannot get PD status %d\n", ret);
+			break;
+		}
+
+		if (r->type == PD_EVENT_NO_ENTRY)
+			break;
+
+		entry = &logger->drained[entries++];
+		entry->time = ktime_add_ns(before,
+					   ktime_to_ns(ktime_sub(after, before)) >> 1);
+		entry->time = ktime_sub_us(entry->time, (u64)r->timestamp <<
+						       PD_LOG_TIMESTAMP_SHIFT);
+		entry->type = r->type;
+		entry->size_port = r->size_port;
+		entry->data = r->data;
+		memcpy(entry->payload, r->payload,
+		       min_t(int, PD_LOG_SIZE(r->size_port),
+			     FWK_USBPD_DATA_SIZE));
+	}
+
+	ec_dev->ec_mutex_unlock(ec_dev);
+
+	return entries;
+}
+
+static void fwk_usbpd_log_check(struct work_struct *work)
+{
+	struct logger_data *logger = container_of(to_delayed_work(work),
+						  struct logger_data,
+						  log_work);
+	int entries, i;
+
+	entries = fwk_usbpd_log_drain(logger);
+
+	if (entries) {
+		mutex_lock(&logger->lock);
+		for (i = 0; i < entries; i++) {
+			logger->ring[logger->head % FWK_USBPD_RING_SIZE] =
+				logger->drained[i];
+			logger->head++;
+		}
+		mutex_unlock(&logger->lock);
+
+		wake_up_interruptible(&logger->wq);
+	}
+
+	/* A full drain may have left entries behind, come back for those. */
+	schedule_delayed_work(&logger->log_work,
+			      entries == FWK_USBPD_MAX_LOG_ENTRIES ?
+			      0 : FWK_USBPD_LOG_UPDATE_DELAY);
+}
+
+static int fwk_usbpd_log_event(struct notifier_block *nb,
+			       unsigned long queued_during_suspend,
+			       void *_notify)
+{
+	struct logger_data *logger = container_of(nb, struct logger_data,
+						  notifier);
+	u32 host_event = fwk_ec_get_host_event(logger->ec_dev->ec_dev);
+
+	if (!(host_event & EC_HOST_EVENT_MASK(EC_HOST_EVENT_PD_MCU)))
+		return NOTIFY_DONE;
+
+	mod_delayed_work(system_wq, &logger->log_work, 0);
+
+	return NOTIFY_OK;
+}
+
+static int fwk_usbpd_log_open(struct inode *inode, struct file *file)
+{
+	struct logger_data *logger = inode->i_private;
+	struct logger_reader *reader;
+
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+
+	reader->logger = logger;
+
+	/* Start with the oldest entry still in the ring. */
+	mutex_lock(&logger->lock);
+	if (logger->head > FWK_USBPD_RING_SIZE)
+		reader->cursor = logger->head - FWK_USBPD_RING_SIZE;
+	mutex_unlock(&logger->lock);
+
+	file->private_data = reader;
+
+	return stream_open(inode, file);
+}
+
+static int fwk_usbpd_log_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+
+	return 0;
+}
+
+/*
+ * Format the next line for @reader into its line buffer.
+ *
+ * LOCKING: the caller holds the logger lock, and there is an entry to read.
+ */
+static void fwk_usbpd_log_next_line(struct logger_reader *reader)
+{
+	struct logger_data *logger = reader->logger;
+	u64 oldest = 0;
+
+	if (logger->head > FWK_USBPD_RING_SIZE)
+		oldest = logger->head - FWK_USBPD_RING_SIZE;
+
+	reader->line_off = 0;
+
+	/* The entries were overwritten before this reader got to them. */
+	if (reader->cursor < oldest) {
+		reader->line_len = scnprintf(reader->line,
+					     sizeof(reader->line),
+					     "PDLOG %llu entries lost\n",
+					     oldest - reader->cursor);
+		reader->cursor = oldest;
+		return;
+	}
+
+	reader->line_len = fwk_usbpd_format_log_entry(
+		&logger->ring[reader->cursor % FWK_USBPD_RING_SIZE],
+		reader->line, sizeof(reader->line));
+	reader->cursor++;
+}
+
+static ssize_t fwk_usbpd_log_read(struct file *file, char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	struct logger_reader *reader = file->private_data;
+	struct logger_data *logger = reader->logger;
+	size_t done = 0;
+	size_t len;
+	int ret;
+
+	mutex_lock(&logger->lock);
+
+	while (reader->line_off == reader->line_len &&
+	       reader->cursor == logger->head) {
+		mutex_unlock(&logger->lock);
+
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(logger->wq,
+				reader->cursor != READ_ONCE(logger->head));
+		if (ret < 0)
+			return ret;
+
+		mutex_lock(&logger->lock);
+	}
+
+	while (done < count) {
+		if (reader->line_off == reader->line_len) {
+			if (reader->cursor == logger->head)
+				break;
+			fwk_usbpd_log_next_line(reader);
+		}
+
+		len = min_t(size_t, count - done,
+			    reader->line_len - reader->line_off);
+		if (copy_to_user(buf + done, reader->line + reader->line_off,
+				 len)) {
+			mutex_unlock(&logger->lock);
+			return done ? done : -EFAULT;
+		}
+
+		reader->line_off += len;
+		done += len;
+	}
+
+	mutex_unlock(&logger->lock);
+
+	return done;
+}
+
+static __poll_t fwk_usbpd_log_poll(struct file *file, poll_table *wait)
+{
+	struct logger_reader *reader = file->private_data;
+	struct logger_data *logger = reader->logger;
+	__poll_t mask = 0;
+
+	poll_wait(file, &logger->wq, wait);
+
+	mutex_lock(&logger->lock);
+	if (reader->line_off != reader->line_len ||
+	    reader->cursor != logger->head)
+		mask |= EPOLLIN | EPOLLRDNORM;
+	mutex_unlock(&logger->lock);
+
+	return mask;
+}
+
+static const struct file_operations fwk_usbpd_log_fops = {
+	.owner = THIS_MODULE,
+	.open = fwk_usbpd_log_open,
+	.read = fwk_usbpd_log_read,
+	.llseek = no_llseek,
+	.poll = fwk_usbpd_log_poll,
+	.release = fwk_usbpd_log_release,
+};
+
+static int fwk_usbpd_logger_probe(struct platform_device *pd)
+{
+	struct fwk_ec_dev *ec_dev = dev_get_drvdata(pd->dev.parent);
+	struct fwk_ec_platform *ec_platform = dev_get_platdata(ec_dev->dev);
+	struct device *dev = &pd->dev;
+	struct logger_data *logger;
+	int ret;
+
+	logger = devm_kzalloc(dev, sizeof(*logger), GFP_KERNEL);
+	if (!logger)
+		return -ENOMEM;
+
+	logger->dev = dev;
+	logger->ec_dev = ec_dev;
+	mutex_init(&logger->lock);
+	init_waitqueue_head(&logger->wq);
+
+	platform_set_drvdata(pd, logger);
+
+	INIT_DELAYED_WORK(&logger->log_work, fwk_usbpd_log_check);
+
+	logger->notifier.notifier_call = fwk_usbpd_log_event;
+	ret = blocking_notifier_chain_register(&ec_dev->ec_dev->event_notifier,
+					       &logger->notifier);
+	if (ret)
+		return ret;
+
+	logger->file = debugfs_create_file(ec_platform->ec_name, 0444,
+					   fwk_usbpd_logger_dir, logger,
+					   &fwk_usbpd_log_fops);
+
+	/* Pick up what the EC logged before we were loaded. */
+	schedule_delayed_work(&logger->log_work, 0);
+
+	return 0;
+}
+
+static void fwk_usbpd_logger_remove(struct platform_device *pd)
+{
+	struct logger_data *logger = platform_get_drvdata(pd);
+
+	debugfs_remove(logger->file);
+	blocking_notifier_chain_unregister(&logger->ec_dev->ec_dev->event_notifier,
+					   &logger->notifier);
+	cancel_delayed_work_sync(&logger->log_work);
+}
+
+static int __maybe_unused fwk_usbpd_logger_resume(struct device *dev)
+{
+	struct logger_data *logger = dev_get_drvdata(dev);
+
+	schedule_delayed_work(&logger->log_work, 0);
+
+	return 0;
+}
+
+static int __maybe_unused fwk_usbpd_logger_suspend(struct device *dev)
+{
+	struct logger_data *logger = dev_get_drvdata(dev);
+
+	cancel_delayed_work_sync(&logger->log_work);
+
+	return 0;
+}
+
+static SIMPLE_DEV_PM_OPS(fwk_usbpd_logger_pm_ops, fwk_usbpd_logger_suspend,
+			 fwk_usbpd_logger_resume);
+
+static struct platform_driver fwk_usbpd_logger_driver = {
+	.driver = {
+		.name = DRV_NAME,
+		.pm = &fwk_usbpd_logger_pm_ops,
+	},
+	.probe = fwk_usbpd_logger_probe,
+	.remove_new = fwk_usbpd_logger_remove,
+};
+
+static int __init fwk_usbpd_logger_init(void)
+{
+	int ret;
+
+	fwk_usbpd_logger_dir = debugfs_create_dir("fwk_usbpd_logger", NULL);
+
+	ret = platform_driver_register(&fwk_usbpd_logger_driver);
+	if (ret)
+		debugfs_remove_recursive(fwk_usbpd_logger_dir);
+
+	return ret;
+}
+
+static void __exit fwk_usbpd_logger_exit(void)
+{
+	platform_driver_unregister(&fwk_usbpd_logger_driver);
+	debugfs_remove_recursive(fwk_usbpd_logger_dir);
+}
+
+module_init(fwk_usbpd_logger_init);
+module_exit(fwk_usbpd_logger_exit);
+
+MODULE_LICENSE("GPL v2");
+MODULE_DESCRIPTION("Logging driver for ChromeOS EC USBPD Charger.");
+MODULE_ALIAS("platform:" DRV_NAME);
@@ -0,0 +1,312 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ChromeOS EC Power Delivery Notifier Driver
+ *
+ * This driver serves as the receiver of fwk_ec PD host events.
+ *
+ * A single negotiation makes the EC raise a burst of PD host events. They
+ * are coalesced: the first one opens a settling window, and the PD host
+ * event status is read and sent to the notifier chain once, when the
+ * window closes. The EC accumulates the status bits in the meantime, so
+ * nothing is lost.
+ */
+
+#include <linux/acpi.h>
+#include <linux/jiffies.h>
+#include <linux/module.h>
+#include <fwk_ec_commands.h>
+#include <fwk_ec_proto.h>
+#include <fwk_usbpd_notify.h>
+#include <linux/platform_device.h>
+#include <linux/workqueue.h>
+
+#define DRV_NAME "fwk-usbpd-notify"
+#define DRV_NAME_PLAT_ACPI "fwk-usbpd-notify-acpi"
+#define ACPI_DRV_NAME FWK_USBPD_NOTIFY_ACPI_HID
+
+static unsigned int settle_ms = 20;
+module_param(settle_ms, uint, 0644);
+MODULE_PARM_DESC(settle_ms,
+		 "Time to wait for more PD events before notifying (ms)");
+
+static BLOCKING_NOTIFIER_HEAD(fwk_usbpd_notifier_list);
+
+/**
+ * struct fwk_usbpd_notify_data - PD notifier driver data.
+ * @dev: Device, mostly used for logging.
+ * @ec: EC device to read the PD host event status from, may be NULL.
+ * @nb: EC event notifier.
+ * @work: Work reading the status and notifying, once events settled.
+ */
+struct fwk_usbpd_notify_data {
+	struct device *dev;
+	struct fwk_ec_device *ec;
+	struct notifier_block nb;
+	struct delayed_work work;
+};
+
+/**
+ * fwk_usbpd_register_notify - Register a notifier callback for PD events.
+ * @nb: Notifier block pointer to register
+ *
+ * On ACPI platforms this corresponds to host events on the ECPD
+ * "GOOG0003" ACPI device. On non-ACPI platforms this will filter mkbp events
+ * for USB PD events.
+ *
+ * Return: 0 on success or negative error code.
+ */
+int fwk_usbpd_register_notify(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_register(&fwk_usbpd_notifier_list,
+						nb);
+}
+EXPORT_SYMBOL_GPL(fwk_usbpd_register_notify);
+
+/**
+ * fwk_usbpd_unregister_notify - Unregister notifier callback for PD events.
+ * @nb: Notifier block pointer to unregister
+ *
+ * Unregister a notifier callback that was previously registered with
+ * fwk_usbpd_register_notify().
+ */
+void fwk_usbpd_unregister_notify(struct notifier_block *nb)
+{
+	blocking_notifier_chain_unregister(&fwk_usbpd_notifier_list, nb);
+}
+EXPORT_SYMBOL_GPL(fwk_usbpd_unregister_notify);
+
+static void fwk_usbpd_get_event_and_notify(struct device *dev,
+					   struct fwk_ec_device *ec_dev)
+{
+	struct ec_response_host_event_status host_event_status;
+	u32 event = 0;
+	int ret;
+
+	/*
+	 * We still send a 0 event out to older devices which don't
+	 * have the updated device heirarchy.
+	 */
+	if (!ec_dev) {
+		dev_dbg(dev,
+			"EC device inaccessible; sending 0 event status.\n");
+		goto send_notify;
+	}
+
+	/* Check for PD host events on EC. */
+	ret = fwk_ec_cmd(ec_dev, 0, EC_CMD_PD_HOST_EVENT_STATUS,
+			 NULL, 0, &host_event_status, sizeof(host_event_status));
+	if (ret < 0) {
+		dev_warn(dev, "Can't get host event status (err: %d)\n", ret);
+		goto send_notify;
+	}
+
+	event = host_event_status.status;
+
+send_notify:
+	blocking_notifier_call_chain(&fwk_usbpd_notifier_list, event, NULL);
+}
+
+static void fwk_usbpd_notify_work(struct work_struct *work)
+{
+	struct fwk_usbpd_notify_data *pdnotify =
+		container_of(to_delayed_work(work),
+			     struct fwk_usbpd_notify_data, work);
+
+	fwk_usbpd_get_event_and_notify(pdnotify->dev, pdnotify->ec);
+}
+
+/*
+ * Open a settling window, unless one is already open, in which case this
+ * event is folded into the pending notification.
+ */
+static void fwk_usbpd_notify_schedule(struct fwk_usbpd_notify_data *pdnotify)
+{
+	schedule_delayed_work(&pdnotify->work,
+			      msecs_to_jiffies(READ_ONCE(settle_ms)));
+}
+
+#ifdef CONFIG_ACPI
+
+static void fwk_usbpd_notify_acpi(acpi_handle device, u32 event, void *data)
+{
+	struct fwk_usbpd_notify_data *pdnotify = data;
+
+	/* These PD events bypass the EC core, tell it about them. */
+	if (pdnotify->ec)
+		fwk_ec_typec_invalidate(pdnotify->ec, -1);
+
+	fwk_usbpd_notify_schedule(pdnotify);
+}
+
+static int fwk_usbpd_notify_probe_acpi(struct platform_device *pdev)
+{
+	struct fwk_usbpd_notify_data *pdnotify;
+	struct device *dev = &pdev->dev;
+	struct acpi_device *adev;
+	struct fwk_ec_device *ec_dev;
+	acpi_status status;
+
+	adev = ACPI_COMPANION(dev);
+
+	pdnotify = devm_kzalloc(dev, sizeof(*pdnotify), GFP_KERNEL);
+	if (!pdnotify)
+		return -ENOMEM;
+
+	/* Get the EC device pointer needed to talk to the EC. */
+	ec_dev = dev_get_drvdata(dev->parent);
+	if (!ec_dev) {
+		/*
+		 * We continue even for older devices which don't have the
+		 * correct device heirarchy, namely, GOOG0003 is a child
+		 * of GOOG0004.
+		 */
+		dev_warn(dev, "Couldn't get Chrome EC device pointer.\n");
+	}
+
+	pdnotify->dev = dev;
+	pdnotify->ec = ec_dev;
+	INIT_DELAYED_WORK(&pdnotify->work, fwk_usbpd_notify_work);
+
+	platform_set_drvdata(pdev, pdnotify);
+
+	status = acpi_install_notify_handler(adev->handle,
+					     ACPI_ALL_NOTIFY,
+					     fwk_usbpd_notify_acpi,
+					     pdnotify);
+	if (ACPI_FAILURE(status)) {
+		dev_warn(dev, "Failed to register notify handler %08x\n",
+			 status);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void fwk_usbpd_notify_remove_acpi(struct platform_device *pdev)
+{
+	struct device *dev = &pdev->dev;
+	struct acpi_device *adev = ACPI_COMPANION(dev);
+	struct fwk_usbpd_notify_data *pdnotify = platform_get_drvdata(pdev);
+
+	acpi_remove_notify_handler(adev->handle, ACPI_ALL_NOTIFY,
+				   fwk_usbpd_notify_acpi);
+	cancel_delayed_work_sync(&pdnotify->work);
+}
+
+static const struct acpi_device_id fwk_usbpd_notify_acpi_device_ids[] = {
+	{ ACPI_DRV_NAME, 0 },
+	{ }
+};
+MODULE_DEVICE_TABLE(acpi, fwk_usbpd_notify_acpi_device_ids);
+
+static struct platform_driver fwk_usbpd_notify_acpi_driver = {
+	.driver = {
+		.name = DRV_NAME_PLAT_ACPI,
+		.acpi_match_table = fwk_usbpd_notify_acpi_device_ids,
+	},
+	.probe = fwk_usbpd_notify_probe_acpi,
+	.remove_new = fwk_usbpd_notify_remove_acpi,
+};
+
+#endif /* CONFIG_ACPI */
+
+static int fwk_usbpd_notify_plat(struct notifier_block *nb,
+				 unsigned long queued_during_suspend,
+				 void *data)
+{
+	struct fwk_usbpd_notify_data *pdnotify = container_of(nb,
+			struct fwk_usbpd_notify_data, nb);
+	struct fwk_ec_device *ec_dev = (struct fwk_ec_device *)data;
+	u32 host_event = fwk_ec_get_host_event(ec_dev);
+
+	if (!host_event)
+		return NOTIFY_DONE;
+
+	if (host_event & (EC_HOST_EVENT_MASK(EC_HOST_EVENT_PD_MCU) |
+			  EC_HOST_EVENT_MASK(EC_HOST_EVENT_USB_MUX))) {
+		fwk_usbpd_notify_schedule(pdnotify);
+		return NOTIFY_OK;
+	}
+	return NOTIFY_DONE;
+}
+
+static int fwk_usbpd_notify_probe_plat(struct platform_device *pdev)
+{
+	struct device *dev = &pdev->dev;
+	struct fwk_ec_dev *ecdev = dev_get_drvdata(dev->parent);
+	struct fwk_usbpd_notify_data *pdnotify;
+	int ret;
+
+	pdnotify = devm_kzalloc(dev, sizeof(*pdnotify), GFP_KERNEL);
+	if (!pdnotify)
+		return -ENOMEM;
+
+	pdnotify->dev = dev;
+	pdnotify->ec = ecdev->ec_dev;
+	pdnotify->nb.notifier_call = fwk_usbpd_notify_plat;
+	INIT_DELAYED_WORK(&pdnotify->work, fwk_usbpd_notify_work);
+
+	dev_set_drvdata(dev, pdnotify);
+
+	ret = blocking_notifier_chain_register(&ecdev->ec_dev->event_notifier,
+					       &pdnotify->nb);
+	if (ret < 0) {
+		dev_err(dev, "Failed to register notifier\n");
+		return ret;
+	}
+
+	return 0;
+}
+
+static void fwk_usbpd_notify_remove_plat(struct platform_device *pdev)
+{
+	struct device *dev = &pdev->dev;
+	struct fwk_ec_dev *ecdev = dev_get_drvdata(dev->parent);
+	struct fwk_usbpd_notify_data *pdnotify =
+		(struct fwk_usbpd_notify_data *)dev_get_drvdata(dev);
+
+	blocking_notifier_chain_unregister(&ecdev->ec_dev->event_notifier,
+					   &pdnotify->nb);
+	cancel_delayed_work_sync(&pdnotify->work);
+}
+
+static struct platform_driver fwk_usbpd_notify_plat_driver = {
+	.driver = {
+		.name = DRV_NAME,
+	},
+	.probe = fwk_usbpd_notify_probe_plat,
+	.remove_new = fwk_usbpd_notify_remove_plat,
+};
+
+static int __init fwk_usbpd_notify_init(void)
+{
+	int ret;
+
+	ret = platform_driver_register(&fwk_usbpd_notify_plat_driver);
+	if (ret < 0)
+		return ret;
+
+#ifdef CONFIG_ACPI
+	ret = platform_driver_register(&fwk_usbpd_notify_acpi_driver);
+	if (ret) {
+		platform_driver_unregister(&fwk_usbpd_notify_plat_driver);
+		return ret;
+	}
+#endif
+	return 0;
+}
+
+static void __exit fwk_usbpd_notify_exit(void)
+{
+#ifdef CONFIG_ACPI
+	platform_driver_unregister(&fwk_usbpd_notify_acpi_driver);
+#endif
+	platform_driver_unregister(&fwk_usbpd_notify_plat_driver);
+}
+
+module_init(fwk_usbpd_notify_init);
+module_exit(fwk_usbpd_notify_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("ChromeOS power delivery notifier device");
+MODULE_ALIAS("platform:" DRV_NAME);
@@ -10,6 +10,9 @@
 
 #include <linux/notifier.h>
 
+/* ACPI device delivering the PD events, on ChromeOS devices. */
+#define FWK_USBPD_NOTIFY_ACPI_HID "GOOG0003"
+
 int fwk_usbpd_register_notify(struct notifier_block *nb);
 
 void fwk_usbpd_unregister_notify(struct notifier_block *nb);